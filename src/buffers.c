@@ -7,6 +7,8 @@
 
 #ifndef DOSLIKE			// no #include <sys/select.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif // !DOSLIKE
 
 /* If this include file is missing, you need the pcre package,
@@ -14,6 +16,8 @@
 #include <pcre.h>
 static bool pcre_utf8_error_stop = false;
 
+#include <pthread.h>
+
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -34,7 +38,7 @@ static char lsformat[12];	/* size date etc on a directory listing */
 static uchar endMarks;		/* ^ $ on printed lines */
 static bool jexmode;
 /* The valid edbrowse commands. */
-static const char valid_cmd[] = "aAbBcdDefghHijJklmMnpqrstuvwXz=^<";
+static const char valid_cmd[] = "aAbBcdDefghHijJklmMnpqrstuUvwXz=^<";
 /* Commands that can be done in browse mode. */
 static const char browse_cmd[] = "AbBdDefghHiklMnpqsvwXz=^<";
 /* Commands for sql mode. */
@@ -42,11 +46,11 @@ static const char sql_cmd[] = "AadDefghHiklmnpqrsvwXz=^<";
 /* Commands for directory mode. */
 static const char dir_cmd[] = "AbdDefghHklmnpqsvwXz=^<";
 /* Commands that work at line number 0, in an empty file. */
-static const char zero_cmd[] = "aAbefhHMqruwz=^<";
+static const char zero_cmd[] = "aAbefhHMqruUwz=^<";
 /* Commands that expect a space afterward. */
 static const char spaceplus_cmd[] = "befrw";
 /* Commands that should have no text after them. */
-static const char nofollow_cmd[] = "aAcdDhHjlmnptuX=";
+static const char nofollow_cmd[] = "aAcdDhHjlmnptuUX=";
 /* Commands that can be done after a g// global directive. */
 static const char global_cmd[] = "dDijJlmnpstX";
 
@@ -57,6 +61,7 @@ static char cmd, scmd;
 static uchar subPrint;		/* print lines after substitutions */
 static bool noStack;		/* don't stack up edit sessions */
 static bool globSub;		/* in the midst of a g// command */
+static bool subMarked;		/* s/// can take the marked lines at once */
 static bool inscript;		/* run from inside an edbrowse function */
 static int lastq, lastqq;
 static char icmd;		/* input command, usually the same as cmd */
@@ -136,6 +141,349 @@ addchar:
 	*t = c;			/* terminating character */
 }				/* removeHiddenNumbers */
 
+/*********************************************************************
+Manage the index of lines in a buffer, see struct lineIndex in eb.h.
+These routines shuffle lineMap structures about; they never allocate
+or free the text of a line, that is the caller's business.
+Lines are numbered from 1, as in ed.
+Two indexes can share a chunk, as the undo snapshot shares most of its
+chunks with the buffer. A chunk is copied the first time either index
+wants to change it, see mapOwn().
+*********************************************************************/
+
+static struct lineChunk *chunkAlloc(int cap)
+{
+	struct lineChunk *k;
+	if (cap > LINECHUNK)
+		cap = LINECHUNK;
+	k = allocMem(sizeof(struct lineChunk) - (LINECHUNK - cap) * LMSIZE);
+	k->n = 0;
+	k->cap = cap;
+	k->ref = 1;
+	k->mark = 0;
+	return k;
+}				/* chunkAlloc */
+
+/* one less index holds this chunk */
+static void chunkRelease(struct lineChunk *k)
+{
+	if (--k->ref == 0)
+		free(k);
+}				/* chunkRelease */
+
+/* make room for cap lines in this chunk, which could move it */
+static struct lineChunk *chunkGrow(struct lineChunk *k, int cap)
+{
+	if (cap <= k->cap)
+		return k;
+	if (cap < 2 * k->cap)
+		cap = 2 * k->cap;
+	if (cap > LINECHUNK)
+		cap = LINECHUNK;
+	k = reallocMem(k,
+		       sizeof(struct lineChunk) - (LINECHUNK - cap) * LMSIZE);
+	k->cap = cap;
+	return k;
+}				/* chunkGrow */
+
+static struct lineIndex *mapNew(void)
+{
+	return allocZeroMem(sizeof(struct lineIndex));
+}				/* mapNew */
+
+/* Free the index and its chunks, but not the text of the lines. */
+static void mapFree(struct lineIndex *x)
+{
+	int i;
+	if (!x)
+		return;
+	for (i = 0; i < x->nchunks; ++i)
+		chunkRelease(x->chunks[i]);
+	nzFree(x->chunks);
+	nzFree(x->starts);
+	free(x);
+}				/* mapFree */
+
+/*********************************************************************
+Chunk c has changed; the starting line numbers from c onward are stale.
+Don't fix them now; g/re/d deletes lines from the top of the buffer
+to the bottom, and renumbering every chunk after every delete
+makes that quadratic. Remember how far the numbers are good,
+and mapFind() brings them up to date, only as far as it has to.
+x->count is kept up to date by the callers.
+*********************************************************************/
+
+static void mapRenumber(struct lineIndex *x, int c)
+{
+	if (x->valid > c)
+		x->valid = c;
+	if (x->hint >= x->valid)
+		x->hint = 0;
+}				/* mapRenumber */
+
+/* open up n slots in the chunk array at position c */
+static void mapOpenChunks(struct lineIndex *x, int c, int n)
+{
+	if (x->nchunks + n > x->allocChunks) {
+		int a = x->allocChunks * 2;
+		if (a < x->nchunks + n)
+			a = x->nchunks + n + 8;
+		if (x->chunks) {
+			x->chunks = reallocMem(x->chunks, a * sizeof(void *));
+			x->starts = reallocMem(x->starts, a * sizeof(int));
+		} else {
+			x->chunks = allocMem(a * sizeof(void *));
+			x->starts = allocMem(a * sizeof(int));
+		}
+		x->allocChunks = a;
+	}
+	memmove(x->chunks + c + n, x->chunks + c,
+		(x->nchunks - c) * sizeof(void *));
+	x->nchunks += n;
+}				/* mapOpenChunks */
+
+/* close n slots in the chunk array at position c; chunks are not freed */
+static void mapCloseChunks(struct lineIndex *x, int c, int n)
+{
+	memmove(x->chunks + c, x->chunks + c + n,
+		(x->nchunks - c - n) * sizeof(void *));
+	x->nchunks -= n;
+}				/* mapCloseChunks */
+
+/* Which chunk holds line n?  n must be in range. */
+static int mapFind(struct lineIndex *x, int n)
+{
+	int lo, hi, mid, ln;
+	struct lineChunk **k = x->chunks;
+	int *s = x->starts;
+
+/* renumber the stale chunks, up to the one holding n */
+	mid = x->valid;
+	if (mid < x->nchunks && (!mid || s[mid - 1] + k[mid - 1]->n < n)) {
+		ln = (mid ? s[mid - 1] + k[mid - 1]->n : 0);
+		while (mid < x->nchunks) {
+			s[mid] = ln;
+			ln += k[mid++]->n;
+			if (ln >= n)
+				break;
+		}
+		x->valid = mid;
+		return (x->hint = mid - 1);
+	}
+
+/* sequential access, line after line, is the common case */
+	mid = x->hint;
+	if (n > s[mid] && n <= s[mid] + k[mid]->n)
+		return mid;
+	++mid;
+	if (mid < x->valid && n > s[mid] && n <= s[mid] + k[mid]->n)
+		return (x->hint = mid);
+
+	lo = 0, hi = x->valid - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (s[mid] < n)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (x->hint = lo);
+}				/* mapFind */
+
+/* Chunk c is about to change; if another index shares it, make our own copy. */
+static struct lineChunk *mapOwn(struct lineIndex *x, int c)
+{
+	struct lineChunk *k = x->chunks[c], *k2;
+	if (k->ref == 1)
+		return k;
+	k2 = chunkAlloc(k->n);
+	k2->n = k->n;
+	memcpy(k2->lines, k->lines, k->n * LMSIZE);
+	--k->ref;
+	return (x->chunks[c] = k2);
+}				/* mapOwn */
+
+/* Return the lineMap structure for line n.
+ * The chunk could be shared with the undo snapshot, so don't change
+ * the text pointer through this; use mapLineWrite().
+ * gflag is fair game, it's just a scratch mark for g//. */
+struct lineMap *mapLine(struct lineIndex *x, int n)
+{
+	int c;
+	if (!x || n <= 0 || n > x->count)
+		i_printfExit(MSG_InvalidLineNb, n);
+	c = mapFind(x, n);
+	return x->chunks[c]->lines + n - x->starts[c] - 1;
+}				/* mapLine */
+
+/* line n, in a chunk that belongs to this index alone */
+struct lineMap *mapLineWrite(struct lineIndex *x, int n)
+{
+	int c;
+	if (!x || n <= 0 || n > x->count)
+		i_printfExit(MSG_InvalidLineNb, n);
+	c = mapFind(x, n);
+	return mapOwn(x, c)->lines + n - x->starts[c] - 1;
+}				/* mapLineWrite */
+
+/* Insert nlines lineMap structures after line destl. */
+static void mapInsert(struct lineIndex *x, int destl,
+		      const struct lineMap *piece, int nlines)
+{
+	struct lineChunk *k, *tail = 0;
+	int c, o, m, nnew;
+
+	if (nlines <= 0)
+		return;
+
+	if (!x->nchunks) {
+		mapOpenChunks(x, 0, 1);
+		x->chunks[0] = chunkAlloc(nlines);
+		c = o = 0;
+	} else if (destl == x->count) {
+		c = x->nchunks - 1;
+		o = x->chunks[c]->n;
+	} else {
+		c = mapFind(x, destl + 1);
+		o = destl - x->starts[c];
+	}
+	k = mapOwn(x, c);
+
+/* the easy case, it fits in the chunk */
+	if (k->n + nlines <= LINECHUNK) {
+		k = x->chunks[c] = chunkGrow(k, k->n + nlines);
+		memmove(k->lines + o + nlines, k->lines + o,
+			(k->n - o) * LMSIZE);
+		memcpy(k->lines + o, piece, nlines * LMSIZE);
+		k->n += nlines;
+		x->count += nlines;
+		mapRenumber(x, c);
+		return;
+	}
+
+/* Split the chunk at o, fill the first half with new lines,
+ * then new chunks as needed, then the second half. */
+	if (o < k->n) {
+		tail = chunkAlloc(k->n - o);
+		tail->n = k->n - o;
+		memcpy(tail->lines, k->lines + o, tail->n * LMSIZE);
+		k->n = o;
+	}
+	m = LINECHUNK - k->n;
+	if (m > nlines)
+		m = nlines;
+	k = x->chunks[c] = chunkGrow(k, k->n + m);
+	memcpy(k->lines + k->n, piece, m * LMSIZE);
+	k->n += m;
+	piece += m, nlines -= m;
+	x->count += m + nlines;
+
+	nnew = (nlines + LINECHUNK - 1) / LINECHUNK + (tail != 0);
+	mapOpenChunks(x, c + 1, nnew);
+	while (nlines) {
+		m = (nlines > LINECHUNK ? LINECHUNK : nlines);
+		k = x->chunks[++c] = chunkAlloc(m);
+		memcpy(k->lines, piece, m * LMSIZE);
+		k->n = m;
+		piece += m, nlines -= m;
+	}
+	if (tail)
+		x->chunks[++c] = tail;
+	mapRenumber(x, c - nnew);
+}				/* mapInsert */
+
+/* Merge chunk c with the chunk after it, if they fit together. */
+static void mapMerge(struct lineIndex *x, int c)
+{
+	struct lineChunk *k, *k2;
+	if (c + 1 >= x->nchunks)
+		return;
+	k = x->chunks[c];
+	k2 = x->chunks[c + 1];
+	if (k->n + k2->n > LINECHUNK)
+		return;
+	k = mapOwn(x, c);
+	k = x->chunks[c] = chunkGrow(k, k->n + k2->n);
+	memcpy(k->lines + k->n, k2->lines, k2->n * LMSIZE);
+	k->n += k2->n;
+	chunkRelease(k2);
+	mapCloseChunks(x, c + 1, 1);
+}				/* mapMerge */
+
+/* Remove lines start through end from the index. */
+static void mapDelete(struct lineIndex *x, int start, int end)
+{
+	struct lineChunk *k;
+	int c, c0, o, m, gone = 0;
+	int n = end - start + 1;
+
+	if (n <= 0)
+		return;
+	c = c0 = mapFind(x, start);
+	o = start - x->starts[c] - 1;
+	x->count -= n;
+	while (n) {
+		k = x->chunks[c];
+		m = k->n - o;
+		if (m > n)
+			m = n;
+		n -= m;
+		if (m == k->n) {
+/* the whole chunk goes, no need to copy it if it is shared */
+			chunkRelease(k);
+			++gone;
+		} else {
+			k = mapOwn(x, c);
+			memmove(k->lines + o, k->lines + o + m,
+				(k->n - o - m) * LMSIZE);
+			k->n -= m;
+			if (gone)
+				x->chunks[c - gone] = k;
+		}
+		++c, o = 0;
+	}
+	if (gone)
+		mapCloseChunks(x, c - gone, gone);
+
+/* Don't let small chunks accumulate; merge across the cut if we can. */
+	mapMerge(x, c0);
+	if (c0 > 0)
+		mapMerge(x, --c0);
+
+	mapRenumber(x, c0);
+}				/* mapDelete */
+
+/* Copy the lineMap structures, start through end, into an allocated array.
+ * A zero structure on the end marks the end of the array. */
+static struct lineMap *mapExtract(struct lineIndex *x, int start, int end)
+{
+	struct lineMap *a, *t;
+	int ln;
+	t = a = allocMem((end - start + 2) * LMSIZE);
+	for (ln = start; ln <= end; ++ln)
+		*t++ = *mapLine(x, ln);
+	memset(t, 0, LMSIZE);
+	return a;
+}				/* mapExtract */
+
+/* A copy of the index, sharing the chunks, and the text of the lines.
+ * This is a few thousand pointers for a million line file. */
+static struct lineIndex *mapCopy(struct lineIndex *x)
+{
+	struct lineIndex *y = mapNew();
+	int c;
+	if (!x)
+		return y;
+	mapOpenChunks(y, 0, x->nchunks);
+	for (c = 0; c < x->nchunks; ++c) {
+		struct lineChunk *k = x->chunks[c];
+		++k->ref;
+		y->chunks[c] = k;
+	}
+	y->count = x->count;
+	return y;
+}				/* mapCopy */
+
 /* Fetch line n from the current buffer, or perhaps another buffer.
  * This returns an allocated copy of the string,
  * and you need to free it when you're done.
@@ -151,19 +499,18 @@ addchar:
 static pst fetchLineContext(int n, int show, int cx)
 {
 	struct ebWindow *lw = sessionList[cx].lw;
-	struct lineMap *map, *t;
+	struct lineMap *t;
 	int dol, idx;
 	unsigned len;
 	pst p;			/* the resulting copy of the string */
 
 	if (!lw)
 		i_printfExit(MSG_InvalidSession, cx);
-	map = lw->map;
 	dol = lw->dol;
 	if (n <= 0 || n > dol)
 		i_printfExit(MSG_InvalidLineNb, n);
 
-	t = map + n;
+	t = mapLine(lw->map, n);
 	if (show < 0)
 		return t->text;
 	p = clonePstring(t->text);
@@ -182,7 +529,7 @@ static int apparentSizeW(const struct ebWindow *w, bool browsing)
 	int ln, size = 0;
 	pst p;
 	for (ln = 1; ln <= w->dol; ++ln) {
-		p = w->map[ln].text;
+		p = mapLine(w->map, ln)->text;
 		while (*p != '\n') {
 			if (*p == InternalCodeChar && browsing && w->browseMode) {
 				++p;
@@ -221,7 +568,7 @@ static char *dirSuffixContext(int n, int cx)
 
 	suffix[0] = 0;
 	if (lw->dirMode) {
-		struct lineMap *s = lw->map + n;
+		struct lineMap *s = mapLine(lw->map, n);
 		suffix[0] = s->ds1;
 		suffix[1] = s->ds2;
 		suffix[2] = 0;
@@ -279,7 +626,7 @@ void displayLine(int n)
 	if (cw->dirMode) {
 		stringAndString(&output, &output_l, dirSuffix(n));
 		if (cw->r_map) {
-			s = cw->r_map[n].text;
+			s = mapLine(cw->r_map, n)->text;
 			if (*s) {
 				stringAndChar(&output, &output_l, ' ');
 				stringAndString(&output, &output_l, s);
@@ -636,6 +983,78 @@ static void print_pst(pst p)
 	} while (*p++ != '\n');
 }				/* print_pst */
 
+/*********************************************************************
+A substitute over a range of lines, see substituteRange(),
+builds all the new text in one string, and that string becomes
+a block that the new lines point into, rather than a malloc per line.
+lineMap.home is LT_BLOCK for these lines.
+The block counts the lines that still point into it, in the buffer
+or in the undo levels, and is freed when the last of them goes.
+A line doesn't know its block; the blocks are kept in order by address,
+and blockRelease() finds the block of a line by binary search.
+*********************************************************************/
+
+struct textBlock {
+	char *base;
+	int size;
+	int lines;		/* lines still pointing into it */
+};
+static struct textBlock *textBlocks;
+static int nTextBlocks, aTextBlocks;
+
+/* The block of the line at p, or 0 if p is not in a block. */
+static struct textBlock *blockFind(const char *p)
+{
+	int lo = 0, hi = nTextBlocks - 1, mid;
+	struct textBlock *b;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		b = textBlocks + mid;
+		if (p < b->base)
+			hi = mid - 1;
+		else if (p >= b->base + b->size)
+			lo = mid + 1;
+		else
+			return b;
+	}
+	return 0;
+}				/* blockFind */
+
+/* This allocated string, of so many bytes, holds the text of n lines. */
+static void blockAdopt(char *base, int size, int n)
+{
+	int i;
+	if (nTextBlocks == aTextBlocks) {
+		aTextBlocks = (aTextBlocks ? aTextBlocks * 2 : 32);
+		textBlocks = (textBlocks ?
+			      reallocMem(textBlocks,
+					 aTextBlocks * sizeof(struct textBlock)) :
+			      allocMem(aTextBlocks * sizeof(struct textBlock)));
+	}
+	for (i = nTextBlocks; i && textBlocks[i - 1].base > base; --i)
+		textBlocks[i] = textBlocks[i - 1];
+	textBlocks[i].base = base;
+	textBlocks[i].size = size;
+	textBlocks[i].lines = n;
+	++nTextBlocks;
+}				/* blockAdopt */
+
+/* The line at p is gone; free its block if it was the last one.
+ * Returns false if p is not in a block. */
+static bool blockRelease(const char *p)
+{
+	struct textBlock *b = blockFind(p);
+	if (!b)
+		return false;
+	if (--b->lines)
+		return true;
+	free(b->base);
+	--nTextBlocks;
+	memmove(b, b + 1,
+		(textBlocks + nTextBlocks - b) * sizeof(struct textBlock));
+	return true;
+}				/* blockRelease */
+
 static void freeLine(struct lineMap *t)
 {
 	if (debugLevel >= 8) {
@@ -645,20 +1064,246 @@ static void freeLine(struct lineMap *t)
 			printf("free ");
 		print_pst(t->text);
 	}
-	nzFree(t->text);
+	if (t->home == LT_HEAP)
+		nzFree(t->text);
+	if (t->home == LT_BLOCK)
+		blockRelease((char *)t->text);
 }				/* freeLine */
 
-static void freeWindowLines(struct lineMap *map)
+/*********************************************************************
+Text that comes into the buffer in bulk, such as reading a file,
+is copied into an arena that belongs to the window, not allocated
+line by line. A 20 million line file is one malloc, not 20 million,
+and quitting the buffer is one free, not 20 million.
+lineMap.home is LT_ARENA for these lines, and freeLine() leaves them alone.
+A line that is changed, by substitute or join etc, gets its own allocation,
+or a place in a block, see blockAdopt(),
+and the old text just sits in the arena,
+unused, until the window goes away.
+Browse mode gets its own arena, r_arena holds the arena for the raw text,
+just as r_map holds the raw lines.
+A large file is not copied at all; it is mapped into memory, private,
+and the mapping becomes a block in the arena, see mapFileIntoArena().
+*********************************************************************/
+
+struct lineArena {
+	struct lineArena *next;
+	int size, used;
+	pst base;		/* the bytes of this block */
+	bool mapped;		/* base was mapped in by mmap() */
+/* the file behind the mapping, 0 if it has been copied out */
+	dev_t dev;
+	ino_t ino;
+};
+
+/* small requests share a block of this size */
+#define ARENABLOCK 0x10000
+
+static pst arenaAlloc(struct lineArena **ap, int n)
 {
-	struct lineMap *t;
-	int cnt = 0;
+	struct lineArena *a = *ap;
+	pst p;
+
+	if (!a || a->size - a->used < n) {
+		int size = (n > ARENABLOCK ? n : ARENABLOCK);
+		struct lineArena *b = allocZeroMem(sizeof(struct lineArena) + size);
+		b->size = size;
+		b->base = (pst) (b + 1);
+		if (a && n > ARENABLOCK) {
+/* a big block of its own, leave the block with room in it at the head */
+			b->next = a->next;
+			a->next = b;
+		} else {
+			b->next = a;
+			*ap = b;
+		}
+		a = b;
+	}
+
+	p = a->base + a->used;
+	a->used += n;
+	return p;
+}				/* arenaAlloc */
+
+static void arenaFree(struct lineArena *a)
+{
+	struct lineArena *next;
+	int cnt = 0, bytes = 0;
+	for (; a; a = next) {
+		next = a->next;
+		bytes += a->size;
+		++cnt;
+#ifndef DOSLIKE
+		if (a->mapped)
+			munmap(a->base, a->size);
+#endif
+		free(a);
+	}
+	if (cnt)
+		debugPrint(6, "arenaFree %d blocks %d bytes", cnt, bytes);
+}				/* arenaFree */
+
+/*********************************************************************
+Map a large file into memory, rather than reading it.
+Opening a file of a gigabyte doesn't copy a gigabyte;
+the lines point into the mapping, and the pages come in as they are touched.
+The mapping is private and writable, so the few places that scribble on
+a line in place, like removeHiddenNumbers(), get their own copy of the page,
+and the file is never changed.
+One page of zeros is mapped beyond the end of the file,
+so the data is null terminated, like anything from fileIntoMemory(),
+and there is room for a newline if the last line doesn't have one.
+The mapping sits in mapBuf until readFile() has looked at it;
+then it is handed to the window's arena, or thrown away if the text
+had to be converted, 8859 to utf8 or some such.
+Files below MAPMIN are simply read in; there's nothing to gain.
+Not in windows; we don't have mmap.
+*********************************************************************/
+
+#define MAPMIN 0x100000
+
+static pst mapBuf;
+static int mapSize;		/* size of the mapping, with the page of zeros */
+static struct stat mapStat;
+
+static bool mapFileIntoMemory(const char *filename, char **data, int *len)
+{
+#ifndef DOSLIKE
+	int fh;
+	int size, pagesize = sysconf(_SC_PAGESIZE);
+	pst p;
+
+	fh = open(filename, O_RDONLY);
+	if (fh < 0)
+		return false;
+	if (fstat(fh, &mapStat) < 0 || !S_ISREG(mapStat.st_mode) ||
+	    mapStat.st_size < MAPMIN || mapStat.st_size > 0x7fffffff - 2 * pagesize) {
+		close(fh);
+		return false;
+	}
+
+	size = mapStat.st_size + pagesize;
+/* reserve the whole range, then lay the file over the front of it */
+	p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		close(fh);
+		return false;
+	}
+	if (mmap(p, mapStat.st_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, fh, 0) == MAP_FAILED) {
+		munmap(p, size);
+		close(fh);
+		return false;
+	}
+	close(fh);
+
+	debugPrint(3, "map %s %d bytes", filename, (int)mapStat.st_size);
+	mapBuf = p;
+	mapSize = size;
+	*data = (char *)p;
+	*len = mapStat.st_size;
+	return true;
+#else
+	return false;
+#endif
+}				/* mapFileIntoMemory */
+
+/* Free the read buffer, which might be the mapping. */
+static void freeReadBuffer(char *buf)
+{
+	if (mapBuf && (pst) buf >= mapBuf && (pst) buf < mapBuf + mapSize) {
+#ifndef DOSLIKE
+		munmap(mapBuf, mapSize);
+#endif
+		mapBuf = 0;
+		return;
+	}
+	nzFree(buf);
+}				/* freeReadBuffer */
+
+/* The lines are going to live in the mapping; it becomes part of the arena.
+ * Put it after the head block, so the head keeps its room for small things. */
+static void mapIntoArena(struct lineArena **ap)
+{
+	struct lineArena *a = *ap;
+	struct lineArena *b = allocZeroMem(sizeof(struct lineArena));
+	b->size = b->used = mapSize;
+	b->base = mapBuf;
+	b->mapped = true;
+	b->dev = mapStat.st_dev;
+	b->ino = mapStat.st_ino;
+	if (a) {
+		b->next = a->next;
+		a->next = b;
+	} else
+		*ap = b;
+	mapBuf = 0;
+}				/* mapIntoArena */
+
+/*********************************************************************
+We are about to truncate and write a file.
+If that file is mapped into any buffer, the lines would vanish out from
+under us, and touching them is a bus error, or worse, they quietly change
+to the new text, which might be those very lines moved about.
+Copy the mapping into anonymous memory at the same address,
+so every pointer into it is still good.
+This costs a copy of the file, for a moment, but it only happens when you
+write over a large file that you are still looking at.
+If a program other than edbrowse changes the file, all bets are off;
+that's the price of not reading a gigabyte into memory.
+*********************************************************************/
+
+static void unmapArena(struct lineArena *a, const struct stat *st)
+{
+#ifndef DOSLIKE
+	pst save;
+	for (; a; a = a->next) {
+		if (!a->mapped || !a->dev && !a->ino)
+			continue;
+		if (a->dev != st->st_dev || a->ino != st->st_ino)
+			continue;
+		debugPrint(3, "copy out mapped file, %d bytes", a->size);
+		save = allocMem(a->size);
+		memcpy(save, a->base, a->size);
+		if (mmap(a->base, a->size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1,
+			 0) == MAP_FAILED)
+			i_printfExit(MSG_MemAllocError, a->size);
+		memcpy(a->base, save, a->size);
+		free(save);
+		a->dev = 0, a->ino = 0;
+	}
+#endif
+}				/* unmapArena */
+
+static void unmapFile(const char *name)
+{
+	struct stat st;
+	int n;
+	struct ebWindow *w;
+	if (stat(name, &st) < 0)
+		return;
+	for (n = 1; n < MAXSESSION; ++n)
+		for (w = sessionList[n].lw; w; w = w->prev) {
+			unmapArena(w->arena, &st);
+			unmapArena(w->r_arena, &st);
+		}
+}				/* unmapFile */
 
-	if (t = map) {
-		for (++t; t->text; ++t) {
-			freeLine(t);
-			++cnt;
+static void freeWindowLines(struct lineIndex *map)
+{
+	struct lineChunk *k;
+	int c, i, cnt = 0;
+
+	if (map) {
+		for (c = 0; c < map->nchunks; ++c) {
+			k = map->chunks[c];
+			for (i = 0; i < k->n; ++i) {
+				freeLine(k->lines + i);
+				++cnt;
+			}
 		}
-		free(map);
+		mapFree(map);
 	}
 
 	debugPrint(6, "freeWindowLines = %d", cnt);
@@ -666,109 +1311,202 @@ static void freeWindowLines(struct lineMap *map)
 
 /*********************************************************************
 Garbage collection for text lines.
-There is an undo window that holds a snapshot of the buffer as it was before.
+There is a stack of undo levels, each a snapshot of the buffer as it was
+before one of your commands;
 not a copy of all the text, but a copy of map,
-and dot and dollar and some other things.
-This starts out with map = 0.
-The u command swaps undoWindow and current window (cw).
-Thus another u undoes your undo.
-You can step back through all your changes,
-popping a stack like a modern editor. Sorry.
-Just don't screw up more than once,
-and don't save your file til you're sure it's ok.
+and dot and dollar and the labels.
+The stack holds at most undoDepth levels, set in the config file.
+The u command pushes the current buffer onto the redo stack,
+and pops the top undo level into cw.
+The U command goes the other way.
+With undoDepth at 1, a u with nothing to undo redoes,
+so u toggles back and forth, as it always has.
+Just don't save your file til you're sure it's ok.
 No autosave feature here, I never liked that anyways.
 So at the start of every command not under g//, set madeChanges = false.
 If we're about to change something in the buffer, set madeChanges = true.
 But if madeChanges was false, i.e. this is the first change coming,
 call undoPush().
-This pushes the undo window off the cliff,
+A new change throws away the redo stack, and if the undo stack is full,
+the oldest level falls off the cliff,
 and that means we have to free the text first.
-Call undoCompare().
-This finds any lines in the undo window that aren't in cw and frees them.
-That is a quicksort on both maps and then a comm -23.
-Then it frees undoWindow.map just to make sure we don't free things twice.
-Then undoPush copies cw onto undoWindow, ready for the u command.
+The lines of a level that aren't in the level next to it are freed.
+A line is created by one command and dropped by a later one,
+and never comes back, except by u and U, which don't make new levels.
+So a line that isn't in the neighbor isn't anywhere else either.
+The levels share their chunks with cw and with each other, see mapCopy(),
+and a chunk that is still shared holds the same lines in both.
+So only the chunks that one side or the other has copied, and changed,
+are pulled out and compared; that is a quicksort and a comm -23
+on the lines near that change, not on the whole buffer.
+Keeping 100 levels of a large file costs 100 chunk arrays,
+plus the chunks that actually changed.
+Then undoPush copies cw onto the stack, ready for the u command.
 Return, and the calling function makes its change.
 But we call undoCompare at other times, like switching buffers,
 pop the window stack, browse, or quit.
-These make undo impossible, so free the lines in the undo window.
+These make undo impossible, so free the lines in all the levels.
 *********************************************************************/
 
 static bool madeChanges;
-static struct ebWindow undoWindow;
 
-/* quick sort compare */
+struct undoLevel {
+	struct lineIndex *map;
+	int dot, dol;
+	int labels[MARKLETTERS];
+};
+static struct undoLevel *undoStack, *redoStack;
+static int undoCount, redoCount;
+static int undoAlloc;		/* the stacks were allocated at this depth */
+
+/* quick sort compare, the lines are sorted by address */
 static int qscmp(const void *s, const void *t)
 {
-	return memcmp(s, t, sizeof(char *));
+	const char *a = *(char *const *)s;
+	const char *b = *(char *const *)t;
+	return (a < b ? -1 : a > b);
 }				/* qscmp */
 
-/* Free undo lines not used by the current session. */
-static void undoCompare(void)
+/* Gather up the text of the allocated lines in the chunks of x
+ * that have this mark and no other; lines in a block count as allocated. */
+static char **markedLines(struct lineIndex *x, int mark, int *np)
 {
-	const struct lineMap *cmap = cw->map;
-	struct lineMap *map = undoWindow.map;
-	struct lineMap *cmap2;
-	struct lineMap *s, *t;
-	int diff, ln, cnt = 0;
-
-	if (!cmap) {
-		debugPrint(6, "undoCompare no current map");
-		freeWindowLines(undoWindow.map);
-		undoWindow.map = 0;
-		return;
+	char **list;
+	int c, i, n = 0;
+	struct lineChunk *k;
+
+	for (c = 0; c < x->nchunks; ++c) {
+		k = x->chunks[c];
+		if (k->mark == mark)
+			n += k->n;
+	}
+	list = allocMem((n + 1) * sizeof(char *));
+	n = 0;
+	for (c = 0; c < x->nchunks; ++c) {
+		k = x->chunks[c];
+		if (k->mark != mark)
+			continue;
+		for (i = 0; i < k->n; ++i)
+			if (k->lines[i].home != LT_ARENA)
+				list[n++] = (char *)k->lines[i].text;
 	}
+	qsort(list, n, sizeof(char *), qscmp);
+	*np = n;
+	return list;
+}				/* markedLines */
 
-	if (!map) {
-		debugPrint(6, "undoCompare no undo map");
-		return;
-	}
+/*********************************************************************
+Free the index x, and the text of every line in x that is not in y.
+Mark the chunks of y with 1 and the chunks of x with 2;
+a chunk with mark 3 is shared, and its lines are in both.
+y can be null, whereupon all the lines of x go.
+*********************************************************************/
 
-/* sort both arrays, run comm, and find out which lines are not needed any more,
-then free them.
- * Use quick sort; some files are a million lines long.
- * I have to copy the second array, so I can sort it.
- * The first I can sort in place, cause it's going to get thrown away. */
-
-	cmap2 = allocMem((cw->dol + 2) * LMSIZE);
-	memcpy(cmap2, cmap, (cw->dol + 2) * LMSIZE);
-	debugPrint(8, "qsort %d %d", undoWindow.dol, cw->dol);
-	qsort(map + 1, undoWindow.dol, LMSIZE, qscmp);
-	qsort(cmap2 + 1, cw->dol, LMSIZE, qscmp);
-
-	s = map + 1;
-	t = cmap2 + 1;
-	while (s->text && t->text) {
-		diff = memcmp(s, t, sizeof(char *));
-		if (!diff) {
-			++s, ++t;
-			continue;
-		}
-		if (diff > 0) {
-			++t;
+static int mapRelease(struct lineIndex *x, struct lineIndex *y)
+{
+	char **xlist, **ylist;
+	int xn, yn, i, j, c, cnt = 0;
+
+	if (!x)
+		return 0;
+	if (y)
+		for (c = 0; c < y->nchunks; ++c)
+			y->chunks[c]->mark |= 1;
+	for (c = 0; c < x->nchunks; ++c)
+		x->chunks[c]->mark |= 2;
+
+	xlist = markedLines(x, 2, &xn);
+	ylist = (y ? markedLines(y, 1, &yn) : 0);
+	if (!y)
+		yn = 0;
+	debugPrint(8, "qsort %d %d", xn, yn);
+
+	for (i = j = 0; i < xn; ++i) {
+		while (j < yn && ylist[j] < xlist[i])
+			++j;
+		if (j < yn && ylist[j] == xlist[i])
 			continue;
-		}
-		freeLine(s);
-		++s;
+		if (!blockRelease(xlist[i]))
+			free(xlist[i]);
 		++cnt;
 	}
+	nzFree(xlist);
+	nzFree(ylist);
 
-	while (s->text) {
-		freeLine(s);
-		++s;
-		++cnt;
+	if (y)
+		for (c = 0; c < y->nchunks; ++c)
+			y->chunks[c]->mark = 0;
+	for (c = 0; c < x->nchunks; ++c)
+		x->chunks[c]->mark = 0;
+	mapFree(x);
+	return cnt;
+}				/* mapRelease */
+
+/* Throw away the redo levels, the farthest one first. */
+static void redoRelease(void)
+{
+	int i, cnt = 0;
+	struct lineIndex *next;
+	for (i = 0; i < redoCount; ++i) {
+		next = (i + 1 < redoCount ? redoStack[i + 1].map : cw->map);
+		cnt += mapRelease(redoStack[i].map, next);
+	}
+	if (redoCount)
+		debugPrint(6, "redo strip %d levels %d", redoCount, cnt);
+	redoCount = 0;
+}				/* redoRelease */
+
+/* Drop the oldest n undo levels. */
+static void undoRelease(int n)
+{
+	int i, cnt = 0;
+	struct lineIndex *next;
+	for (i = 0; i < n; ++i) {
+		next = (i + 1 < undoCount ? undoStack[i + 1].map : cw->map);
+		cnt += mapRelease(undoStack[i].map, next);
 	}
+	undoCount -= n;
+	memmove(undoStack, undoStack + n, undoCount * sizeof(struct undoLevel));
+	debugPrint(6, "undoCompare strip %d levels %d", n, cnt);
+}				/* undoRelease */
 
-	free(cmap2);
-	free(map);
-	undoWindow.map = 0;
-	debugPrint(6, "undoCompare strip %d", cnt);
+/* Free undo lines not used by the current session. */
+static void undoCompare(void)
+{
+	redoRelease();
+	if (!undoCount) {
+		debugPrint(6, "undoCompare no undo map");
+		return;
+	}
+	undoRelease(undoCount);
 }				/* undoCompare */
 
-static void undoPush(void)
+/* snapshot of the current buffer */
+static void undoSave(struct undoLevel *u)
 {
-	struct ebWindow *uw;
+	u->dot = cw->dot;
+	u->dol = cw->dol;
+	memcpy(u->labels, cw->labels, MARKLETTERS * sizeof(int));
+	u->map = (cw->map ? mapCopy(cw->map) : 0);
+}				/* undoSave */
+
+/* Swap the current buffer with an undo or redo level.
+ * The map moves over, nothing is copied. */
+static void undoSwap(struct undoLevel *u)
+{
+	int i, j;
+	struct lineIndex *swapmap;
+	i = u->dot, u->dot = cw->dot, cw->dot = i;
+	i = u->dol, u->dol = cw->dol, cw->dol = i;
+	for (j = 0; j < MARKLETTERS; ++j) {
+		i = u->labels[j], u->labels[j] = cw->labels[j], cw->labels[j] =
+		    i;
+	}
+	swapmap = u->map, u->map = cw->map, cw->map = swapmap;
+}				/* undoSwap */
 
+static void undoPush(void)
+{
 /* if in browse mode, we really shouldn't be here at all!
  * But we could if substituting on an input field, since substitute is also
  * a regular ed command. */
@@ -783,21 +1521,53 @@ static void undoPush(void)
 	if (!cw->quitMode)
 		cw->changeMode = true;
 
-	undoCompare();
-
-	uw = &undoWindow;
-	uw->dot = cw->dot;
-	uw->dol = cw->dol;
-	memcpy(uw->labels, cw->labels, MARKLETTERS * sizeof(int));
-	uw->binMode = cw->binMode;
-	uw->nlMode = cw->nlMode;
-	uw->dirMode = cw->dirMode;
-	if (cw->map) {
-		uw->map = allocMem((cw->dol + 2) * LMSIZE);
-		memcpy(uw->map, cw->map, (cw->dol + 2) * LMSIZE);
+/* The config file could have changed the depth. */
+	if (undoAlloc != undoDepth) {
+		undoCompare();
+		nzFree(undoStack);
+		nzFree(redoStack);
+		undoStack = allocMem(undoDepth * sizeof(struct undoLevel));
+		redoStack = allocMem(undoDepth * sizeof(struct undoLevel));
+		undoAlloc = undoDepth;
 	}
+
+	redoRelease();
+	if (undoCount == undoDepth)
+		undoRelease(1);
+	undoSave(undoStack + undoCount++);
 }				/* undoPush */
 
+/* u, or U for redo */
+static bool undoCommand(bool redo)
+{
+	struct undoLevel *u;
+	if (!cw->undoable) {
+		setError(redo ? MSG_NoRedo : MSG_NoUndo);
+		return false;
+	}
+/* one level of undo, u toggles, like it always has */
+	if (!redo && !undoCount && undoDepth == 1)
+		redo = true;
+	if (redo) {
+		if (!redoCount) {
+			setError(MSG_NoRedo);
+			return false;
+		}
+		u = redoStack + --redoCount;
+		undoSwap(u);
+		undoStack[undoCount++] = *u;
+	} else {
+		if (!undoCount) {
+			setError(MSG_NoUndo);
+			return false;
+		}
+		u = undoStack + --undoCount;
+		undoSwap(u);
+		redoStack[redoCount++] = *u;
+	}
+	return true;
+}				/* undoCommand */
+
 static void freeWindow(struct ebWindow *w)
 {
 	struct ebFrame *f, *fnext;
@@ -816,6 +1586,8 @@ static void freeWindow(struct ebWindow *w)
 	}
 	freeWindowLines(w->map);
 	freeWindowLines(w->r_map);
+	arenaFree(w->arena);
+	arenaFree(w->r_arena);
 	nzFree(w->ft);
 	nzFree(w->fd);
 	nzFree(w->fk);
@@ -967,9 +1739,7 @@ static struct lineMap *newpiece;
  * Pass the string containing the new line numbers, and the dest line number. */
 static void addToMap(int nlines, int destl)
 {
-	struct lineMap *newmap;
 	int i, ln;
-	int svdol = cw->dol;
 
 	if (nlines == 0)
 		i_printfExit(MSG_EmptyPiece);
@@ -993,31 +1763,23 @@ static void addToMap(int nlines, int destl)
 	cw->dot = destl + nlines;
 	cw->dol += nlines;
 
-	newmap = allocMem((cw->dol + 2) * LMSIZE);
-	if (destl)
-		memcpy(newmap, cw->map, (destl + 1) * LMSIZE);
-	else
-		memset(newmap, 0, LMSIZE);
 /* insert new piece here */
-	memcpy(newmap + destl + 1, newpiece, nlines * LMSIZE);
-/* put on the last piece */
-	if (destl < svdol)
-		memcpy(newmap + destl + nlines + 1, cw->map + destl + 1,
-		       (svdol - destl + 1) * LMSIZE);
-	else
-		memset(newmap + destl + nlines + 1, 0, LMSIZE);
-
-	nzFree(cw->map);
-	cw->map = newmap;
+	if (!cw->map)
+		cw->map = mapNew();
+	mapInsert(cw->map, destl, newpiece, nlines);
 	free(newpiece);
 	newpiece = 0;
 }				/* addToMap */
 
-/* Add a block of text into the buffer; uses addToMap(). */
-bool addTextToBuffer(const pst inbuf, int length, int destl, bool showtrail)
+/* Add a block of text into the buffer; uses addToMap().
+ * If inplace, the text is already in the arena, a mapped file,
+ * with a spare byte on the end; the lines point right into it. */
+static bool addTextBlock(pst inbuf, int length, int destl, bool showtrail,
+			 bool inplace)
 {
 	int i, j, linecount = 0;
 	struct lineMap *t;
+	pst bulk = 0;
 
 	for (i = 0; i < length; ++i)
 		if (inbuf[i] == '\n') {
@@ -1040,27 +1802,50 @@ bool addTextToBuffer(const pst inbuf, int length, int destl, bool showtrail)
 		}
 	}
 	/* missing newline */
+
+/* Copy the whole block into the arena in one go, with room for a newline
+ * on the end, in case the last line doesn't have one.
+ * Browse mode rerenders pieces of the page as javascript runs,
+ * and those lines come and go, so give them their own allocations. */
+	if (inplace) {
+		bulk = inbuf;
+		bulk[length] = '\n';
+	} else if (!cw->browseMode) {
+		bulk = arenaAlloc(&cw->arena, length + 1);
+		memcpy(bulk, inbuf, length);
+		bulk[length] = '\n';
+	}
+
 	newpiece = t = allocZeroMem(linecount * LMSIZE);
 	i = 0;
 	while (i < length) {	/* another line */
+		const uchar *nl;
 		j = i;
-		while (i < length)
-			if (inbuf[i++] == '\n')
-				break;
-		if (inbuf[i - 1] == '\n') {
+		nl = memchr(inbuf + i, '\n', length - i);
+		i = (nl ? nl - inbuf + 1 : length);
+		if (bulk) {
+			t->text = bulk + j;
+			t->home = LT_ARENA;
+		} else if (inbuf[i - 1] == '\n') {
 /* normal line */
 			t->text = allocMem(i - j);
+			memcpy(t->text, inbuf + j, i - j);
 		} else {
 /* last line with no nl */
 			t->text = allocMem(i - j + 1);
 			t->text[i - j] = '\n';
+			memcpy(t->text, inbuf + j, i - j);
 		}
-		memcpy(t->text, inbuf + j, i - j);
 		++t;
 	}			/* loop breaking inbuf into lines */
 
 	addToMap(linecount, destl);
 	return true;
+}				/* addTextBlock */
+
+bool addTextToBuffer(const pst inbuf, int length, int destl, bool showtrail)
+{
+	return addTextBlock(inbuf, length, destl, showtrail, false);
 }				/* addTextToBuffer */
 
 /* Pass input lines straight into the buffer, until the user enters . */
@@ -1135,7 +1920,7 @@ void delText(int start, int end)
 /* browse has no undo command */
 	if (cw->browseMode) {
 		for (ln = start; ln <= end; ++ln)
-			nzFree(cw->map[ln].text);
+			freeLine(mapLine(cw->map, ln));
 	} else {
 		undoPush();
 	}
@@ -1143,8 +1928,7 @@ void delText(int start, int end)
 	if (end == cw->dol)
 		cw->nlMode = false;
 	j = end - start + 1;
-	memmove(cw->map + start, cw->map + end + 1,
-		(cw->dol - end + 1) * LMSIZE);
+	mapDelete(cw->map, start, end);
 
 /* move the labels */
 	for (i = 0; i < MARKLETTERS; ++i) {
@@ -1164,11 +1948,79 @@ void delText(int start, int end)
 		cw->dot = cw->dol;
 /* by convention an empty buffer has no map */
 	if (!cw->dol) {
-		free(cw->map);
+		mapFree(cw->map);
 		cw->map = 0;
 	}
 }				/* delText */
 
+/*********************************************************************
+g/re/d, delete every line with gflag set, in one pass.
+One at a time, each delete is a command, with the map to adjust and
+the labels to move, and millions of those add up.
+Here the lines that survive are copied into a new index, chunk by chunk,
+and the labels and dot come out as though the lines were deleted
+one at a time, top to bottom.
+As in delText(), the text isn't freed; the undo snapshot holds it.
+*********************************************************************/
+
+static void delGlobal(void)
+{
+	struct lineIndex *x = cw->map, *y = mapNew();
+	struct lineMap piece[LINECHUNK], *t;
+	int labs[MARKLETTERS];
+	int i, j, ln, np = 0, nl = 0, lastgone = 0, nlabs = 0;
+
+	undoPush();
+
+/* labels in line order, so we can move them as we go */
+	for (i = 0; i < MARKLETTERS; ++i) {
+		if (!cw->labels[i])
+			continue;
+		for (j = nlabs; j > 0 && cw->labels[labs[j - 1]] > cw->labels[i];
+		     --j)
+			labs[j] = labs[j - 1];
+		labs[j] = i;
+		++nlabs;
+	}
+	j = 0;
+
+	for (ln = 1; ln <= cw->dol; ++ln) {
+		t = mapLine(x, ln);
+		if (t->gflag) {
+			t->gflag = false;
+			lastgone = ln;
+			while (j < nlabs && cw->labels[labs[j]] == ln)
+				cw->labels[labs[j++]] = 0;
+			continue;
+		}
+		++nl;
+		while (j < nlabs && cw->labels[labs[j]] == ln)
+			cw->labels[labs[j++]] = nl;
+		piece[np++] = *t;
+		if (np == LINECHUNK) {
+			mapInsert(y, y->count, piece, np);
+			np = 0;
+		}
+	}
+	mapInsert(y, y->count, piece, np);
+
+	if (lastgone == cw->dol)
+		cw->nlMode = false;
+/* dot is the line after the last one deleted */
+	cw->dot = lastgone - (cw->dol - nl) + 1;
+	cw->dol = nl;
+	if (cw->dot > cw->dol)
+		cw->dot = cw->dol;
+	debugPrint(3, "delGlobal %d lines", ln - 1 - nl);
+	mapFree(x);
+	cw->map = y;
+/* by convention an empty buffer has no map */
+	if (!cw->dol) {
+		mapFree(cw->map);
+		cw->map = 0;
+	}
+}				/* delGlobal */
+
 /* Delete files from a directory as you delete lines.
  * Set dw to move them to your recycle bin.
  * Set dx to delete them outright. */
@@ -1264,12 +2116,9 @@ static bool moveCopy(void)
 	int sr = startRange;
 	int er = endRange + 1;
 	int dl = destLine + 1;
-	int i_sr = sr * LMSIZE;	/* indexes into map */
-	int i_er = er * LMSIZE;
-	int i_dl = dl * LMSIZE;
 	int n_lines = er - sr;
-	struct lineMap *map = cw->map;
-	struct lineMap *newmap, *t;
+	struct lineIndex *map = cw->map;
+	struct lineMap *piece, *t;
 	int lowcut, highcut, diff, i, ln;
 
 	if (dl > sr && dl < er) {
@@ -1295,18 +2144,13 @@ static bool moveCopy(void)
 	if (destLine == cw->dol || endRange == cw->dol)
 		cw->nlMode = false;
 
-/* All we really need do is rearrange the map. */
-	newmap = allocMem((cw->dol + 2) * LMSIZE);
-	memcpy(newmap, map, (cw->dol + 2) * LMSIZE);
-	if (dl < sr) {
-		memcpy(newmap + dl, map + sr, i_er - i_sr);
-		memcpy(newmap + dl + er - sr, map + dl, i_sr - i_dl);
-	} else {
-		memcpy(newmap + sr, map + er, i_dl - i_er);
-		memcpy(newmap + sr + dl - er, map + sr, i_er - i_sr);
-	}
-	free(cw->map);
-	cw->map = newmap;
+/* All we really need do is rearrange the map.
+ * Pull the block out, then put it back in after the destination line,
+ * which has moved up if it was beyond the block. */
+	piece = mapExtract(map, sr, er - 1);
+	mapDelete(map, sr, er - 1);
+	mapInsert(map, (dl < sr ? dl - 1 : dl - 1 - n_lines), piece, n_lines);
+	free(piece);
 
 /* now for the labels */
 	if (dl < sr) {
@@ -1487,7 +2331,11 @@ static bool readDirectory(const char *filename)
 	}			/* loop fixing files in the directory scan */
 
 	addToMap(linecount, endRange);
-	cw->r_map = backpiece;
+	if (backpiece) {
+		cw->r_map = mapNew();
+		mapInsert(cw->r_map, 0, backpiece + 1, linecount);
+		free(backpiece);
+	}
 
 success:
 	if (cmd == 'r')
@@ -1594,7 +2442,8 @@ fromdisk:
 	rbuf = findHash(nopound);
 	if (rbuf && !filetype)
 		*rbuf = 0;
-	rc = fileIntoMemory(nopound, &rbuf, &fileSize);
+	rc = (!inframe && mapFileIntoMemory(nopound, &rbuf, &fileSize)) ||
+	    fileIntoMemory(nopound, &rbuf, &fileSize);
 	nzFree(nopound);
 	if (!rc)
 		return false;
@@ -1640,7 +2489,7 @@ gotdata:
 					i_puts(cons_utf8 ? MSG_ConvUtf8 :
 					       MSG_Conv8859);
 				utfLow(rbuf, fileSize, &tbuf, &fileSize, bom);
-				nzFree(rbuf);
+				freeReadBuffer(rbuf);
 				rbuf = tbuf;
 			} else {
 				looks_8859_utf8(rbuf, fileSize, &is8859,
@@ -1654,7 +2503,7 @@ gotdata:
 						i_puts(MSG_ConvUtf8);
 					iso2utf(rbuf, fileSize, &tbuf,
 						&fileSize);
-					nzFree(rbuf);
+					freeReadBuffer(rbuf);
 					rbuf = tbuf;
 				}
 				if (!cons_utf8 && isutf8) {
@@ -1663,7 +2512,7 @@ gotdata:
 						i_puts(MSG_Conv8859);
 					utf2iso(rbuf, fileSize, &tbuf,
 						&fileSize);
-					nzFree(rbuf);
+					freeReadBuffer(rbuf);
 					rbuf = tbuf;
 				}
 				if (cons_utf8 && isutf8) {
@@ -1671,8 +2520,12 @@ gotdata:
 					if (fileSize >= 3 &&
 					    !memcmp(rbuf, "\xef\xbb\xbf", 3)) {
 						fileSize -= 3;
-						memmove(rbuf, rbuf + 3,
-							fileSize);
+/* don't slide a whole mapped file down by 3 bytes */
+						if (mapBuf)
+							rbuf += 3;
+						else
+							memmove(rbuf, rbuf + 3,
+								fileSize);
 					}
 				}
 			}
@@ -1715,6 +2568,10 @@ gotdata:
 	}
 
 intext:
+	if (mapBuf) {
+		mapIntoArena(&cw->arena);
+		return addTextBlock((pst) rbuf, fileSize, endRange, true, true);
+	}
 	rc = addTextToBuffer((const pst)rbuf, fileSize, endRange,
 			     !isURL(filename));
 	free(rbuf);
@@ -1770,6 +2627,8 @@ static bool writeFile(const char *name, int mode)
 	if (cw->binMode | cw->utf16Mode | cw->utf32Mode)
 		stringAndChar(&modeString, &modeString_l, 'b');
 
+	if (!(mode & O_APPEND))
+		unmapFile(name);
 	fh = fopen(name, modeString);
 	nzFree(modeString);
 	if (fh == NULL) {
@@ -1882,7 +2741,7 @@ badline:
 			if (len && fwrite(suf, len, 1, fh) <= 0)
 				goto badline;
 			++len;	/* for nl */
-			extra = cw->r_map[i].text;
+			extra = mapLine(cw->r_map, i)->text;
 			l = strlen(extra);
 			if (l) {
 				if (fwrite(" ", 1, 1, fh) <= 0)
@@ -1945,7 +2804,7 @@ static bool readContext(int cx)
 			char *suf = dirSuffixContext(i, cx);
 			char *q;
 			if (lw->r_map) {
-				char *extra = lw->r_map[i].text;
+				char *extra = mapLine(lw->r_map, i)->text;
 				int elen = strlen(extra);
 				q = allocMem(len + 4 + elen);
 				memcpy(q, p, len);
@@ -1987,7 +2846,7 @@ static bool writeContext(int cx)
 {
 	struct ebWindow *lw;
 	int i, len;
-	struct lineMap *newmap, *t;
+	struct lineMap *piece, *t;
 	pst p;
 	int fardol = endRange - startRange + 1;
 
@@ -2002,15 +2861,16 @@ static bool writeContext(int cx)
 	lw = sessionList[cx].lw;
 	fileSize = 0;
 	if (startRange) {
-		newmap = t = allocZeroMem((fardol + 2) * LMSIZE);
-		for (i = startRange, ++t; i <= endRange; ++i, ++t) {
+		piece = t = allocZeroMem(fardol * LMSIZE);
+		for (i = startRange; i <= endRange; ++i, ++t) {
 			p = fetchLine(i, (cw->dirMode ? -1 : 1));
 			len = pstLength(p);
 			if (cw->dirMode) {
 				pst q;
 				char *suf = dirSuffix(i);
 				if (cw->r_map) {
-					char *extra = cw->r_map[i].text;
+					char *extra =
+					    mapLine(cw->r_map, i)->text;
 					int elen = strlen(extra);
 					q = allocMem(len + 4 + elen);
 					memcpy(q, p, len);
@@ -2034,7 +2894,9 @@ static bool writeContext(int cx)
 			t->text = p;
 			fileSize += len;
 		}
-		lw->map = newmap;
+		lw->map = mapNew();
+		mapInsert(lw->map, 0, piece, fardol);
+		free(piece);
 		lw->binMode = cw->binMode;
 		if (cw->nlMode && endRange == cw->dol) {
 			lw->nlMode = true;
@@ -2421,8 +3283,217 @@ regexpCheck(const char *line, bool isleft, bool ebmuck,
 static int re_count;
 static int re_vector[11 * 3];
 static pcre *re_cc;		/* compiled */
+static pcre_extra *re_extra;	/* studied, perhaps jit compiled */
 static bool re_utf8 = true;
 
+/*********************************************************************
+Compiled expressions are kept in a cache, most recently used first,
+so a script that runs the same substitute a thousand times
+compiles it once. The key is the expression and the options,
+which carry caseless and utf8.
+Each one is studied, and jit compiled if this pcre can do that;
+it's worth it now that the work isn't thrown away after one command.
+The cache owns re_cc and re_extra; don't free them.
+*********************************************************************/
+
+#define RECACHE 16
+static struct reCache {
+	char *re;
+	int opt;
+	pcre *cc;
+	pcre_extra *extra;
+} reCache[RECACHE];
+static int reHits, reMisses;
+
+static void reFreeStudy(pcre_extra *e)
+{
+	if (!e)
+		return;
+#ifdef PCRE_STUDY_JIT_COMPILE
+	pcre_free_study(e);
+#else
+	pcre_free(e);
+#endif
+}				/* reFreeStudy */
+
+/* Look for the expression in the cache, and move it to the front. */
+static bool reCacheFind(const char *re, int opt)
+{
+	struct reCache hold;
+	int i;
+	for (i = 0; i < RECACHE && reCache[i].re; ++i)
+		if (reCache[i].opt == opt && stringEqual(reCache[i].re, re))
+			break;
+	if (i == RECACHE || !reCache[i].re)
+		return false;
+	hold = reCache[i];
+	memmove(reCache + 1, reCache, i * sizeof(struct reCache));
+	reCache[0] = hold;
+	re_cc = hold.cc;
+	re_extra = hold.extra;
+	return true;
+}				/* reCacheFind */
+
+/* Study the newly compiled expression and put it at the front,
+ * pushing the least recently used one out the back. */
+static void reCacheAdd(const char *re, int opt)
+{
+	struct reCache *last = reCache + RECACHE - 1;
+	const char *study_error;
+	int study_opt = 0;
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+	study_opt = PCRE_STUDY_JIT_COMPILE;
+#endif
+	re_extra = pcre_study(re_cc, study_opt, &study_error);
+
+	if (last->re) {
+		nzFree(last->re);
+		reFreeStudy(last->extra);
+		pcre_free(last->cc);
+	}
+	memmove(reCache + 1, reCache, (RECACHE - 1) * sizeof(struct reCache));
+	reCache[0].re = cloneString(re);
+	reCache[0].opt = opt;
+	reCache[0].cc = re_cc;
+	reCache[0].extra = re_extra;
+}				/* reCacheAdd */
+
+/*********************************************************************
+A lot of searches and substitutions are plain text, /foo/ or s/bar/baz/,
+and pcre, even jit compiled, is slower than a straight memmem.
+If the expression has no meta characters, apart from a leading ^
+or a trailing $, and \ before punctuation, which is just that punctuation,
+remember the literal text, and reExec() looks for it directly.
+Case insensitive only if the literal is ascii;
+we leave utf8 case folding to pcre.
+*********************************************************************/
+
+static char re_lit[MAXRE];
+static int re_litlen;		/* 0 means use pcre */
+static bool re_litci, re_litstart, re_litend;
+
+static void regexpLiteral(const char *re, bool ci)
+{
+	const char *s = re;
+	char c;
+	int n = 0;
+
+	re_litlen = 0;
+	re_litstart = re_litend = false;
+	if (*s == '^')
+		re_litstart = true, ++s;
+	while (c = *s++) {
+		if (c == '\\') {
+			c = *s++;
+			if (!c || isalnumByte(c) || c & 0x80)
+				return;
+		} else if (c == '$' && !*s) {
+			re_litend = true;
+			break;
+		} else if (strchr("^$.[]|()?*+{}", c))
+			return;
+		if (ci && c & 0x80)
+			return;
+		if (n == MAXRE - 1)
+			return;
+		re_lit[n++] = (ci ? tolower((uchar) c) : c);
+	}
+	re_lit[n] = 0;
+	re_litci = ci;
+	re_litlen = n;
+	if (n)
+		debugPrint(7, "regexp literal %s", re_lit);
+}				/* regexpLiteral */
+
+/* Find the literal in s, starting at offset, return its position or -1 */
+static int litSearch(const char *s, int len, int offset)
+{
+	const char *t;
+	uchar first;
+	int i, last = len - re_litlen;
+
+	if (offset > last)
+		return -1;
+	if (!re_litci) {
+#ifdef DOSLIKE
+		for (i = offset; i <= last; ++i)
+			if (s[i] == re_lit[0] &&
+			    !memcmp(s + i, re_lit, re_litlen))
+				return i;
+		return -1;
+#else
+		t = memmem(s + offset, len - offset, re_lit, re_litlen);
+		return (t ? t - s : -1);
+#endif
+	}
+
+	first = re_lit[0];
+	for (i = offset; i <= last; ++i)
+		if (tolower((uchar) s[i]) == first &&
+		    memEqualCI(s + i, re_lit, re_litlen))
+			return i;
+	return -1;
+}				/* litSearch */
+
+/*********************************************************************
+Run the current expression against a line, the way pcre_exec would,
+but only the whole match is returned in vector[0] and vector[1].
+This is the only place we call pcre_exec, so the literal shortcut
+works for g//, v//, searches, and s///.
+Without PCRE_MULTILINE, ^ is the start of the line, and only at offset 0,
+and $ is the end of the line, or just before a newline at the end.
+*********************************************************************/
+
+static int reExec(const char *s, int len, int offset, int *vector)
+{
+	int i;
+
+	if (!re_litlen)
+		return pcre_exec(re_cc, re_extra, s, len, offset, 0, vector,
+				 33);
+
+	if (re_litend) {
+/* before the trailing newline comes first, left to right */
+		int end = len;
+		if (re_litstart && offset)
+			return PCRE_ERROR_NOMATCH;
+		if (len && s[len - 1] == '\n')
+			--end;
+		for (; end <= len; ++end) {
+			i = end - re_litlen;
+			if (i < offset || (re_litstart && i))
+				continue;
+			if (re_litci ? memEqualCI(s + i, re_lit, re_litlen)
+			    : !memcmp(s + i, re_lit, re_litlen))
+				goto found;
+		}
+		return PCRE_ERROR_NOMATCH;
+	}
+
+	if (re_litstart) {
+		if (offset || re_litlen > len)
+			return PCRE_ERROR_NOMATCH;
+		i = 0;
+		if (re_litci ? memEqualCI(s, re_lit, re_litlen)
+		    : !memcmp(s, re_lit, re_litlen))
+			goto found;
+		return PCRE_ERROR_NOMATCH;
+	}
+
+	i = litSearch(s, len, offset);
+	if (i < 0)
+		return PCRE_ERROR_NOMATCH;
+
+found:
+	vector[0] = i;
+	vector[1] = i + re_litlen;
+/* no subexpressions, $1 through $9 are empty */
+	for (i = 2; i < 20; ++i)
+		vector[i] = -1;
+	return 1;
+}				/* reExec */
+
 static void regexpCompile(const char *re, bool ci)
 {
 	static signed char try8 = 0;	/* 1 is utf8 on, -1 is utf8 off */
@@ -2450,6 +3521,19 @@ top:
 		}
 	}
 
+	regexpLiteral(re, ci);
+
+	if (reCacheFind(re, re_opt)) {
+		++reHits;
+		debugPrint(5, "regexp cache hit, %d hits %d misses", reHits,
+			   reMisses);
+		return;
+	}
+	++reMisses;
+	debugPrint(5, "regexp cache miss, %d hits %d misses", reHits,
+		   reMisses);
+
+	re_extra = 0;
 	re_cc = pcre_compile(re, re_opt, &re_error, &re_offset, 0);
 	if (!re_cc && try8 > 0 && strstr(re_error, "PCRE_UTF8 support")) {
 		i_puts(MSG_PcreUtf8);
@@ -2462,8 +3546,183 @@ top:
 
 	if (!re_cc)
 		setError(MSG_RexpError, re_error);
+	else
+		reCacheAdd(re, re_opt);
 }				/* regexpCompile */
 
+/*********************************************************************
+Scan a run of lines for the compiled regular expression re_cc.
+This is the matching half of g// and v//, and the /re/ search.
+A big buffer is cut into pieces, and each piece is matched on a thread
+of its own, right against the text of the line, no copy,
+unless we are browsing and have to strip out the hidden numbers.
+pcre_exec is reentrant; each thread has its own vector.
+The threads only read the chunks of the map, and they don't use
+mapLine(), which updates the hint and the line numbers as it goes.
+The main thread finds where each piece starts, before the threads begin,
+and it marks the lines, or whatever, after they are done.
+Nothing else happens while the threads run.
+*********************************************************************/
+
+/* not worth a thread for fewer lines than this */
+#define SCANMIN 20000
+#define SCANTHREADS 8
+
+struct scanPiece {
+	int start, end;		/* lines, in the order we look at them */
+	int incr;		/* 1 or -1 */
+	int c, o;		/* chunk and offset of the start line */
+	uchar *hits;		/* hits[ln - hitbase], or 0 to stop at the first */
+	int hitbase;
+	int first;		/* first line that matches */
+	int bad;		/* first line with bad utf8, if we care */
+	struct lineIndex *map;	/* cw belongs to the main thread */
+	bool browsing;
+	pthread_t tid;
+	bool threaded;
+};
+
+static int scanThreads(void)
+{
+	static int n;
+	if (!n) {
+#ifdef _SC_NPROCESSORS_ONLN
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (n < 1)
+			n = 1;
+		if (n > SCANTHREADS)
+			n = SCANTHREADS;
+	}
+	return n;
+}				/* scanThreads */
+
+static void *scanPieceLines(void *arg)
+{
+	struct scanPiece *p = arg;
+	struct lineIndex *x = p->map;
+	struct lineChunk *k = x->chunks[p->c];
+	int o = p->o, ln = p->start;
+	int vector[11 * 3];
+	int rc, len;
+	bool browsing = p->browsing;
+	pst t, copy = 0;
+
+	while (true) {
+		t = k->lines[o].text;
+		len = pstLength(t) - 1;
+		if (browsing) {
+			nzFree(copy);
+			t = copy = clonePstring(t);
+			removeHiddenNumbers(t, '\n');
+			len = pstLength(t) - 1;
+		}
+		rc = reExec((char *)t, len, 0, vector);
+		if (rc < -1 && pcre_utf8_error_stop) {
+			p->bad = ln;
+			break;
+		}
+		if (rc >= 0) {
+			if (!p->hits) {
+				p->first = ln;
+				break;
+			}
+			p->hits[ln - p->hitbase] = 1;
+		}
+		if (ln == p->end)
+			break;
+		ln += p->incr;
+		o += p->incr;
+		if (o == k->n) {
+			k = x->chunks[++p->c];
+			o = 0;
+		} else if (o < 0) {
+			k = x->chunks[--p->c];
+			o = k->n - 1;
+		}
+	}
+
+	nzFree(copy);
+	return 0;
+}				/* scanPieceLines */
+
+/*********************************************************************
+Scan lines from through to, stepping toward to.
+With hits, set hits[ln - from] for every line that matches, from <= to.
+Without, return the first line that matches, in the order of the scan,
+or 0 if there is none.
+Either way, *bad is set to a line with bad utf8, if pcre_utf8_error_stop
+is set, and such a line came before any match.
+A search usually finds its line close by, so look at the first SCANMIN
+lines here, before splitting the rest up among the threads.
+*********************************************************************/
+
+static int scanLines(int from, int to, int incr, uchar *hits, int *bad)
+{
+	struct lineIndex *x = cw->map;
+	struct scanPiece pieces[SCANTHREADS], *p;
+	int n = (to - from) * incr + 1;
+	int npieces, i, ln, c;
+
+	*bad = 0;
+	if (!hits && n > SCANMIN) {
+		ln = scanLines(from, from + (SCANMIN - 1) * incr, incr, 0, bad);
+		if (ln || *bad)
+			return ln;
+		from += SCANMIN * incr;
+		n -= SCANMIN;
+	}
+
+	npieces = n / SCANMIN;
+	if (npieces > scanThreads())
+		npieces = scanThreads();
+	if (npieces < 1)
+		npieces = 1;
+
+	ln = from;
+	for (i = 0; i < npieces; ++i) {
+		p = pieces + i;
+		memset(p, 0, sizeof(struct scanPiece));
+		p->start = ln;
+		ln += (n / npieces + (i < n % npieces)) * incr;
+		p->end = ln - incr;
+		p->incr = incr;
+		p->hits = hits;
+		p->hitbase = from;
+		p->map = x;
+		p->browsing = cw->browseMode;
+		c = mapFind(x, p->start);
+		p->c = c;
+		p->o = p->start - x->starts[c] - 1;
+	}
+
+/* piece 0 runs here, while the others run on their threads */
+	for (i = 1; i < npieces; ++i) {
+		p = pieces + i;
+		p->threaded = !pthread_create(&p->tid, NULL, scanPieceLines, p);
+		if (!p->threaded)
+			scanPieceLines(p);
+	}
+	scanPieceLines(pieces);
+	for (i = 1; i < npieces; ++i)
+		if (pieces[i].threaded)
+			pthread_join(pieces[i].tid, NULL);
+	if (npieces > 1)
+		debugPrint(5, "scan %d lines %d threads", n, npieces);
+
+/* pieces are in scan order, the first one to find something wins */
+	for (i = 0; i < npieces; ++i) {
+		p = pieces + i;
+		if (p->bad) {
+			*bad = p->bad;
+			return 0;
+		}
+		if (p->first)
+			return p->first;
+	}
+	return 0;
+}				/* scanLines */
+
 /* Get the start or end of a range.
  * Pass the line containing the address. */
 static bool getRangePart(const char *line, int *lineno, const char **split)
@@ -2491,6 +3750,7 @@ static bool getRangePart(const char *line, int *lineno, const char **split)
 		char *re;	/* regular expression */
 		bool ci = caseInsensitive;
 		signed char incr;	/* forward or back */
+		int found, bad;
 /* Don't look through an empty buffer. */
 		if (cw->dol == 0) {
 			setError(MSG_EmptyBuffer);
@@ -2508,39 +3768,33 @@ static bool getRangePart(const char *line, int *lineno, const char **split)
 		regexpCompile(re, ci);
 		if (!re_cc)
 			return false;
-/* We should probably study the pattern, if the file is large.
- * But then again, it's probably not worth it,
- * since the expressions are simple, and the lines are short. */
+/* Look from the line after dot to the end of the buffer,
+ * then wrap around, from the top back down to dot,
+ * or the other way round if searching backwards. */
 		incr = (first == '/' ? 1 : -1);
-		while (true) {
-			char *subject;
-			ln += incr;
-			if (ln > cw->dol)
-				ln = 1;
-			if (ln == 0)
-				ln = cw->dol;
-			subject = (char *)fetchLine(ln, 1);
-			re_count =
-			    pcre_exec(re_cc, 0, subject,
-				      pstLength((pst) subject) - 1, 0, 0,
-				      re_vector, 33);
-			free(subject);
+		found = bad = 0;
+		if (incr > 0) {
+			if (ln < cw->dol)
+				found = scanLines(ln + 1, cw->dol, 1, 0, &bad);
+			if (!found && !bad)
+				found = scanLines(1, ln, 1, 0, &bad);
+		} else {
+			if (ln > 1)
+				found = scanLines(ln - 1, 1, -1, 0, &bad);
+			if (!found && !bad)
+				found = scanLines(cw->dol, ln, -1, 0, &bad);
+		}
 // An error in evaluation is treated like text not found.
 // This usually happens because this particular line has bad binary, not utf8.
-			if (re_count < -1 && pcre_utf8_error_stop) {
-				pcre_free(re_cc);
-				setError(MSG_RexpError2, ln);
-				return (globSub = false);
-			}
-			if (re_count >= 0)
-				break;
-			if (ln == cw->dot) {
-				pcre_free(re_cc);
-				setError(MSG_NotFound);
-				return false;
-			}
-		}		/* loop over lines */
-		pcre_free(re_cc);
+		if (bad) {
+			setError(MSG_RexpError2, bad);
+			return (globSub = false);
+		}
+		if (!found) {
+			setError(MSG_NotFound);
+			return false;
+		}
+		ln = found;
 /* and ln is the line that matches */
 	}
 
@@ -2579,7 +3833,9 @@ static bool doGlobal(const char *line)
 	char delim = *line;
 	struct lineMap *t;
 	char *re;		/* regular expression */
-	int i, origdot, yesdot, nodot;
+	int i, origdot, yesdot, nodot, bad;
+	uchar *hits;
+	bool batch;
 
 	if (!delim) {
 		setError(MSG_RexpMissing, icmd);
@@ -2600,30 +3856,27 @@ static bool doGlobal(const char *line)
 /* clean up any previous global flags.
  * Also get ready for javascript, as in g/<->/ i=+
  * which I use in web based gmail to clear out spam etc. */
-	for (t = cw->map + 1; t->text; ++t)
-		t->gflag = false;
+	for (i = 1; i <= cw->dol; ++i)
+		mapLine(cw->map, i)->gflag = false;
 
 /* Find the lines that match the pattern. */
 	regexpCompile(re, ci);
 	if (!re_cc)
 		return false;
+	hits = allocZeroMem(endRange - startRange + 1);
+	scanLines(startRange, endRange, 1, hits, &bad);
+	if (bad) {
+		free(hits);
+		setError(MSG_RexpError2, bad);
+		return false;
+	}
 	for (i = startRange; i <= endRange; ++i) {
-		char *subject = (char *)fetchLine(i, 1);
-		re_count =
-		    pcre_exec(re_cc, 0, subject, pstLength((pst) subject) - 1,
-			      0, 0, re_vector, 33);
-		free(subject);
-		if (re_count < -1 && pcre_utf8_error_stop) {
-			pcre_free(re_cc);
-			setError(MSG_RexpError2, i);
-			return false;
-		}
-		if (re_count < 0 && cmd == 'v' || re_count >= 0 && cmd == 'g') {
+		if (hits[i - startRange] == (cmd == 'g')) {
 			++gcnt;
-			cw->map[i].gflag = true;
+			mapLine(cw->map, i)->gflag = true;
 		}
-	}			/* loop over line */
-	pcre_free(re_cc);
+	}
+	free(hits);
 
 	if (!gcnt) {
 		setError((cmd == 'v') + MSG_NoMatchG);
@@ -2637,11 +3890,44 @@ static bool doGlobal(const char *line)
 		line = "p";
 	origdot = cw->dot;
 	yesdot = nodot = 0;
+
+/* g/re/d is common enough, and slow enough on a big buffer,
+ * to get a pass of its own. */
+	if (stringEqual(line, "d") &&
+	    !cw->dirMode && !cw->sqlMode && !cw->browseMode) {
+		cmd = 'd';
+		delGlobal();
+		yesdot = cw->dot;
+		goto done;
+	}
+
+/* g/re/p is the default, and needs nothing but a walk down the buffer */
+	if (stringEqual(line, "p")) {
+		cmd = 'p';
+		for (i = 1; i <= cw->dol && !intFlag; ++i) {
+			t = mapLine(cw->map, i);
+			if (!t->gflag)
+				continue;
+			t->gflag = false;
+			displayLine(i);
+			yesdot = i;
+		}
+		goto done;
+	}
+
+/* g/re/s/x/y/ hands the marked lines to substituteRange(), all at once,
+ * when it reaches the first one; see substituteText(). */
+	batch = subMarked = (!cw->dirMode && !cw->sqlMode && !cw->browseMode);
+
+/* Each pass runs down the buffer, and picks up the marked lines as it goes.
+ * A subcommand that moves a marked line up above us, as in g/x/m0,
+ * leaves it for the next pass; the gflag travels with the line,
+ * so no line is done twice, and none are missed. */
 	change = true;
 	while (gcnt && change) {
 		change = false;	/* kinda like bubble sort */
-		for (i = 1; i <= cw->dol; ++i) {
-			t = cw->map + i;
+		for (i = 1; i <= cw->dol && gcnt; ++i) {
+			t = mapLine(cw->map, i);
 			if (!t->gflag)
 				continue;
 			if (intFlag)
@@ -2653,6 +3939,9 @@ static bool doGlobal(const char *line)
 				yesdot = cw->dot;
 /* try this line again, in case we deleted or moved it somewhere else */
 				--i;
+/* a substitute took all the marked lines at once */
+				if (batch && !subMarked)
+					gcnt = 0;
 			} else {
 /* error in subcommand might turn global flag off */
 				if (!globSub) {
@@ -2664,7 +3953,7 @@ static bool doGlobal(const char *line)
 	}			/* loop making changes */
 
 done:
-	globSub = false;
+	globSub = subMarked = false;
 /* yesdot could be 0, even on success, if all lines are deleted via g/re/d */
 	if (yesdot || !cw->dol) {
 		cw->dot = yesdot;
@@ -2701,6 +3990,9 @@ static void fieldNumProblem(int desc, char c, int n, int nt, int nrt)
 /* Perform a substitution on a given line.
  * The lhs has been compiled, and the rhs is passed in for replacement.
  * Refer to the static variable re_cc for the compiled lhs.
+ * The new line is appended to the string *rp, of length *rlp,
+ * so a range of lines can be built up in one string; see substituteRange().
+ * If there is no replacement the string is left as it was.
  * Return true for a replacement, false for no replace, and -1 for a problem. */
 
 static char *replaceString;
@@ -2709,26 +4001,23 @@ static char *replaceStringEnd;
 
 static int
 replaceText(const char *line, int len, const char *rhs,
-	    bool ebmuck, int nth, bool global, int ln)
+	    bool ebmuck, int nth, bool global, int ln, char **rp, int *rlp)
 {
 	int offset = 0, lastoffset, instance = 0;
-	int span;
-	char *r;
-	int rlen;
+	int span, rc;
+	char *r = *rp;
+	int rlen = *rlp, start = rlen;
 	const char *s = line, *s_end, *t;
 	char c, d;
 
-	r = initString(&rlen);
-
 	while (true) {
 /* find the next match */
-		re_count =
-		    pcre_exec(re_cc, 0, line, len, offset, 0, re_vector, 33);
+		re_count = reExec(line, len, offset, re_vector);
 		if (re_count < -1 &&
-		    (pcre_utf8_error_stop || startRange == endRange)) {
+		    (pcre_utf8_error_stop || startRange == endRange || globSub)) {
 			setError(MSG_RexpError2, ln);
-			nzFree(r);
-			return -1;
+			rc = -1;
+			goto fail;
 		}
 
 		if (re_count < 0)
@@ -2738,8 +4027,8 @@ replaceText(const char *line, int len, const char *rhs,
 		offset = re_vector[1];	/* ready for next iteration */
 		if (offset == lastoffset && (nth > 1 || global)) {
 			setError(MSG_ManyEmptyStrings);
-			nzFree(r);
-			return -1;
+			rc = -1;
+			goto fail;
 		}
 
 		if (!global &&instance != nth)
@@ -2844,13 +4133,13 @@ replaceText(const char *line, int len, const char *rhs,
 	}			/* loop matching the regular expression */
 
 	if (!instance) {
-		nzFree(r);
-		return false;
+		rc = false;
+		goto fail;
 	}
 
 	if (!global &&instance < nth) {
-		nzFree(r);
-		return false;
+		rc = false;
+		goto fail;
 	}
 
 /* We got a match, copy the last span. */
@@ -2858,9 +4147,16 @@ replaceText(const char *line, int len, const char *rhs,
 	span = s_end - s;
 	stringAndBytes(&r, &rlen, s, span);
 
-	replaceString = r;
-	replaceStringLength = rlen;
+	*rp = r;
+	*rlp = rlen;
 	return true;
+
+fail:
+	if (rlen > start)
+		r[start] = 0;
+	*rp = r;
+	*rlp = start;
+	return rc;
 }				/* replaceText */
 
 static void
@@ -3036,6 +4332,201 @@ findInputField(const char *line, int ftype, int n, int *total, int *realtotal,
  * and an indication that we need to abort any g// in progress.
  * It's a serious problem. */
 
+/*********************************************************************
+s/x/y/ over a range of lines, in one pass.
+Line by line, each new line is its own string, built up a piece at a time,
+with its own write into the map, and 1,$s/x/y/g on 5 million lines
+is millions of little reallocations and map updates.
+Here the new lines are built up in one string, and the map is updated
+once at the end.
+That string becomes a block, see blockAdopt(), and the new lines point into it.
+It is not copied into the window's arena, because undo frees a line when
+the last level that holds it falls off the stack; text in the arena would
+sit there until the window goes away, and a script that runs 1,$s/x/y/
+over and over would grow without bound. The block goes when its last line does.
+If no replacement has \n in it, the new text is dropped into the chunks,
+right where the old lines were.
+If a line is split, the stretch from the first changed line to the last
+becomes a new piece, and replaces the old lines with one delete and insert.
+Labels and dot come out as though the lines were substituted one at a time,
+as in the loop in substituteText().
+Under g//, marked is true, and the range runs from the first marked line
+to the end of the buffer, but only the lines with gflag set are changed;
+the flags are cleared as we go, and the lines come out as they would
+if g// ran s/x/y/ on each of them in turn.
+This is only for plain text; browse, directory, and sql mode,
+and the bl command, still go line by line.
+*********************************************************************/
+
+struct subChange {
+	int ln;			/* the line, numbered as before the substitute */
+	int off;		/* the new text in the string */
+	int lines;		/* the number of lines it becomes */
+	int shift;		/* lines added by the changes above this one */
+	bool split;		/* the replacement has \n in it */
+};
+
+static int substituteRange(const char *rhs, int nth, bool g_mode,
+			   bool marked)
+{
+	struct subChange *ch = 0, *h;
+	int nch = 0, ach = 0;
+	char *r, *t, *e;
+	int rlen, start;
+	int ln, i, j, added = 0, lastSubst = 0;
+	bool split = false, bad = false;
+	struct lineIndex *x;
+	struct lineChunk *k;
+	struct lineMap *mptr;
+	pst p;
+
+	r = initString(&rlen);
+	for (ln = startRange; ln <= endRange && !intFlag; ++ln) {
+		if (marked && ln > startRange) {
+			mptr = mapLine(cw->map, ln);
+			if (!mptr->gflag)
+				continue;
+			mptr->gflag = false;
+		}
+		p = fetchLine(ln, -1);
+		start = rlen;
+		j = replaceText((char *)p, pstLength(p) - 1, rhs, true, nth,
+				g_mode, ln, &r, &rlen);
+		if (j < 0) {
+			bad = true;
+			break;
+		}
+		if (!j)
+			continue;
+
+		if (nch == ach) {
+			ach = (ach ? ach * 2 : 256);
+			ch = (ch ? reallocMem(ch, ach * sizeof(struct subChange)) :
+			      allocMem(ach * sizeof(struct subChange)));
+		}
+		h = ch + nch++;
+		h->ln = ln;
+		h->off = start;
+		h->lines = 1;
+		h->split = false;
+		e = r + rlen;
+		for (t = r + start; (t = memchr(t, '\n', e - t)); ++t)
+			++h->lines;
+		if (h->lines > 1) {
+			h->split = split = true;
+/* the quirk of a trailing newline on a buffer that had none */
+			if (cw->nlMode && ln == cw->dol && e[-1] == '\n')
+				--h->lines;
+		}
+		h->shift = added;
+		added += h->lines - 1;
+		if (sizeof(int) == 4) {
+			if (added > MAXLINES - cw->dol)
+				i_printfExit(MSG_LineLimit);
+		}
+		stringAndChar(&r, &rlen, '\n');
+	}			/* loop over lines in the range */
+
+	if (!nch) {
+		nzFree(r);
+		goto done;
+	}
+
+/* Even if something went wrong, install the lines that were substituted,
+ * just as the line at a time loop would have. */
+	undoPush();
+	x = cw->map;
+
+	if (!split) {
+		k = 0;
+		j = 0;
+		for (h = ch; h < ch + nch; ++h) {
+			if (!k || h->ln > x->starts[j] + k->n) {
+				j = mapFind(x, h->ln);
+				k = mapOwn(x, j);
+			}
+			mptr = k->lines + h->ln - x->starts[j] - 1;
+			mptr->text = (pst) r + h->off;
+			mptr->home = LT_BLOCK;
+		}
+		blockAdopt(r, rlen, nch);
+	} else {
+		int first = ch[0].ln, last = ch[nch - 1].ln;
+		int n = last - first + 1 + added;
+		struct lineMap *piece = allocZeroMem(n * LMSIZE);
+		mptr = piece;
+		h = ch;
+		for (ln = first; ln <= last; ++ln) {
+			if (ln != h->ln) {
+				*mptr++ = *mapLine(x, ln);
+				continue;
+			}
+			p = (pst) r + h->off;
+			for (i = 0; i < h->lines; ++i) {
+				mptr->text = p;
+				mptr->home = LT_BLOCK;
+				++mptr;
+				p += pstLength(p);
+			}
+			++h;
+		}
+		/* each change becomes h->lines lines, that's nch + added in all */
+		blockAdopt(r, rlen, nch + added);
+		mapDelete(x, first, last);
+		mapInsert(x, first - 1, piece, n);
+		free(piece);
+
+/* move the labels; a line that was split loses its label */
+		for (i = 0; i < MARKLETTERS; ++i) {
+			int lo, hi, mid;
+			ln = cw->labels[i];
+			if (ln < first)
+				continue;
+			lo = 0, hi = nch - 1;
+			while (lo < hi) {
+				mid = (lo + hi + 1) / 2;
+				if (ch[mid].ln <= ln)
+					lo = mid;
+				else
+					hi = mid - 1;
+			}
+			h = ch + lo;
+			if (h->ln == ln && h->split)
+				cw->labels[i] = 0;
+			else if (h->ln == ln)
+				cw->labels[i] += h->shift;
+			else
+				cw->labels[i] += h->shift + h->lines - 1;
+		}
+		cw->dol += added;
+		endRange += added;
+	}
+
+	for (h = ch; h < ch + nch; ++h) {
+		lastSubst = h->ln + h->shift + h->lines - 1;
+		if (subPrint == 2)
+			displayLine(lastSubst);
+	}
+	nzFree(ch);
+
+done:
+	if (bad)
+		return -1;
+	if (intFlag) {
+		setError(MSG_Interrupted);
+		return -1;
+	}
+	if (!lastSubst) {
+		if (!globSub && !errorMsg[0])
+			setError(MSG_NoMatch);
+		return false;
+	}
+	cw->dot = lastSubst;
+	if (subPrint == 1 && !globSub)
+		printDot();
+	return true;
+}				/* substituteRange */
+
 static int substituteText(const char *line)
 {
 	int whichField = 0;
@@ -3135,6 +4626,18 @@ static int substituteText(const char *line)
 	if (!globSub)
 		setError(-1);
 
+	if (!bl_mode && !cw->browseMode && !cw->dirMode && !cw->sqlMode) {
+		if (!globSub && startRange < endRange)
+			return substituteRange(rhs, nth, g_mode, false);
+/* under g//, this marked line and every marked line below it */
+		if (globSub && subMarked && startRange == endRange &&
+		    startRange == cw->dot) {
+			subMarked = false;
+			endRange = cw->dol;
+			return substituteRange(rhs, nth, g_mode, true);
+		}
+	}
+
 	for (ln = startRange; ln <= endRange && !intFlag; ++ln) {
 		char *p;
 		int len;
@@ -3190,16 +4693,23 @@ static int substituteText(const char *line)
 				t = strstr(s, searchend);
 				if (!t)
 					continue;
+				replaceString = initString(&replaceStringLength);
 				j = replaceText(s, t - s, rhs, true, nth,
-						g_mode, ln);
+						g_mode, ln, &replaceString,
+						&replaceStringLength);
 			} else {
+				replaceString = initString(&replaceStringLength);
 				j = replaceText(p, len - 1, rhs, true, nth,
-						g_mode, ln);
+						g_mode, ln, &replaceString,
+						&replaceStringLength);
 			}
 			if (j < 0)
 				goto abort;
-			if (!j)
+			if (!j) {
+				nzFree(replaceString);
+				replaceString = 0;
 				continue;
+			}
 		}
 
 /* Did we split this line into many lines? */
@@ -3282,8 +4792,9 @@ static int substituteText(const char *line)
 			if (!linecount) {
 /* normal substitute */
 				undoPush();
-				mptr = cw->map + ln;
+				mptr = mapLineWrite(cw->map, ln);
 				mptr->text = allocMem(replaceStringLength + 1);
+				mptr->home = LT_HEAP;
 				memcpy(mptr->text, replaceString,
 				       replaceStringLength + 1);
 				if (cw->dirMode || cw->sqlMode) {
@@ -3318,9 +4829,6 @@ static int substituteText(const char *line)
 		breakLineResult = 0;
 	}			/* loop over lines in the range */
 
-	if (re_cc)
-		pcre_free(re_cc);
-
 	if (intFlag) {
 		setError(MSG_Interrupted);
 		return -1;
@@ -3339,8 +4847,6 @@ static int substituteText(const char *line)
 	return true;
 
 abort:
-	if (re_cc)
-		pcre_free(re_cc);
 	nzFree(replaceString);
 /* we may have just freed the result of a breakline command */
 	breakLineResult = 0;
@@ -3642,12 +5148,18 @@ pwd:
 			freeWindowLines(cw->map);
 			cw->map = cw->r_map;
 			cw->r_map = 0;
+			arenaFree(cw->arena);
+			cw->arena = cw->r_arena;
+			cw->r_arena = 0;
 		} else {
 et_go:
 			for (i = 1; i <= cw->dol; ++i)
-				removeHiddenNumbers(cw->map[i].text, '\n');
+				removeHiddenNumbers(mapLine(cw->map, i)->text,
+						    '\n');
 			freeWindowLines(cw->r_map);
 			cw->r_map = 0;
+			arenaFree(cw->r_arena);
+			cw->r_arena = 0;
 		}
 		freeTags(cw);
 		cw->mustrender = false;
@@ -3820,6 +5332,28 @@ et_go:
 		return true;
 	}
 
+	if (!strncmp(line, "bgkill", 6) &&
+	    (!line[6] || (line[6] == ' ' && isdigitByte(line[7])))) {
+		n = (line[6] ? atoi(line + 7) : 0);
+		if (!bgKill(n) && n) {
+			setError(MSG_NoDownJob, n);
+			return false;
+		}
+		return true;
+	}
+
+	if (!strncmp(line, "bgrate", 6)) {
+		c = line[6];
+		if (!c) {
+			printf("%ld\n", downRate);
+			return true;
+		}
+		if (c == ' ' && isdigitByte(line[7])) {
+			downRate = atol(line + 7);
+			return true;
+		}
+	}
+
 	if (stringEqual(line, "bflist")) {
 		for (n = 1; n < MAXSESSION; ++n) {
 			struct ebWindow *lw = sessionList[n].lw;
@@ -4117,7 +5651,7 @@ bool unfoldBufferW(const struct ebWindow * w, bool cr, char **data, int *len)
 	buf = allocMem(size + 4);
 	*data = buf;
 	for (ln = 1; ln <= w->dol; ++ln) {
-		pst line = w->map[ln].text;
+		pst line = mapLine(w->map, ln)->text;
 		l = pstLength(line) - 1;
 		if (l) {
 			memcpy(buf, line, l);
@@ -4656,23 +6190,8 @@ replaceframe:
 		return balanceLine(line);
 	}
 
-	if (cmd == 'u') {
-		struct ebWindow *uw = &undoWindow;
-		struct lineMap *swapmap;
-		if (!cw->undoable) {
-			setError(MSG_NoUndo);
-			return false;
-		}
-/* swap, so we can undo our undo, if need be */
-		i = uw->dot, uw->dot = cw->dot, cw->dot = i;
-		i = uw->dol, uw->dol = cw->dol, cw->dol = i;
-		for (j = 0; j < MARKLETTERS; ++j) {
-			i = uw->labels[j], uw->labels[j] =
-			    cw->labels[j], cw->labels[j] = i;
-		}
-		swapmap = uw->map, uw->map = cw->map, cw->map = swapmap;
-		return true;
-	}
+	if (cmd == 'u' || cmd == 'U')
+		return undoCommand(cmd == 'U');
 
 	if (cmd == 'k') {
 		if (!islowerByte(first) || line[1]) {
@@ -5457,13 +6976,16 @@ redirect:
 		}
 		newhash = cloneString(s);
 		unpercentString(newhash);
-		for (i = 1; i <= cw->dol; ++i) {
-			char *p = (char *)fetchLine(i, -1);
-			if (lineHasTag(p, newhash)) {
-				cw->dot = i;
-				printDot();
-				nzFree(newhash);
-				return true;
+/* the tag index says whether there is such a label at all */
+		if (tagFromAnchor(newhash)) {
+			for (i = 1; i <= cw->dol; ++i) {
+				char *p = (char *)fetchLine(i, -1);
+				if (lineHasTag(p, newhash)) {
+					cw->dot = i;
+					printDot();
+					nzFree(newhash);
+					return true;
+				}
 			}
 		}
 		setError(MSG_NoLable2, newhash);
@@ -5762,6 +7284,8 @@ bool browseCurrentBuffer(void)
 	cw->dot = cw->dol = 0;
 	cw->r_map = cw->map;
 	cw->map = 0;
+	cw->r_arena = cw->arena;
+	cw->arena = 0;
 	memcpy(cw->r_labels, cw->labels, sizeof(cw->labels));
 	memset(cw->labels, 0, sizeof(cw->labels));
 	j = strlen(newbuf);
@@ -1,27 +1,44 @@
 /*********************************************************************
 cache.c: maintain a cache of the http files.
 The url is the key.
-The result is a string that holds a 5 digit filename, the etag,
-last modified time, last access time, and file size.
-nnnnn tab etag tab last-mod tab access tab size
+The result is a string that holds an 8 digit hex filename, the etag,
+last modified time, last access time, file size, when it expires,
+how the file is compressed, its length uncompressed, and the content type.
+url tab nnnnnnnn tab etag tab last-mod tab access tab size tab expires tab
+codec tab length tab type
+The first line of the file is a generation number, see readControl().
+The files are spread over 256 subdirectories, by the last two hex digits,
+so no directory gets too big, even with a million files in the cache.
 The access time helps us clean house; delete the oldest files.
 If you change the format of this file in any way, increment the version number.
 Previous cache files will be left hanging around, but oh well.
 Not expecting to change this file format very often.
 cacheDir is the directory holding the cached files,
 and cacheControl is the file that houses the database.
-I open a lock file with O_EXCL when accessing the cache,
-and if busy then I wait a few milliseconds and try again.
+Access to the cache is under a lock, see setLock().
+The etag and last-mod time go back to the server as If-None-Match
+and If-Modified-Since, and a 304 response says our copy is still good.
+A file that is fresh, by the max-age of the server, doesn't go to the
+server at all, see lookupCache().
 If the stored etag and header etag are both present, and don't match,
 then the file is stale.
 If one or the other etag is missing, and mod time website > mod time cached,
 then the file is stale.
 We don't even query the cache if we don't have at least one of etag or mod time.
+Html and javascript shrink several fold under zlib, so files are compressed
+on the way in, if that saves space, and inflated straight into the
+buffer that is handed back, on the way out. The size is the size on disk.
 *********************************************************************/
 
 #include "eb.h"
 
-#define CACHECONTROLVERSION 1
+#include <zlib.h>
+
+#define CACHECONTROLVERSION 5
+
+/* how the file is stored */
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
 
 #ifdef DOSLIKE
 #define USLEEP(a) Sleep(a / 1000)	// sleep millisecs
@@ -30,6 +47,8 @@ We don't even query the cache if we don't have at least one of etag or mod time.
 #endif
 
 static int control_fh = -1;	/* file handle for cacheControl */
+static int lock_fh = -1;	/* file handle for cacheLock */
+static bool lockExclusive;	/* we hold the write lock */
 static char *cache_data;
 static time_t now_t;
 static char *cacheFile, *cacheLock, *cacheControl;
@@ -38,16 +57,59 @@ static char *cacheFile, *cacheLock, *cacheControl;
 struct CENTRY {
 	off_t offset;
 	size_t textlength;
-	const char *url;
-	int filenumber;
+	const char *url;	/* 0 if this slot is free */
+	unsigned filenumber;
 	const char *etag;
-	int modtime;
-	int accesstime;
+	time_t modtime;
+	int accesstime;		/* in 8 second chunks */
 	int pages;		/* in 4K pages */
+	time_t expires;		/* fresh until then, 0 if we always ask */
+	int codec;		/* CODEC_NONE or CODEC_ZLIB */
+	int length;		/* bytes, uncompressed */
+	const char *content;	/* content type from the http header */
+	int hnext;		/* next entry with this url hash, -1 at the end */
+	int fnext;		/* next entry with this file number hash */
+	char own;		/* url or etag allocated, not in cache_data */
 };
+#define OWN_URL 1
+#define OWN_ETAG 2
+#define OWN_CONTENT 4
 
 static struct CENTRY *entries;
-static int numentries;
+static int numentries;		/* slots in use, including free ones */
+static int liveEntries;		/* files in the cache */
+static int allocEntries;
+static int freeSlot = -1;	/* free slots, chained through hnext */
+static long totalPages;
+/* bytes in the control file, and bytes of deleted records */
+static off_t controlBytes, deadBytes;
+/* generation of the control file that entries reflects, -1 if none */
+static long control_gen = -1;
+/* hash of the url, or the file number, to the first entry in its chain */
+static int *hashHeads, *fileHeads;
+static int hashSize;
+
+/* Forget what we know about the control file, it will be read again. */
+static void freeEntries(void)
+{
+	struct CENTRY *e = entries;
+	int i;
+	for (i = 0; i < numentries; ++i, ++e) {
+		if (e->own & OWN_URL)
+			nzFree((char *)e->url);
+		if (e->own & OWN_ETAG)
+			nzFree((char *)e->etag);
+		if (e->own & OWN_CONTENT)
+			nzFree((char *)e->content);
+	}
+	numentries = liveEntries = 0;
+	freeSlot = -1;
+	totalPages = 0;
+	controlBytes = deadBytes = 0;
+	nzFree(cache_data);
+	cache_data = 0;
+	control_gen = -1;
+}				/* freeEntries */
 
 void setupEdbrowseCache(void)
 {
@@ -57,6 +119,10 @@ void setupEdbrowseCache(void)
 		close(control_fh);
 		control_fh = -1;
 	}
+	if (lock_fh >= 0) {
+		close(lock_fh);
+		lock_fh = -1;
+	}
 #ifdef DOSLIKE
 	if (!cacheDir) {
 		if (!ebUserDir)
@@ -99,44 +165,282 @@ void setupEdbrowseCache(void)
 		close(fh);
 
 	nzFree(cacheLock);
-	cacheLock = allocMem(strlen(cacheDir) + 6);
-	sprintf(cacheLock, "%s/lock", cacheDir);
+	cacheLock = allocMem(strlen(cacheDir) + 8);
+	sprintf(cacheLock, "%s/rwlock", cacheDir);
 
 	nzFree(cacheFile);
-	cacheFile = allocMem(strlen(cacheDir) + 7);
+	cacheFile = allocMem(strlen(cacheDir) + 13);
 
+	freeEntries();
 	nzFree(entries);
-	entries = allocMem(cacheCount * sizeof(struct CENTRY));
+	entries = 0;
+	allocEntries = 0;
+	nzFree(hashHeads);
+	nzFree(fileHeads);
+	hashHeads = fileHeads = 0;
+	hashSize = 0;
 }				/* setupEdbrowseCache */
 
+/* a random 32 bit number, rand() could be only 15 bits */
+static unsigned rand32(void)
+{
+	return ((unsigned)rand() << 20) ^ ((unsigned)rand() << 10) ^
+	    (unsigned)rand();
+}				/* rand32 */
+
+/* the file behind a file number, in cacheFile */
+static void cacheFileName(unsigned n)
+{
+	sprintf(cacheFile, "%s/%02x/%08x", cacheDir, n & 0xff, n);
+}				/* cacheFileName */
+
+/*********************************************************************
+Urls are found through a hash table, not a linear scan with sameURL().
+The hash is over the part of the url that sameURL() compares,
+without http://, #hash, or .browse, and with the post data,
+so urls that sameURL() calls equal land in the same chain.
+File numbers are hashed too, so a new file number is checked in one step.
+The chains run through the entries, by index.
+The tables grow with the cache, and are never more than full.
+*********************************************************************/
+
+static unsigned urlHash(const char *s)
+{
+	const char *p, *u;
+	unsigned h = 5381;
+
+	p = strchr(s, '\1');
+	if (!p)
+		p = s + strlen(s);
+	for (u = p; *u; ++u)
+		h = h * 33 + (uchar) * u;
+	if (u = findHash(s))
+		p = u;
+	if (memEqualCI(s, "http://", 7))
+		s += 7;
+	if (p - s >= 7 && stringEqual(p - 7, ".browse"))
+		p -= 7;
+	for (u = s; u < p; ++u)
+		h = h * 33 + (uchar) * u;
+	return h;
+}				/* urlHash */
+
+static void hashEntry(int i)
+{
+	struct CENTRY *e = entries + i;
+	int slot = urlHash(e->url) & (hashSize - 1);
+	e->hnext = hashHeads[slot];
+	hashHeads[slot] = i;
+	slot = e->filenumber & (hashSize - 1);
+	e->fnext = fileHeads[slot];
+	fileHeads[slot] = i;
+}				/* hashEntry */
+
+/* Build the hash tables again, bigger if the cache has grown. */
+static void hashBuild(void)
+{
+	int i, size;
+
+	for (size = 1024; size < liveEntries; size *= 2) ;
+	if (size != hashSize) {
+		nzFree(hashHeads);
+		nzFree(fileHeads);
+		hashSize = size;
+		hashHeads = allocMem(hashSize * sizeof(int));
+		fileHeads = allocMem(hashSize * sizeof(int));
+	}
+	for (i = 0; i < hashSize; ++i)
+		hashHeads[i] = fileHeads[i] = -1;
+	for (i = 0; i < numentries; ++i)
+		if (entries[i].url)
+			hashEntry(i);
+}				/* hashBuild */
+
+static void hashRemove(int i)
+{
+	struct CENTRY *e = entries + i;
+	int *p = hashHeads + (urlHash(e->url) & (hashSize - 1));
+	while (*p != i)
+		p = &entries[*p].hnext;
+	*p = e->hnext;
+	p = fileHeads + (e->filenumber & (hashSize - 1));
+	while (*p != i)
+		p = &entries[*p].fnext;
+	*p = e->fnext;
+}				/* hashRemove */
+
+static struct CENTRY *findEntry(const char *url)
+{
+	int i = hashHeads[urlHash(url) & (hashSize - 1)];
+	for (; i >= 0; i = entries[i].hnext)
+		if (sameURL(url, entries[i].url))
+			return entries + i;
+	return 0;
+}				/* findEntry */
+
+/* A slot for a new entry, the caller fills it in and calls addEntry() */
+static struct CENTRY *newEntry(void)
+{
+	struct CENTRY *e;
+	if (freeSlot >= 0) {
+		e = entries + freeSlot;
+		freeSlot = e->hnext;
+		return e;
+	}
+	if (numentries == allocEntries) {
+		allocEntries = (allocEntries ? allocEntries * 2 : 1024);
+		entries = (entries ?
+			   reallocMem(entries,
+				      allocEntries * sizeof(struct CENTRY)) :
+			   allocMem(allocEntries * sizeof(struct CENTRY)));
+	}
+	return entries + numentries++;
+}				/* newEntry */
+
+static void addEntry(struct CENTRY *e)
+{
+	++liveEntries;
+	totalPages += e->pages;
+	if (liveEntries > hashSize)
+		hashBuild();
+	else
+		hashEntry(e - entries);
+}				/* addEntry */
+
+static void dropEntry(struct CENTRY *e)
+{
+	hashRemove(e - entries);
+	--liveEntries;
+	totalPages -= e->pages;
+	if (e->own & OWN_URL)
+		nzFree((char *)e->url);
+	if (e->own & OWN_ETAG)
+		nzFree((char *)e->etag);
+	if (e->own & OWN_CONTENT)
+		nzFree((char *)e->content);
+	e->url = 0;
+	e->hnext = freeSlot;
+	freeSlot = e - entries;
+}				/* dropEntry */
+
 /*********************************************************************
 Read the control file into memory and parse it into entry structures.
-Sadly, I do this every time you access the cache.
-It would be better to hold all this data in memory, with the time stamp of the
-control file, and if the control file has not been updated
-then just use what we have;
-and if it has been updated then read it and parse it.
-Well maybe we'll implement this later.
-For now, the control file isn't too big, it's not prohibitive
-to do this every time.
+This used to happen every time you accessed the cache,
+and a page with 200 images and scripts read and parsed the file 200 times.
+Now the entries stay in memory, and are read again only if another
+edbrowse process has changed the control file.
+The first line is a generation number, 10 digits,
+and every process that changes the file bumps it, under the lock.
+Reading those 11 bytes tells us whether what we have is current.
+An empty file is generation 0. The first write starts the count at
+the current time. Clearing the cache doesn't empty the file;
+it leaves a generation past the last one, or the current time,
+whichever is greater, because the count runs ahead of the clock,
+and another process may still hold the old entries under a recent number.
+A record that is deleted, or has to move because it changed length,
+is blanked out in place, and the new record goes on the end.
+So storing a file, or evicting one, writes a line or two,
+no matter how big the cache is.
+The blank lines are squeezed out, by rewriting the file,
+when they are more than half of it, which doesn't happen very often.
 Note that control is a nice ascii readable file, helps with debugging.
 *********************************************************************/
 
+#define GENLENGTH 11
+
+/* Truncate the control file in a portable way.
+ * We already opened the file read write, so can't imagine why this wouldn't work. */
+static void clobber(void)
+{
+	int fh = open(cacheControl, O_WRONLY | O_TRUNC);
+	if (fh >= 0)
+		close(fh);
+}
+
+/* the generation on disk, 0 for an empty file, -1 for trouble */
+static long diskGeneration(void)
+{
+	char buf[GENLENGTH + 1];
+	int n;
+	lseek(control_fh, 0L, 0);
+	n = read(control_fh, buf, GENLENGTH);
+	if (n == 0)
+		return 0;
+	if (n != GENLENGTH || buf[GENLENGTH - 1] != '\n')
+		return -1;
+	buf[GENLENGTH] = 0;
+	return strtol(buf, 0, 10);
+}				/* diskGeneration */
+
+/* We are about to change the control file; bump the generation. */
+static void newGeneration(void)
+{
+	char buf[24];		/* room for any long */
+	if (control_gen <= 0)
+		control_gen = now_t;
+	++control_gen;
+	if (snprintf(buf, sizeof(buf), "%010ld\n", control_gen) != GENLENGTH) {
+/* past 9999999999, that's the year 2286 */
+		debugPrint(1, "cache generation %ld overflows", control_gen);
+		return;
+	}
+	lseek(control_fh, 0L, 0);
+	write(control_fh, buf, GENLENGTH);
+	if (controlBytes < GENLENGTH)
+		controlBytes = GENLENGTH;
+}				/* newGeneration */
+
+/* The control file was just emptied. Put a generation back,
+ * past the last one we saw, so the count never repeats. */
+static void restartGeneration(long last)
+{
+	control_gen = (last > now_t ? last : now_t);
+	newGeneration();
+}				/* restartGeneration */
+
 static bool readControl(void)
 {
 	char *s, *t, *endfile;
 	char *data;
 	int datalen;
 	struct CENTRY *e;
+	long gen = diskGeneration();
+	long last = control_gen;
+	bool restart = false;
 
+	if (gen >= 0 && gen == control_gen)
+		return true;
+
+	freeEntries();
 	lseek(control_fh, 0L, 0);
 	if (!fdIntoMemory(control_fh, &data, &datalen))
 		return false;
+	cache_data = data;	/* held until the file changes */
 
-	numentries = 0;
-	e = entries;
 	endfile = data + datalen;
-	for (s = data; s != endfile; s = t) {
+	s = data;
+	if (datalen) {
+		if (gen <= 0 || datalen < GENLENGTH) {
+/* not a file we wrote, or not one we can use */
+			debugPrint(3, "cache control file is corrupt");
+/* A reader can't fix it; the next process that stores a file will. */
+			if (!lockExclusive) {
+				freeEntries();
+				return false;
+			}
+			clobber();
+			restart = true;
+			endfile = data;
+		} else
+			s += GENLENGTH;
+	}
+	controlBytes = endfile - data;
+	if (restart) {
+		restartGeneration(last > gen ? last : gen);
+		gen = control_gen;
+	}
+
+	for (; s != endfile; s = t) {
 		t = strchr(s, '\n');
 		if (!t) {
 /* file does not end in newline; this should never happen! */
@@ -144,40 +448,49 @@ static bool readControl(void)
 			break;
 		}
 		++t;
+		if (*s == ' ' || *s == '\n') {
+/* a deleted record */
+			deadBytes += t - s;
+			continue;
+		}
+		e = newEntry();
 		e->offset = s - data;
 		e->textlength = t - s;
 		e->url = s;
+		e->own = 0;
 		s = strchr(s, '\t');
 		*s++ = 0;
-		e->filenumber = strtol(s, &s, 10);
+		e->filenumber = strtoul(s, &s, 16);
 		++s;
 		e->etag = s;
 		s = strchr(s, '\t');
 		*s++ = 0;
-		sscanf(s, "%d %d %d", &e->modtime, &e->accesstime, &e->pages);
-		++e, ++numentries;
+		e->modtime = strtol(s, &s, 10);
+		e->accesstime = strtol(s, &s, 10);
+		e->pages = strtol(s, &s, 10);
+		e->expires = strtol(s, &s, 10);
+		e->codec = strtol(s, &s, 10);
+		e->length = strtol(s, &s, 10);
+		e->content = ++s;
+		t[-1] = 0;
+		++liveEntries;
+		totalPages += e->pages;
 	}
 
-	cache_data = data;	/* remember to free this later */
+	hashBuild();
+	control_gen = gen;
+	debugPrint(4, "cache control read, %d entries", liveEntries);
 	return true;
 }				/* readControl */
 
-/* Truncate the control file in a portable way.
- * We already opened the file read write, so can't imagine why this wouldn't work. */
-static void clobber(void)
-{
-	int fh = open(cacheControl, O_WRONLY | O_TRUNC);
-	if (fh >= 0)
-		close(fh);
-}
-
 /* create an ascii equivalent for a record, this is allocated */
 static char *record2string(const struct CENTRY *e)
 {
 	char *t;
-	asprintf(&t, "%s\t%05d\t%s\t%d\t%d\t%d\n",
-		 e->url, e->filenumber, e->etag, e->modtime, e->accesstime,
-		 e->pages);
+	asprintf(&t, "%s\t%08x\t%s\t%ld\t%d\t%d\t%ld\t%d\t%d\t%s\n",
+		 e->url, e->filenumber, e->etag, (long)e->modtime,
+		 e->accesstime, e->pages, (long)e->expires, e->codec,
+		 e->length, e->content);
 	return t;
 }				/* record2string */
 
@@ -188,18 +501,26 @@ static bool writeControl(void)
 {
 	struct CENTRY *e;
 	int i;
+	off_t offset = GENLENGTH;
 	FILE *f;
 
+	debugPrint(4, "cache control rewrite, %d entries", liveEntries);
 	lseek(control_fh, 0L, 0);
 	clobber();
+	newGeneration();
 /* buffered IO is more efficient */
 	f = fdopen(control_fh, "w");
 
 	e = entries;
 	for (i = 0; i < numentries; ++i, ++e) {
 		int rc;
-		char *newrec = record2string(e);
+		char *newrec;
+		if (!e->url)
+			continue;
+		newrec = record2string(e);
 		e->textlength = strlen(newrec);
+		e->offset = offset;
+		offset += e->textlength;
 		rc = fprintf(f, "%s", newrec);
 		free(newrec);
 		if (rc <= 0) {
@@ -212,33 +533,186 @@ static bool writeControl(void)
 
 	fclose(f);
 	control_fh = -1;
+	controlBytes = offset;
+	deadBytes = 0;
 	return true;
 }				/* writeControl */
 
+/* Blank out the record in the control file, leaving the newline. */
+static void killRecord(struct CENTRY *e)
+{
+	char blanks[256];
+	int n, len = e->textlength - 1;
+	memset(blanks, ' ', sizeof(blanks));
+	lseek(control_fh, e->offset, 0);
+	for (; len; len -= n) {
+		n = (len > (int)sizeof(blanks) ? (int)sizeof(blanks) : len);
+		write(control_fh, blanks, n);
+	}
+	deadBytes += e->textlength;
+}				/* killRecord */
+
+/* Write the record for this entry, in place if it is the same length,
+ * or on the end of the file. Pass append for a new entry.
+ * The caller has already called newGeneration(). */
+static void putRecord(struct CENTRY *e, bool append)
+{
+	char *newrec = record2string(e);
+	size_t newlen = strlen(newrec);
+	if (!append && newlen == e->textlength) {
+		lseek(control_fh, e->offset, 0);
+	} else {
+		if (!append)
+			killRecord(e);
+		e->offset = lseek(control_fh, 0L, 2);
+		e->textlength = newlen;
+		controlBytes += newlen;
+	}
+	write(control_fh, newrec, newlen);
+	free(newrec);
+}				/* putRecord */
+
+/* Rewrite a record in place, if it is still the same length.
+ * The generation stays the same; see fetchCache(). */
+static bool touchRecord(const struct CENTRY *e)
+{
+	char *newrec = record2string(e);
+	size_t newlen = strlen(newrec);
+	bool rc = (newlen == e->textlength);
+	if (rc) {
+		lseek(control_fh, e->offset, 0);
+		write(control_fh, newrec, newlen);
+	}
+	free(newrec);
+	return rc;
+}				/* touchRecord */
+
+static void clearCacheInternal(void);
+
+/* squeeze out the blank lines if there are enough of them */
+static void squeezeControl(void)
+{
+	if (deadBytes < 0x10000 || deadBytes * 2 < controlBytes)
+		return;
+	if (!writeControl())
+		clearCacheInternal();
+}				/* squeezeControl */
+
 /* create a file number to fold into the file name.
- * This is chosen at random. At worst we should get
- * an unused number in 2 or 3 tries. */
-static int generateFileNumber(void)
+ * This is chosen at random, and checked against the hash of file numbers.
+ * At worst we should get an unused number in 2 or 3 tries. */
+static unsigned generateFileNumber(void)
 {
-	struct CENTRY *e;
-	int i, n;
+	unsigned n;
+	int i;
 
 	while (true) {
-		n = rand() % 100000;
-		e = entries;
-		for (i = 0; i < numentries; ++i, ++e)
-			if (e->filenumber == n)
+		n = rand32();
+		for (i = fileHeads[n & (hashSize - 1)]; i >= 0;
+		     i = entries[i].fnext)
+			if (entries[i].filenumber == n)
 				break;
-		if (i == numentries)
+		if (i < 0)
 			return n;
 	}
 }				/* generateFileNumber */
 
-/* get exclusive access to the cache */
-static bool setLock(void)
+/*********************************************************************
+Make room for a new file of so many pages.
+The cache is full when it holds cacheCount files,
+or cacheSize megabytes.
+We don't sort the whole cache to find the oldest files;
+that's a lot of work when there are a million of them.
+Instead, look at 16 entries at random, and throw out the one that
+was accessed longest ago. This approximates lru very well,
+and costs the same whatever the size of the cache.
+Evict just enough to fit the new file, or the growth of a file we rewrote,
+rather than 100 at a clip. The file we rewrote, keep, is never evicted.
+*********************************************************************/
+
+#define EVICTSAMPLE 16
+
+static void makeRoom(int pages, const struct CENTRY *keep)
+{
+	struct CENTRY *e, *oldest;
+	int i, j, n = 0;
+	long maxPages = (long)cacheSize * 256;
+/* a new file needs a slot, a file that grows already has one */
+	int slot = (keep ? 0 : 1);
+	int others = liveEntries - (keep ? 1 : 0);
+
+	while (others > 0 &&
+	       (liveEntries + slot > cacheCount
+		|| totalPages + pages > maxPages)) {
+		oldest = 0;
+		for (i = j = 0; i < EVICTSAMPLE && j < EVICTSAMPLE * 8; ++j) {
+			e = entries + rand32() % numentries;
+			if (!e->url || e == keep)
+				continue;
+			++i;
+			if (!oldest || e->accesstime < oldest->accesstime)
+				oldest = e;
+		}
+		if (!oldest) {
+/* a lot of free slots, find anything */
+			for (e = entries; !e->url || e == keep; ++e) ;
+			oldest = e;
+		}
+		cacheFileName(oldest->filenumber);
+		unlink(cacheFile);
+		killRecord(oldest);
+		dropEntry(oldest);
+		--others;
+		++n;
+	}
+
+	if (n)
+		debugPrint(3, "cache is full; removed %d old files", n);
+}				/* makeRoom */
+
+/*********************************************************************
+Lock the cache, shared to look something up, exclusive to change it.
+Any number of edbrowse processes, and their edbrowse-js processes,
+can read the cache at once, and a writer waits only for other writers,
+and for the readers that are there already.
+This is an fcntl() lock on the lock file, which stays open.
+The system drops the lock if the process dies,
+so there are no stale lock files to clean up after a crash.
+The lock is on its own file, not on the control file,
+because writeControl() closes the control file, and closing any
+descriptor of a file drops the process's locks on that file.
+Windows doesn't have fcntl locks, so there it is the old way,
+a lock file created with O_EXCL, tried every 10 ms for a second,
+and that is always exclusive.
+*********************************************************************/
+
+static bool openControl(void)
+{
+#ifndef DOSLIKE
+/* A child process, forked after we opened the control file,
+ * shares its file offset with us; it needs a descriptor of its own. */
+	static pid_t control_pid;
+	if (control_fh >= 0 && control_pid != getpid()) {
+		close(control_fh);
+		control_fh = -1;
+	}
+	control_pid = getpid();
+#endif
+	if (control_fh < 0) {
+		control_fh = open(cacheControl, O_RDWR | O_BINARY, 0);
+		if (control_fh < 0)
+			return false;
+	}
+	if (!readControl())
+		return false;
+	return true;
+}				/* openControl */
+
+#ifdef DOSLIKE
+
+static bool setLock(bool exclusive)
 {
 	int i;
-	int lock_fh;
 	time_t lock_t;
 
 	if (!cacheDir)
@@ -254,16 +728,10 @@ top:
 		lock_fh = open(cacheLock, O_WRONLY | O_EXCL | O_CREAT, 0666);
 		if (lock_fh >= 0) {	/* got it */
 			close(lock_fh);
-			if (control_fh < 0) {
-				control_fh =
-				    open(cacheControl, O_RDWR | O_BINARY, 0);
-				if (control_fh < 0) {
+			lock_fh = -1;
+			lockExclusive = true;
+			if (!openControl()) {
 /* got the lock but couldn't open the database */
-					unlink(cacheLock);
-					return false;
-				}
-			}
-			if (!readControl()) {
 				unlink(cacheLock);
 				return false;
 			}
@@ -285,153 +753,321 @@ top:
 	return false;
 }				/* setLock */
 
+/* we already have the lock, and it is exclusive */
+static bool upgradeLock(void)
+{
+	return true;
+}				/* upgradeLock */
+
 static void clearLock(void)
 {
 	unlink(cacheLock);
 }				/* clearLock */
 
+#else
+
+static bool lockControl(int type, bool wait)
+{
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	while (fcntl(lock_fh, (wait ? F_SETLKW : F_SETLK), &fl) < 0)
+		if (errno != EINTR)
+			return false;
+	return true;
+}				/* lockControl */
+
+static bool setLock(bool exclusive)
+{
+	if (!cacheDir)
+		return false;
+	if (!cacheSize)
+		return false;
+
+	time(&now_t);
+
+	if (lock_fh < 0) {
+		lock_fh = open(cacheLock, O_RDWR | O_CREAT, 0600);
+		if (lock_fh < 0)
+			return false;
+	}
+	if (!lockControl((exclusive ? F_WRLCK : F_RDLCK), true)) {
+		debugPrint(3, "cannot lock the cache, errno %d", errno);
+		return false;
+	}
+	lockExclusive = exclusive;
+
+	if (!openControl()) {
+/* got the lock but couldn't open the database */
+		lockControl(F_UNLCK, false);
+		return false;
+	}
+	return true;
+}				/* setLock */
+
+/* We have a shared lock, and would like to write.
+ * Don't wait; if another process is reading, or wants to write,
+ * waiting could deadlock against its own upgrade,
+ * so let the caller skip the write. */
+static bool upgradeLock(void)
+{
+	if (lockExclusive)
+		return true;
+	if (!lockControl(F_WRLCK, false))
+		return false;
+	lockExclusive = true;
+/* can't have changed, another writer would have had to get past our lock */
+	return true;
+}				/* upgradeLock */
+
+static void clearLock(void)
+{
+	lockControl(F_UNLCK, false);
+	lockExclusive = false;
+}				/* clearLock */
+
+#endif
+
+
 /* Remove any cached files and initialize the database */
 static void clearCacheInternal(void)
 {
 	struct CENTRY *e;
 	int i;
+	long last = control_gen;
 
 	debugPrint(3, "clear cache");
 
 /* loop through and remove the files */
 	e = entries;
 	for (i = 0; i < numentries; ++i, ++e) {
-		sprintf(cacheFile, "%s/%05d", cacheDir, e->filenumber);
+		if (!e->url)
+			continue;
+		cacheFileName(e->filenumber);
 		unlink(cacheFile);
 	}
 
 	clobber();
+/* and we know what's in an empty file */
+	freeEntries();
+	hashBuild();
+/* writeControl() may have closed it */
+	if (control_fh < 0)
+		control_fh = open(cacheControl, O_RDWR | O_BINARY, 0);
+	if (control_fh >= 0)
+		restartGeneration(last);
 }				/* clearCacheInternal */
 
 void clearCache(void)
 {
-	if (!setLock())
+	if (!setLock(true))
 		return;
 	clearCacheInternal();
-	free(cache_data);
 	clearLock();
 }				/* clearCache */
 
+/*********************************************************************
+Read the cached file, named by cacheFile, into an allocated string,
+with a null byte on the end, as fileIntoMemory() would.
+A compressed file is inflated a chunk at a time, right into the string,
+whose length we know from the control entry,
+so there is never a second copy of the data in memory.
+*********************************************************************/
+
+static bool readCacheFile(const struct CENTRY *e, char **data,
+			  int *data_len)
+{
+	int fh, n;
+	int ret = Z_OK;
+	z_stream zs;
+	char *buf;
+	char chunk[8192];
+
+	if (e->codec == CODEC_NONE)
+		return fileIntoMemory(cacheFile, data, data_len);
+	if (e->codec != CODEC_ZLIB)
+		return false;
+
+	fh = open(cacheFile, O_RDONLY | O_BINARY);
+	if (fh < 0)
+		return false;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		close(fh);
+		return false;
+	}
+	buf = allocMem(e->length + 2);
+	zs.next_out = (Bytef *) buf;
+	zs.avail_out = e->length;
+	while (ret == Z_OK) {
+		n = read(fh, chunk, sizeof(chunk));
+		if (n <= 0)
+			break;
+		zs.next_in = (Bytef *) chunk;
+		zs.avail_in = n;
+		ret = inflate(&zs, Z_NO_FLUSH);
+	}
+	inflateEnd(&zs);
+	close(fh);
+
+	if (ret != Z_STREAM_END || zs.total_out != (uLong) e->length) {
+		debugPrint(3, "cache file %s is corrupt", cacheFile);
+		nzFree(buf);
+		return false;
+	}
+	buf[e->length] = buf[e->length + 1] = 0;
+	*data = buf;
+	*data_len = e->length;
+	return true;
+}				/* readCacheFile */
+
+/* Compress data for the cache, if that saves at least an eighth of the space.
+ * Images and other compressed formats won't, and are stored as is. */
+static char *deflateData(const char *data, int datalen, int *ziplen)
+{
+	uLongf len;
+	char *zip;
+
+	if (datalen < 512)
+		return 0;
+	len = compressBound(datalen);
+	zip = allocMem(len);
+	if (compress2((Bytef *) zip, &len, (const Bytef *)data, datalen,
+		      Z_DEFAULT_COMPRESSION) != Z_OK ||
+	    len > (uLongf) (datalen - datalen / 8)) {
+		nzFree(zip);
+		return 0;
+	}
+	*ziplen = len;
+	return zip;
+}				/* deflateData */
+
 /* Fetch a file from cache. return true if fetched successfully,
 false if the file has not been cached or is stale.
-If true then the last access time is set to now. */
+If true then the last access time is set to now,
+and the expiration time is set to expires, if that is not 0,
+as the server has just told us the file is still good.
+The content type comes back in content, allocated, if it is known. */
 bool fetchCache(const char *url, const char *etag, time_t modtime,
-		char **data, int *data_len)
+		time_t expires, char **data, int *data_len, char **content)
 {
 	struct CENTRY *e;
-	int i;
-	char *newrec;
-	size_t newlen = 0;
 
 /* you have to give me enough information */
 	if (!modtime && (!etag || !*etag))
 		return false;
 
-	if (!setLock())
+	if (!setLock(false))
 		return false;
 
 /* find the url */
-	e = entries;
-	for (i = 0; i < numentries; ++i, ++e) {
-		if (!sameURL(url, e->url))
-			continue;
+	e = findEntry(url);
+	if (!e)
+		goto nomatch;
 /* look for match on etag */
-		if (e->etag[0] && etag && etag[0]) {
+	if (e->etag[0] && etag && etag[0]) {
 /* both etags are present */
-			if (stringEqual(etag, e->etag))
-				goto match;
-			goto nomatch;
-		}
-		if (!modtime)
-			goto nomatch;
-		if (modtime / 8 > e->modtime)
-			goto nomatch;
-		goto match;
+		if (stringEqual(etag, e->etag))
+			goto match;
+		goto nomatch;
 	}
-/* url not found */
+	if (!modtime)
+		goto nomatch;
+	if (modtime > e->modtime)
+		goto nomatch;
+	goto match;
 
 nomatch:
-	free(cache_data);
 	clearLock();
 	return false;
 
 match:
-	sprintf(cacheFile, "%s/%05d", cacheDir, e->filenumber);
-	if (!fileIntoMemory(cacheFile, data, data_len))
+	cacheFileName(e->filenumber);
+	if (!readCacheFile(e, data, data_len))
 		goto nomatch;
 /* file has been pulled from cache */
-/* have to update the access time */
-	e->accesstime = now_t / 8;
-	newrec = record2string(e);
-	newlen = strlen(newrec);
-	if (newlen == e->textlength) {
-		lseek(control_fh, e->offset, 0);
-		write(control_fh, newrec, newlen);
-	} else {
-		if (!writeControl())
-			clearCacheInternal();
+/* Have to update the access time, if we can do it without waiting.
+ * If other processes are reading the cache, this access is forgotten,
+ * and it only matters to eviction, which is a guess anyways.
+ * Nearly always the record is the same length, and is written in place,
+ * without a new generation; no offsets move, so other processes keep
+ * what they have, with an older access time, and don't read the whole file
+ * again just for this. */
+	if (content)
+		*content = (e->content[0] ? cloneString(e->content) : 0);
+	if (upgradeLock()) {
+		e->accesstime = now_t / 8;
+		if (expires)
+			e->expires = expires;
+		if (!touchRecord(e)) {
+			newGeneration();
+			putRecord(e, false);
+			squeezeControl();
+		}
 	}
 
 	debugPrint(3, "from cache");
-	free(newrec);
-	free(cache_data);
 	clearLock();
 	return true;
 }				/* fetchCache */
 
-/* for quicksort */
-/* records sorted by access time in reverse order */
-static int entry_cmp(const void *s, const void *t)
-{
-	return ((struct CENTRY *)t)->accesstime -
-	    ((struct CENTRY *)s)->accesstime;
-}				/* entry_cmp */
+/*********************************************************************
+Is a URL in the cache, and what do we know about it?
+If so, return the etag, allocated, and the last-mod time,
+to send to the server as If-None-Match and If-Modified-Since.
+fresh is set if the server said, through max-age, that we don't even
+have to ask until now, in which case just call fetchCache().
+*********************************************************************/
 
-/*
- * Is a URL present in the cache?  This can save on HEAD requests,
- * since we can just do a straight GET if the item is not there.
- */
-bool presentInCache(const char *url)
+bool lookupCache(const char *url, char **etag, time_t *modtime, bool *fresh)
 {
-	bool ret = false;
 	struct CENTRY *e;
-	int i;
 
-	if (!setLock())
+	*etag = 0, *modtime = 0, *fresh = false;
+	if (!setLock(false))
 		return false;
-
-	e = entries;
-
-	for (i = 0; (!ret && i < numentries); ++i, ++e) {
-		if (!sameURL(url, e->url))
-			continue;
-		ret = true;
+	e = findEntry(url);
+	if (e) {
+		*etag = cloneString(e->etag);
+		*modtime = e->modtime;
+		*fresh = (e->expires > now_t);
 	}
-
-	free(cache_data);
 	clearLock();
-	return ret;
-}				/* presentInCache */
+	return (e != 0);
+}				/* lookupCache */
 
 /* Put a file into the cache.
  * Sets the modified time and last access time to now.
- * Time is in 8 second chunks, so even a 32 bit int will hold us for centuries. */
+ * Access time is in 8 second chunks, so even a 32 bit int will hold us for centuries.
+ * expires is 0, or the time the file stops being fresh, from max-age. */
 
 void storeCache(const char *url, const char *etag, time_t modtime,
-		const char *data, int datalen)
+		time_t expires, const char *content, const char *data,
+		int datalen)
 {
 	struct CENTRY *e;
-	int i;
-	int filenum;
-	bool append = false;
+	unsigned filenum;
+	int pages;
+	char *zip;
+	int ziplen;
+	int codec = CODEC_NONE;
+
+/* fields are tab separated, one record per line */
+	if (strpbrk(url, "\t\n") || (etag && strpbrk(etag, "\t\n")) ||
+	    (content && strpbrk(content, "\t\n")))
+		return;
 
-	if (!setLock())
+/* compress before we lock, so others aren't waiting on it */
+	zip = deflateData(data, datalen, &ziplen);
+	if (zip)
+		codec = CODEC_ZLIB;
+	pages = ((zip ? ziplen : datalen) + 4095) / 4096;
+
+	if (!setLock(true)) {
+		nzFree(zip);
 		return;
+	}
 
 /* leading http:// is the default, and not needed in the control file.
  * sameURL() takes care of all that. */
@@ -439,111 +1075,74 @@ void storeCache(const char *url, const char *etag, time_t modtime,
 		url += 7;
 
 /* find the url */
-	e = entries;
-	for (i = 0; i < numentries; ++i, ++e) {
-		if (sameURL(url, e->url))
-			break;
-	}
-
-	if (i < numentries)
+	e = findEntry(url);
+	if (e)
 		filenum = e->filenumber;
 	else
 		filenum = generateFileNumber();
-	sprintf(cacheFile, "%s/%05d", cacheDir, filenum);
-	if (!memoryOutToFile(cacheFile, data, datalen,
+	cacheFileName(filenum);
+/* the subdirectory might not be there yet */
+	cacheFile[strlen(cacheDir) + 3] = 0;
+	mkdir(cacheFile, 0700);
+	cacheFile[strlen(cacheDir) + 3] = '/';
+	if (!memoryOutToFile(cacheFile, (zip ? zip : data),
+			     (zip ? ziplen : datalen),
 			     MSG_TempNoCreate2, MSG_NoWrite2)) {
 /* oops, can't write the file */
 		unlink(cacheFile);
 		debugPrint(3, "cannot write web page into cache");
-		free(cache_data);
+		nzFree(zip);
 		clearLock();
 		return;
 	}
+	nzFree(zip);
 
-	if (i < numentries) {
-		char *newrec;
-		size_t newlen;
+	newGeneration();
+
+	if (e) {
 /* we're just updating a preexisting record */
 		e->accesstime = now_t / 8;
-		e->modtime = modtime / 8;
-		e->etag = (etag ? etag : emptyString);
-		e->pages = (datalen + 4095) / 4096;
-		newrec = record2string(e);
-		newlen = strlen(newrec);
-		if (newlen == e->textlength) {
-/* record is the same length, just update it */
-			lseek(control_fh, e->offset, 0);
-			write(control_fh, newrec, newlen);
-			debugPrint(3, "into cache");
-			free(cache_data);
-			free(newrec);
-			clearLock();
-			return;
-		}
-
-/* Record has changed length, have to rewrite the whole control file */
-		e->textlength = newlen;
-		if (!writeControl())
-			clearCacheInternal();
-		else
-			debugPrint(3, "into cache");
-		free(cache_data);
+		e->modtime = modtime;
+		e->expires = expires;
+		e->codec = codec;
+		e->length = datalen;
+		if (e->own & OWN_ETAG)
+			nzFree((char *)e->etag);
+		e->etag = cloneString(etag ? etag : emptyString);
+		if (e->own & OWN_CONTENT)
+			nzFree((char *)e->content);
+		e->content = cloneString(content ? content : emptyString);
+		e->own |= OWN_ETAG | OWN_CONTENT;
+/* it could be bigger than it was; don't throw out the file we just wrote */
+		if (pages > e->pages)
+			makeRoom(pages - e->pages, e);
+		totalPages += pages - e->pages;
+		e->pages = pages;
+		putRecord(e, false);
+		squeezeControl();
+		debugPrint(3, "into cache%s", (codec ? " compressed" : ""));
 		clearLock();
 		return;
 	}
 
 /* this file is new. See if the database is full. */
-	append = true;
-	if (numentries >= 140) {
-		int npages = 0;
-		e = entries;
-		for (i = 0; i < numentries; ++i, ++e)
-			npages += e->pages;
-
-		if (numentries == cacheCount || npages / 256 >= cacheSize) {
-/* sort to find the 100 oldest files */
-			qsort(entries, numentries, sizeof(struct CENTRY),
-			      entry_cmp);
-			debugPrint(3,
-				   "cache is full; removing the 100 oldest files");
-			e = entries + numentries - 100;
-			for (i = 0; i < 100; ++i, ++e) {
-				sprintf(cacheFile, "%s/%05d", cacheDir,
-					e->filenumber);
-				unlink(cacheFile);
-			}
-			numentries -= 100;
-			append = false;
-		}
-	}
+	makeRoom(pages, 0);
 
-	e = entries + numentries;
-	++numentries;
-	e->url = url;
+	e = newEntry();
+	e->url = cloneString(url);
 	e->filenumber = filenum;
-	e->etag = (etag ? etag : emptyString);
+	e->etag = cloneString(etag ? etag : emptyString);
+	e->content = cloneString(content ? content : emptyString);
+	e->own = OWN_URL | OWN_ETAG | OWN_CONTENT;
 	e->accesstime = now_t / 8;
-	e->modtime = modtime / 8;
-	e->pages = (datalen + 4095) / 4096;
-
-	if (append) {
-/* didn't have to prune; just append this record */
-		char *newrec = record2string(e);
-		e->textlength = strlen(newrec);
-		lseek(control_fh, 0L, 2);
-		write(control_fh, newrec, e->textlength);
-		debugPrint(3, "into cache");
-		free(cache_data);
-		free(newrec);
-		clearLock();
-		return;
-	}
-
-/* have to rewrite the whole control file */
-	if (!writeControl())
-		clearCacheInternal();
-	else
-		debugPrint(3, "into cache");
-	free(cache_data);
+	e->modtime = modtime;
+	e->expires = expires;
+	e->codec = codec;
+	e->length = datalen;
+	e->pages = pages;
+	addEntry(e);
+	putRecord(e, true);
+	squeezeControl();
+	debugPrint(3, "into cache%s", (codec ? " compressed" : ""));
 	clearLock();
 }				/* storeCache */
@@ -12,8 +12,8 @@ foo.innerHTML = string or document.write(string).
 
 /* The current (foreground) edbrowse window and frame.
  * These are replaced with stubs when run within the javascript process. */
-struct ebWindow *cw;
-struct ebFrame *cf;
+THREADLOCAL struct ebWindow *cw;
+THREADLOCAL struct ebFrame *cf;
 
 /* traverse the tree of nodes with a callback function */
 nodeFunction traverse_callback;
@@ -1026,7 +1026,7 @@ call out to process those and add them to the object */
 		set_property_string(io, "class", htmlclass);
 	}
 
-	t->jv = io;
+	setTagJv(t, io);
 
 	set_property_string(io, "nodeName", t->info->name);
 /* documentElement is now set in the "Body" case because the 
@@ -1114,7 +1114,7 @@ static void optionJS(struct htmlTag *t)
 	if (!sel->jv)
 		return;
 
-	t->jv = establish_js_option(sel->jv, t->lic);
+	setTagJv(t, establish_js_option(sel->jv, t->lic));
 	set_property_string(t->jv, "text", t->textval);
 	set_property_string(t->jv, "value", t->value);
 	set_property_string(t->jv, "nodeName", "option");
@@ -1160,7 +1160,7 @@ Needless to say that's not good!
 		jsobjtype cdbody;	/* contentDocument.body */
 
 	case TAGACT_TEXT:
-		t->jv = instantiate(cf->docobj, fakePropName(), "TextNode");
+		setTagJv(t, instantiate(cf->docobj, fakePropName(), "TextNode"));
 		if (t->jv) {
 			const char *w = t->textval;
 			if (!w)
@@ -1532,6 +1532,11 @@ void freeTags(struct ebWindow *w)
 	free(w->tags);
 	w->tags = 0;
 	w->numTags = w->allocTags = 0;
+
+	nzFree(w->jvHeads);
+	w->jvHeads = w->idHeads = w->nameHeads = 0;
+	w->jvNext = w->idNext = w->nameNext = 0;
+	w->hashSize = 0;
 }				/* freeTags */
 
 struct htmlTag *newTag(const char *name)
@@ -1572,6 +1577,176 @@ void initTagArray(void)
 					sizeof(struct htmlTag *));
 }				/* initTagArray */
 
+/*********************************************************************
+Find a tag by its js object, or by its id or name, through a hash,
+rather than a scan of the whole tag list.
+Each window has three tables, hashSize in length, giving the first tag
+in each chain, and the chains run through the next arrays, by seqno,
+-1 at the end.
+Tags past hashSize aren't in the tables yet; the next lookup rebuilds them.
+Otherwise jv, id, and name are set through the functions below,
+which keep the chains up to date.
+*********************************************************************/
+
+static unsigned jvHash(jsobjtype v)
+{
+	size_t u = (size_t) v;
+	u ^= (u >> 9) ^ (u >> 20);
+	return (unsigned)u;
+}				/* jvHash */
+
+static unsigned nameHash(const char *s)
+{
+	unsigned h = 2166136261u;
+	while (*s)
+		h = (h ^ (uchar) * s++) * 16777619u;
+	return h;
+}				/* nameHash */
+
+static void chainAdd(int *heads, int *next, unsigned h, int seqno)
+{
+	h &= (cw->hashSize - 1);
+	next[seqno] = heads[h];
+	heads[h] = seqno;
+}				/* chainAdd */
+
+static void chainDel(int *heads, int *next, unsigned h, int seqno)
+{
+	int *p;
+	h &= (cw->hashSize - 1);
+	for (p = heads + h; *p >= 0; p = next + *p)
+		if (*p == seqno) {
+			*p = next[seqno];
+			return;
+		}
+}				/* chainDel */
+
+static void tagHashBuild(void)
+{
+	int n = 256, i;
+	struct htmlTag *t;
+
+	while (n < cw->numTags * 2)
+		n *= 2;
+	nzFree(cw->jvHeads);
+	cw->jvHeads = (int *)allocMem(6 * n * sizeof(int));
+	memset(cw->jvHeads, 0xff, 6 * n * sizeof(int));
+	cw->idHeads = cw->jvHeads + n;
+	cw->nameHeads = cw->idHeads + n;
+	cw->jvNext = cw->nameHeads + n;
+	cw->idNext = cw->jvNext + n;
+	cw->nameNext = cw->idNext + n;
+	cw->hashSize = n;
+
+	for (i = 0; i < cw->numTags; ++i) {
+		t = tagList[i];
+		if (t->jv)
+			chainAdd(cw->jvHeads, cw->jvNext, jvHash(t->jv), i);
+		if (t->id)
+			chainAdd(cw->idHeads, cw->idNext, nameHash(t->id), i);
+		if (t->name)
+			chainAdd(cw->nameHeads, cw->nameNext, nameHash(t->name),
+				 i);
+	}
+	debugPrint(5, "tag hash %d for %d tags", n, cw->numTags);
+}				/* tagHashBuild */
+
+/* Is this tag in the tables? */
+static bool tagHashed(const struct htmlTag *t)
+{
+	return (t->seqno < cw->hashSize && tagList[t->seqno] == t);
+}				/* tagHashed */
+
+void setTagJv(struct htmlTag *t, jsobjtype v)
+{
+	if (t->jv == v)
+		return;
+	if (tagHashed(t)) {
+		if (t->jv)
+			chainDel(cw->jvHeads, cw->jvNext, jvHash(t->jv),
+				 t->seqno);
+		if (v)
+			chainAdd(cw->jvHeads, cw->jvNext, jvHash(v), t->seqno);
+	}
+	t->jv = v;
+}				/* setTagJv */
+
+/* id and name are allocated strings, and the tag takes them over */
+void setTagId(struct htmlTag *t, char *id)
+{
+	if (tagHashed(t)) {
+		if (t->id)
+			chainDel(cw->idHeads, cw->idNext, nameHash(t->id),
+				 t->seqno);
+		if (id)
+			chainAdd(cw->idHeads, cw->idNext, nameHash(id),
+				 t->seqno);
+	}
+	nzFree(t->id);
+	t->id = id;
+}				/* setTagId */
+
+void setTagName(struct htmlTag *t, char *name)
+{
+	if (tagHashed(t)) {
+		if (t->name)
+			chainDel(cw->nameHeads, cw->nameNext,
+				 nameHash(t->name), t->seqno);
+		if (name)
+			chainAdd(cw->nameHeads, cw->nameNext, nameHash(name),
+				 t->seqno);
+	}
+	nzFree(t->name);
+	t->name = name;
+}				/* setTagName */
+
+/* The first tag with this js object, in the order of the tag list. */
+struct htmlTag *tagFromJavaVar(jsobjtype v)
+{
+	int i, best = -1;
+
+	if (!tagList)
+		i_printfExit(MSG_NullListInform);
+	if (!v)
+		return 0;
+	if (cw->numTags > cw->hashSize)
+		tagHashBuild();
+
+	i = cw->jvHeads[jvHash(v) & (cw->hashSize - 1)];
+	for (; i >= 0; i = cw->jvNext[i])
+		if (tagList[i]->jv == v && (best < 0 || i < best))
+			best = i;
+	return (best >= 0 ? tagList[best] : 0);
+}				/* tagFromJavaVar */
+
+/* The first tag with this id, or an anchor with this name,
+ * as in the #section at the end of a url. */
+struct htmlTag *tagFromAnchor(const char *s)
+{
+	struct htmlTag *t;
+	int i, best = -1;
+	unsigned h;
+
+	if (!tagList || !s)
+		return 0;
+	if (cw->numTags > cw->hashSize)
+		tagHashBuild();
+
+	h = nameHash(s) & (cw->hashSize - 1);
+	for (i = cw->idHeads[h]; i >= 0; i = cw->idNext[i]) {
+		t = tagList[i];
+		if (stringEqual(t->id, s) && (best < 0 || i < best))
+			best = i;
+	}
+	for (i = cw->nameHeads[h]; i >= 0; i = cw->nameNext[i]) {
+		t = tagList[i];
+		if (t->action == TAGACT_A && stringEqual(t->name, s)
+		    && (best < 0 || i < best))
+			best = i;
+	}
+	return (best >= 0 ? tagList[best] : 0);
+}				/* tagFromAnchor */
+
 bool htmlGenerated;
 static struct htmlTag *treeAttach;
 static int tree_pos;
@@ -1705,13 +1880,13 @@ checkattributes:
 			v = t->atvals[j];
 			if (v && !*v)
 				v = 0;
-			t->name = cloneString(v);
+			setTagName(t, cloneString(v));
 		}
 		if ((j = stringInListCI(t->attributes, "id")) >= 0) {
 			v = t->atvals[j];
 			if (v && !*v)
 				v = 0;
-			t->id = cloneString(v);
+			setTagId(t, cloneString(v));
 		}
 		if ((j = stringInListCI(t->attributes, "class")) >= 0) {
 			v = t->atvals[j];
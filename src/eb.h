@@ -76,6 +76,14 @@ typedef uchar bool;
 #define true 1
 #endif
 
+/* A few globals, such as the current window, belong to each thread,
+ * so the js engine can run on a thread inside edbrowse; see jsThread. */
+#ifdef _MSC_VER
+#define THREADLOCAL __declspec(thread)
+#else
+#define THREADLOCAL __thread
+#endif
+
 /* Some source files are shared between edbrowse, a C program,
  * and edbrowse-js, currently a C++ function program, thus the prototypes,
  * and some other structures, must be C protected. */
@@ -151,6 +159,8 @@ typedef uchar *pst;		/* perl string */
 #define ALLOC_GR        0x100
 /* print a dot on download for each chunk of this size */
 #define CHUNKSIZE 1000000
+/* most byte ranges a download is fetched in at once */
+#define MAXSEGMENTS 8
 
 /* alignments */
 #define AL_LEFT		0
@@ -178,10 +188,10 @@ extern char emptyString[];	/* use this whenever you would use "" */
  * Tell them you're Explorer, and walk right in.
  * Anyways, this array holds up to 10 user agent strings. */
 extern char *userAgents[10], *currentAgent;
-extern char *newlocation;
-extern int newloc_d; /* delay */
-extern bool newloc_r; /* location replaces this page */
-extern struct ebFrame *newloc_f; /* frame calling for new web page */
+extern THREADLOCAL char *newlocation;
+extern THREADLOCAL int newloc_d;	/* delay */
+extern THREADLOCAL bool newloc_r;	/* location replaces this page */
+extern THREADLOCAL struct ebFrame *newloc_f;	/* frame calling for new web page */
 extern const char *ebrc_string; /* default ebrc file */
 
 struct eb_curl_callback_data {
@@ -196,6 +206,26 @@ struct eb_curl_callback_data {
 	int down_length;
 };
 
+/* a url fetched in parallel with others, see prefetchURLs() */
+struct PREFETCH {
+	const char *url;	/* in, percent encoded */
+	char *data;		/* out, allocated, if code is 200 */
+	int length;
+	long code;		/* http response code, 0 to fetch it again */
+	char *location;		/* the url we were redirected to, if any */
+	char *content;		/* content type and charset, if known */
+/* the rest is private to prefetchURLs() */
+	char *u;		/* the url as it goes to curl */
+	CURL *h;
+	struct curl_slist *headers;
+	char *host;
+	char *etag;
+	time_t modtime;
+	char *hdata;		/* the http headers that come back */
+	int hlength;
+	char state;		/* waiting, running, done */
+};
+
 struct MACCOUNT {		/* pop3 account */
 	char *login, *password, *from, *reply;
 	char *inurl, *outurl;
@@ -244,19 +274,24 @@ extern char *sslCerts;		/* ssl certificates to validate the secure server */
 extern int verifyCertificates;	/* is a certificate required for the ssl connection? */
 extern int displayLength;	/* when printing a line */
 extern int jsPool;		/* size of js pool in megabytes */
+extern int undoDepth;		/* levels of undo */
 extern int webTimeout, mailTimeout;
 extern uchar browseLocal;
 extern bool sqlPresent;		/* Was edbrowse compiled with SQL built in? */
 extern bool ismc;		/* Is the program running as a mail client? */
 extern bool isimap;		/* Is the program running as an imap client? */
 extern bool down_bg;		/* download in background */
-extern char whichproc; // which edbrowse-xx process
+extern int downMax;		/* background downloads at once */
+extern long downRate;		/* kilobytes per second for each */
+extern int downSegments;	/* byte ranges to fetch a large file in */
+extern bool jsThread;		/* run the js engine on a thread */
+extern THREADLOCAL char whichproc; // which edbrowse-xx process
 extern char showProgress; // feedback as a file is downloaded
 extern int eb_lang;		/* edbrowse language, determined by $LANG */
 extern bool cons_utf8;		/* does the console expect utf8? */
 extern bool iuConvert;		/* perform iso utf8 conversions automatically */
 extern char type8859;		/* 1 through 15 */
-extern bool js_redirects;	/* window.location = new_url */
+extern THREADLOCAL bool js_redirects;	/* window.location = new_url */
 extern bool passMail;		/* pass mail across the filters */
 extern bool errorExit;		/* exit on any error, for scripting purposes */
 extern bool isInteractive;
@@ -267,7 +302,7 @@ extern bool listNA;		/* list nonascii chars */
 extern bool inInput;		/* reading line from standard in */
 extern int fileSize;		/* when reading/writing files */
 extern int mssock;		/* mail server socket */
-extern long ht_code;		/* http code, like 404 file not found */
+extern THREADLOCAL long ht_code;	/* http code, like 404 file not found */
 extern char errorMsg[];		/* generated error message */
 extern char serverLine[];	/* lines to and from the mail server */
 extern int localAccount;	/* this is the smtp server for outgoing mail */
@@ -284,20 +319,20 @@ extern char *dbarea, *dblogin, *dbpw;	/* to log into the database */
 extern bool fetchBlobColumns;
 extern bool caseInsensitive, searchStringsAll;
 extern bool allowRedirection;	/* from http code 301, or http refresh */
-extern bool sendReferrer;	/* in the http header */
+extern THREADLOCAL bool sendReferrer;	/* in the http header */
 extern bool allowJS;		/* javascript on */
 extern bool allowXHR;		/* xhr on */
 extern bool htmlGenerated;
 extern bool ftpActive;
 extern bool helpMessagesOn;	/* no need to type h */
-extern bool pluginsOn;		/* plugins are active */
+extern THREADLOCAL bool pluginsOn;	/* plugins are active */
 extern bool showHiddenFiles;	/* during directory scan */
 extern int context;		/* which session (buffer) are we in? */
 extern pst linePending;
-extern char *changeFileName;
+extern THREADLOCAL char *changeFileName;
 extern char *addressFile;	/* your address book */
-extern char *serverData;
-extern int serverDataLen;
+extern THREADLOCAL char *serverData;
+extern THREADLOCAL int serverDataLen;
 extern char *breakLineResult;
 extern char *currentReferrer;
 extern char *home;		/* home directory */
@@ -346,10 +381,45 @@ struct lineMap {
 	pst text;
 	char ds1, ds2;		/* directory suffix */
 	bool gflag;		/* for g// */
-	char filler;
+	uchar home;		/* where the text lives, see below */
 };
 #define LMSIZE sizeof(struct lineMap)
 
+/* lineMap.home: the text was allocated on its own, and is freed on its own,
+ * or it was carved out of the window's arena, and is freed with the arena,
+ * or it is in a block shared by the lines of one substitute,
+ * and the block is freed with the last of those lines. */
+enum { LT_HEAP, LT_ARENA, LT_BLOCK };
+
+/*********************************************************************
+The lines of a buffer are not one long array of lineMap structures.
+That had to be rebuilt, start to finish, every time you added or deleted
+a line, and it was slow on a file with millions of lines.
+The lines are held in chunks, up to LINECHUNK lines per chunk,
+and an index holds the chunks in order, with the line number
+just before each chunk, so we can find line n by binary search.
+Insert or delete, and you shift a few hundred lineMap structures
+in one chunk, then adjust the chunk array, which is 500 times shorter.
+See mapLine() mapInsert() and mapDelete() in buffers.c.
+*********************************************************************/
+
+#define LINECHUNK 512
+struct lineChunk {
+	int n, cap;		/* lines in use, lines allocated */
+	int ref;		/* number of indexes holding this chunk */
+	int mark;		/* scratch, see mapRelease() */
+	struct lineMap lines[LINECHUNK];
+};
+
+struct lineIndex {
+	struct lineChunk **chunks;
+	int *starts;		/* line number before each chunk */
+	int valid;		/* starts[] is good up to here, see mapRenumber() */
+	int nchunks, allocChunks;
+	int count;		/* total number of lines */
+	int hint;		/* the last chunk we looked at */
+};
+
 /* an edbrowse frame, as when there are many frames in an html page.
  * There could be several frames in an edbrowse window or buffer, chained
  * together in a linked list, but usually there is just one, as when editing
@@ -374,7 +444,7 @@ struct ebFrame {
 	jsobjtype docobj;	/* window.document */
 	const struct MIMETYPE *mt;
 };
-extern struct ebFrame *cf;	/* current frame */
+extern THREADLOCAL struct ebFrame *cf;	/* current frame */
 
 /* an edbrowse window */
 struct ebWindow {
@@ -393,7 +463,9 @@ struct ebWindow {
 	char *ft, *fd, *fk;	/* title, description, keywords */
 	char *mailInfo;
 	char lhs[MAXRE], rhs[MAXRE];	/* remembered substitution strings */
-	struct lineMap *map, *r_map;
+	struct lineIndex *map, *r_map;
+/* bulk storage for the text of the lines, see arenaAlloc() in buffers.c */
+	struct lineArena *arena, *r_arena;
 /* The labels that you set with the k command, and access via 'x.
  * Basically, that's 26 line numbers.
  * Number 0 means the label is not set.
@@ -406,6 +478,10 @@ struct ebWindow {
  * and used thereafter for hyperlinks, fill-out forms, etc. */
 	struct htmlTag **tags;
 	int numTags, allocTags;
+/* find tags by js object, id, or name, see tagFromJavaVar() */
+	int *jvHeads, *idHeads, *nameHeads;
+	int *jvNext, *idNext, *nameNext;
+	int hashSize;
 	bool mustrender:1;
 	bool sank:1; /* jSyncup has been run */
 	bool lhs_yes:1;
@@ -429,7 +505,7 @@ struct ebWindow {
 	struct DBTABLE *table;	/* if in sqlMode */
 	time_t nextrender;
 };
-extern struct ebWindow *cw;	/* current window */
+extern THREADLOCAL struct ebWindow *cw;	/* current window */
 #define foregroundWindow (cw == sessionList[context].lw)
 
 /* quickly grab a tag from the current window via its sequence number:
@@ -14,6 +14,18 @@
 #include <process.h>		// for _execlp()
 #include <pthread.h>		// for pthreads...
 #endif /* defined(DOSLIKE) && defined(HAVE_PTHREAD_H) */
+#ifndef DOSLIKE
+#include <pthread.h>
+#define HAVE_JSTHREAD 1
+#include <sys/syscall.h>
+#ifdef SYS_memfd_create
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdint.h>
+#define HAVE_RING 1
+#endif
+#endif
 
 /* If connection is lost, mark all js sessions as dead. */
 static void markAllDead(void)
@@ -44,7 +56,282 @@ static void markAllDead(void)
 
 /* communication pipes with the js process */
 static int pipe_in[2], pipe_out[2];
-static char arg1[8], arg2[8];
+static char arg1[8], arg2[8], arg3[40];
+
+/*********************************************************************
+The pipes carry every byte through the kernel, and back out again,
+and a large script or innerHTML string goes through in pieces,
+with a context switch for each.
+On linux the two processes can share memory instead,
+a memfd mapped by both, holding a ring buffer in each direction.
+The writer copies straight into the ring and the reader straight out,
+and neither makes a system call unless the other is asleep.
+A message that fits in the ring goes across whole,
+without waiting for the other side to drain it.
+Each process sleeps on its own eventfd, and the other pokes it
+after making progress, if the waiting flag is set.
+The pipes stay open; a hangup tells the sleeper the other side is gone,
+and if the ring cannot be set up, they carry the messages as before.
+The third argument to the js process, memfd,eventfd,eventfd,
+says where to find the ring.
+*********************************************************************/
+
+/* When js is a thread, each side of the ring has its own copy of these. */
+static THREADLOCAL bool ring_on;
+/* js runs on a thread inside edbrowse, see jsThreadMain() */
+bool jsThread;
+static bool js_threaded;
+#ifdef HAVE_RING
+static THREADLOCAL struct EJ_RING *ring_out, *ring_in;
+static THREADLOCAL char *ring_base;
+static THREADLOCAL int ring_fd = -1;
+static THREADLOCAL int wake_me = -1, wake_peer = -1, ring_alive = -1;
+#define RINGMAP (2 * (sizeof(struct EJ_RING) + EJ_RINGSIZE))
+
+static char *ringData(struct EJ_RING *r)
+{
+	return (char *)(r + 1);
+}				/* ringData */
+
+/* Sleep until poked, or until something comes down the pipe,
+ * which means the other side is gone, or could not start.
+ * Returns 0 for poked, 1 for the pipe. */
+static int ringSleep(void)
+{
+	struct pollfd pf[2];
+	uint64_t count;
+
+	pf[0].fd = wake_me;
+	pf[0].events = POLLIN;
+	pf[1].fd = ring_alive;
+	pf[1].events = POLLIN;
+	pf[0].revents = pf[1].revents = 0;
+	if (poll(pf, 2, -1) < 0)
+		return (errno == EINTR ? 0 : 1);
+	if (pf[0].revents) {
+		read(wake_me, &count, sizeof(count));
+		return 0;
+	}
+	return 1;
+}				/* ringSleep */
+
+static void ringPoke(void)
+{
+	uint64_t one = 1;
+	write(wake_peer, &one, sizeof(one));
+}				/* ringPoke */
+
+/* Returns 0 for ok, or 1 if the pipe is to be used instead. */
+int ringRead(void *data_p, int n)
+{
+	struct EJ_RING *r = ring_in;
+	char *p = data_p;
+	unsigned int head, tail, avail, off, k;
+
+	while (n > 0) {
+		tail = r->tail;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		avail = head - tail;
+		if (!avail) {
+/* Say we are waiting, then look again, in case the writer just missed it. */
+			__atomic_store_n(&r->readwait, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail
+			    && ringSleep()) {
+				r->readwait = 0;
+				return 1;
+			}
+			__atomic_store_n(&r->readwait, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (avail > n)
+			avail = n;
+		off = tail % EJ_RINGSIZE;
+		k = EJ_RINGSIZE - off;
+		if (k > avail)
+			k = avail;
+		memcpy(p, ringData(r) + off, k);
+		memcpy(p + k, ringData(r), avail - k);
+		p += avail;
+		n -= avail;
+		__atomic_store_n(&r->tail, tail + avail, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->writewait, __ATOMIC_SEQ_CST))
+			ringPoke();
+	}
+	return 0;
+}				/* ringRead */
+
+int ringWrite(const void *data_p, int n)
+{
+	struct EJ_RING *r = ring_out;
+	const char *p = data_p;
+	unsigned int head, tail, room, off, k;
+
+	while (n > 0) {
+		head = r->head;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		room = EJ_RINGSIZE - (head - tail);
+		if (!room) {
+			__atomic_store_n(&r->writewait, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == tail
+			    && ringSleep()) {
+				r->writewait = 0;
+				return 1;
+			}
+			__atomic_store_n(&r->writewait, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (room > n)
+			room = n;
+		off = head % EJ_RINGSIZE;
+		k = EJ_RINGSIZE - off;
+		if (k > room)
+			k = room;
+		memcpy(ringData(r) + off, p, k);
+		memcpy(ringData(r), p + k, room - k);
+		p += room;
+		n -= room;
+		__atomic_store_n(&r->head, head + room, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->readwait, __ATOMIC_SEQ_CST))
+			ringPoke();
+	}
+	return 0;
+}				/* ringWrite */
+
+static bool ringMap(int fd)
+{
+	ring_base =
+	    mmap(NULL, RINGMAP, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring_base == MAP_FAILED) {
+		ring_base = 0;
+		return false;
+	}
+	return true;
+}				/* ringMap */
+
+static void ringClose(void)
+{
+	if (ring_base)
+		munmap(ring_base, RINGMAP);
+	ring_base = 0;
+	if (ring_fd >= 0)
+		close(ring_fd);
+/* A js thread shares the eventfds with us, and closes them on its way out. */
+	if (wake_me >= 0 && !js_threaded)
+		close(wake_me);
+	if (wake_peer >= 0 && !js_threaded)
+		close(wake_peer);
+	ring_fd = wake_me = wake_peer = -1;
+	ring_on = false;
+	arg3[0] = 0;
+}				/* ringClose */
+
+/* The js thread lets go of its side of the ring. */
+static void ringDetach(void)
+{
+	if (ring_base)
+		munmap(ring_base, RINGMAP);
+	ring_base = 0;
+	if (wake_me >= 0)
+		close(wake_me);
+	if (wake_peer >= 0)
+		close(wake_peer);
+	wake_me = wake_peer = -1;
+	ring_on = false;
+}				/* ringDetach */
+
+/* Before the fork, set up the ring, and the argument that points to it. */
+static void ringCreate(void)
+{
+	arg3[0] = 0;
+	ring_fd = syscall(SYS_memfd_create, "edbrowse-js", 0);
+	if (ring_fd < 0)
+		goto fail;
+	if (ftruncate(ring_fd, RINGMAP) < 0 || !ringMap(ring_fd))
+		goto fail;
+	wake_me = eventfd(0, 0);
+	wake_peer = eventfd(0, 0);
+	if (wake_me < 0 || wake_peer < 0)
+		goto fail;
+	ring_out = (struct EJ_RING *)ring_base;
+	ring_in = (struct EJ_RING *)(ringData(ring_out) + EJ_RINGSIZE);
+	sprintf(arg3, "%d,%d,%d", ring_fd, wake_me, wake_peer);
+	debugPrint(5, "js ring %s", arg3);
+	return;
+
+fail:
+	debugPrint(5, "no shared memory for javascript, using pipes");
+	ringClose();
+}				/* ringCreate */
+
+/* The js process picks up the ring; alive is the pipe from edbrowse. */
+/* After the fork, edbrowse keeps the mapping and the eventfds. */
+static void ringParent(void)
+{
+	if (!arg3[0])
+		return;
+/* a js thread closes the memfd once it has mapped it */
+	if (!js_threaded)
+		close(ring_fd);
+	ring_fd = -1;
+	ring_alive = pipe_in[0];
+	ring_on = true;
+}				/* ringParent */
+
+bool ringAttach(const char *spec, int alive)
+{
+	int fd, e1, e2;
+	if (sscanf(spec, "%d,%d,%d", &fd, &e1, &e2) != 3)
+		return false;
+	if (!ringMap(fd)) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+/* the same ring, seen from the other side */
+	ring_in = (struct EJ_RING *)ring_base;
+	ring_out = (struct EJ_RING *)(ringData(ring_in) + EJ_RINGSIZE);
+	wake_me = e2;
+	wake_peer = e1;
+	ring_alive = alive;
+	ring_on = true;
+	return true;
+}				/* ringAttach */
+
+#else // !HAVE_RING
+
+static void ringCreate(void)
+{
+}				/* ringCreate */
+
+static void ringClose(void)
+{
+	ring_on = false;
+}				/* ringClose */
+
+static void ringParent(void)
+{
+}				/* ringParent */
+
+static void ringDetach(void)
+{
+}				/* ringDetach */
+
+bool ringAttach(const char *spec, int alive)
+{
+	return false;
+}				/* ringAttach */
+
+int ringRead(void *data_p, int n)
+{
+	return 1;
+}				/* ringRead */
+
+int ringWrite(const void *data_p, int n)
+{
+	return 1;
+}				/* ringWrite */
+
+#endif // HAVE_RING y/n
 
 static int js_pid;
 static struct EJ_MSG head;
@@ -81,6 +368,122 @@ static void *child_proc(void *vp)
 }
 #endif // defined(DOSLIKE) && defined(HAVE_PTHREAD_H)
 
+#ifdef HAVE_JSTHREAD
+/*********************************************************************
+With jsthread = on in the config file, the js engine runs on a thread
+inside edbrowse, rather than a process of its own.
+The messages are the same, through the ring, or the pipes if there is no ring,
+but nothing is exec'd, and the config file, the cookies, and curl
+are already set up and shared.
+The thread has its own current window, its own side of the ring,
+and whichproc = 'j', so the wrappers below call the engine directly
+when they run on that thread.
+Edbrowse waits for the answer to every message, so only one side
+runs at a time.
+A batch doesn't wait, but it only sets properties, with setters suspended,
+and touches nothing outside the js runtime.
+That makes it safe to share the config, cookies, cache, and curl handles,
+but not the state that one fetch leaves for the next step,
+because an xhr calls httpConnect on the js thread.
+The headers, the body, a pending redirect or refresh,
+are thread local in http.c, so edbrowse never sees the ones from an xhr,
+just as it never saw those of the js process.
+The price is isolation; if js crashes, edbrowse goes down with it.
+*********************************************************************/
+
+static pthread_t js_tid;
+static bool js_thread_live;	/* set by edbrowse, cleared by the thread */
+static int thread_fd[2];	/* the ends of the pipes that the thread owns */
+static THREADLOCAL bool on_js_thread;
+
+/* The thread is on its way out, its stack already unwound.
+ * Free the runtime, then close its side of things, the way a process would,
+ * and only then can edbrowse start another. */
+static void jsThreadDone(void *vp)
+{
+	js_teardown();
+	ringDetach();
+	close(thread_fd[0]);
+	close(thread_fd[1]);
+	__atomic_store_n(&js_thread_live, false, __ATOMIC_SEQ_CST);
+}				/* jsThreadDone */
+
+static void *jsThreadMain(void *vp)
+{
+	char *argv[3];
+	sigset_t ss;
+/* interrupt goes to edbrowse, as it did when js was a process */
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &ss, NULL);
+	on_js_thread = true;
+	whichproc = 'j';
+	argv[0] = arg1;
+	argv[1] = arg2;
+	argv[2] = arg3;
+	pthread_cleanup_push(jsThreadDone, 0);
+	js_main(arg3[0] ? 3 : 2, argv);
+	jsThreadExit();
+	pthread_cleanup_pop(0);
+	return 0;
+}				/* jsThreadMain */
+
+bool inJsThread(void)
+{
+	return on_js_thread;
+}				/* inJsThread */
+
+/* The js thread is done, or it can't talk to edbrowse any more,
+ * or something went wrong deep inside the engine.
+ * Unwind from wherever we are; jsThreadDone() cleans up. */
+void jsThreadExit(void)
+{
+	if (!on_js_thread)
+		return;
+	pthread_exit(0);
+}				/* jsThreadExit */
+
+/* The pipes are set up, start the thread that reads them. */
+static bool jsStartThread(void)
+{
+/* A thread that never came back from some script still has the statics
+ * in the js engine, so the next one has to be a process. */
+	if (__atomic_load_n(&js_thread_live, __ATOMIC_SEQ_CST))
+		return false;
+
+	ringCreate();
+	thread_fd[0] = pipe_out[0];
+	thread_fd[1] = pipe_in[1];
+	sprintf(arg1, "%d", thread_fd[0]);
+	sprintf(arg2, "%d", thread_fd[1]);
+	js_threaded = true;
+	js_thread_live = true;
+	if (pthread_create(&js_tid, NULL, jsThreadMain, NULL)) {
+		js_thread_live = false;
+		js_threaded = false;
+		ringClose();
+		return false;
+	}
+	pthread_detach(js_tid);
+	js_pid = 1;
+	ringParent();
+	debugPrint(5, "js engine on a thread %s %s %s", arg1, arg2, arg3);
+	return true;
+}				/* jsStartThread */
+
+#else // !HAVE_JSTHREAD
+
+bool inJsThread(void)
+{
+	return false;
+}				/* inJsThread */
+
+void jsThreadExit(void)
+{
+}				/* jsThreadExit */
+
+#endif // HAVE_JSTHREAD y/n
+
 /* Start the js process. */
 static void js_start(void)
 {
@@ -114,6 +517,10 @@ static void js_start(void)
 		close(pipe_in[1]);
 		return;
 	}
+#ifdef HAVE_JSTHREAD
+	if (jsThread && jsStartThread())
+		return;
+#endif // HAVE_JSTHREAD
 #if defined(DOSLIKE)
 #if defined(HAVE_PTHREAD_H)
 	/* windows implementation of fork() using pthreads */
@@ -132,10 +539,12 @@ static void js_start(void)
 	}
 	js_pid = 1;
 #else // !(defined(DOSLIKE) && defined(HAVE_PTHREAD_H)
+	ringCreate();
 	pid = fork();
 	if (pid < 0) {
 		i_puts(MSG_JSEngineFork);
 		allowJS = false;
+		ringClose();
 		close(pipe_in[0]);
 		close(pipe_in[1]);
 		close(pipe_out[0]);
@@ -147,6 +556,7 @@ static void js_start(void)
 		js_pid = pid;
 		close(pipe_in[1]);
 		close(pipe_out[0]);
+		ringParent();
 		return;
 	}
 
@@ -155,8 +565,9 @@ static void js_start(void)
 	close(pipe_out[1]);
 	sprintf(arg1, "%d", pipe_out[0]);
 	sprintf(arg2, "%d", pipe_in[1]);
-	debugPrint(5, "spawning edbrowse-js %s %s", arg1, arg2);
-	execlp(progname, "edbrowse", "--mode", "js", arg1, arg2, NULL);
+	debugPrint(5, "spawning edbrowse-js %s %s %s", arg1, arg2, arg3);
+	execlp(progname, "edbrowse", "--mode", "js", arg1, arg2,
+	       (arg3[0] ? arg3 : NULL), NULL);
 
 /* oops, process did not exec */
 /* write a message from this child, saying js would not exec */
@@ -168,24 +579,52 @@ static void js_start(void)
 #endif // defined(DOSLIKE) && defined(HAVE_PTHREAD_H) y/n
 }				/* js_start */
 
+/*********************************************************************
+Setting or deleting a property doesn't return anything,
+so there is no need to wait for js to answer each one.
+These operations are queued, and go out in one EJ_CMD_BATCH message,
+in one write, just ahead of the next message, or when the queue gets large.
+js runs them in order and says nothing; any side effects or errors
+come back with the reply to that next message.
+The header carries the js context, so the queue belongs to one frame.
+Space for the header is kept at the front of the queue.
+*********************************************************************/
+
+#define BATCHMAX 0x10000
+static char *batch;
+static int batch_l, batch_n;
+static struct ebFrame *batch_f;
+
+static void dropBatch(void)
+{
+	nzFree(batch);
+	batch = 0;
+	batch_l = batch_n = 0;
+	batch_f = 0;
+}				/* dropBatch */
+
 /* Shut down the js process, although if we got here,
  * it's probably dead anyways. */
 static void js_kill(void)
 {
+	dropBatch();
 	if (!js_pid)
 		return;
 
+	ringClose();
+
 	close(pipe_in[0]);
 	close(pipe_out[1]);
 #ifndef DOSLIKE
-	kill(js_pid, SIGTERM);
+/* A thread can't be killed; it sees the pipe close and exits on its own. */
+	if (!js_threaded)
+		kill(js_pid, SIGTERM);
 #endif // #ifndef DOSLIKE
 	js_pid = 0;
+	js_threaded = false;
 
 }				/* js_kill */
 
-/* String description of side effects, as a result of running js code. */
-static char *effects;
 /* source file containing the js code */
 static const char *jsSourceFile;
 /* queue of edbrowse buffer changes produced by running js - see eb.h */
@@ -211,19 +650,22 @@ static void javaSetsTagVar(jsobjtype v, const char *newtext)
 	t->value = cloneString(newtext);
 }				/* javaSetsTagVar */
 
-static void javaSetsInner(jsobjtype v, const char *newtext, char c)
+/* The new html, then the decoration of its tags, follow one another in value */
+static void javaSetsInner(jsobjtype v, const char *newtext, int l1,
+			  const char *decor, int l2, char c)
 {
 	struct inputChange *ic;
 	struct htmlTag *t = tagFromJavaVar(v);
 	if (!t)
 		return;
-	ic = allocMem(sizeof(struct inputChange) + strlen(newtext));
+	ic = allocMem(sizeof(struct inputChange) + l1 + l2 + 1);
 	ic->t = t;
 	ic->tagno = t->seqno;
 	ic->major = 'i';
 	ic->minor = c;
 	ic->f0 = cf;
-	strcpy(ic->value, newtext);
+	memcpy(ic->value, newtext, l1 + 1);
+	memcpy(ic->value + l1 + 1, decor, l2 + 1);
 	addToListBack(&inputChangesPending, ic);
 }				/* javaSetsInner */
 
@@ -236,157 +678,227 @@ void dwStart(void)
 	stringAndString(&cf->dw, &cf->dw_l, "<!DOCTYPE public><body>");
 }				/* dwStart */
 
+/* Read some data from the js process.
+ * Close things down if there is any trouble from the read.
+ * Returns 0 for ok or -1 for bad read. */
+static int readFromJS(void *data_p, int n)
+{
+	unsigned char *bytes_p = (unsigned char *)data_p;
+	int rc;
+	if (n == 0)
+		return 0;
+	if (ring_on) {
+		if (!ringRead(data_p, n))
+			return 0;
+/* Something came down the pipe instead, perhaps js could not exec,
+ * or it is gone; either way, read it the old way. */
+		ringClose();
+	}
+	while (n > 0) {
+		rc = read(pipe_in[0], bytes_p, n);
+		debugPrint(7, "js read %d", rc);
+		if (rc <= 0) {
+/* Oops - can't read from the process any more */
+			i_puts(MSG_JSEngineRW);
+			js_kill();
+			markAllDead();
+			return -1;
+		}
+		n -= rc;
+		bytes_p += rc;
+	}
+	return 0;
+}				/* readFromJS */
+
+static int writeToJS(const void *data_p, int n)
+{
+	int rc;
+	if (n == 0)
+		return 0;
+	if (ring_on) {
+		if (!ringWrite(data_p, n))
+			return 0;
+		goto fail;
+	}
+	rc = write(pipe_out[1], data_p, n);
+	if (rc == n)
+		return 0;
+fail:
+/* Oops - can't write to the process any more */
+	js_kill();
+/* this call will print an error message for you */
+	markAllDead();
+	return -1;
+}				/* writeToJS */
+
+static int sendBatch(void)
+{
+	struct EJ_MSG bh;
+	int rc;
+
+	if (!batch_n)
+		return 0;
+	debugPrint(5, "> batch %d", batch_n);
+	memset(&bh, 0, sizeof(bh));
+	bh.magic = EJ_MAGIC;
+	bh.cmd = EJ_CMD_BATCH;
+	bh.jcx = batch_f->jcx;
+	bh.winobj = batch_f->winobj;
+	bh.docobj = batch_f->docobj;
+	bh.n = batch_n;
+	bh.proplength = batch_l - sizeof(bh);
+	memcpy(batch, &bh, sizeof(bh));
+	rc = writeToJS(batch, batch_l);
+	dropBatch();
+	return rc;
+}				/* sendBatch */
+
+static int queueOp(enum ej_cmd cmd, jsobjtype obj, const char *name,
+		   const char *value, enum ej_proptype proptype, int n)
+{
+	struct EJ_OP op;
+
+	if (batch_n && batch_f != cf && sendBatch())
+		return -1;
+	if (!batch_n) {
+		struct EJ_MSG bh;
+		batch = initString(&batch_l);
+		stringAndBytes(&batch, &batch_l, (char *)&bh, sizeof(bh));
+		batch_f = cf;
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.cmd = cmd;
+	op.obj = obj;
+	op.proptype = proptype;
+	op.n = n;
+	op.namelength = (name ? strlen(name) : 0);
+	op.proplength = (value ? strlen(value) : 0);
+	stringAndBytes(&batch, &batch_l, (char *)&op, sizeof(op));
+	stringAndBytes(&batch, &batch_l, name, op.namelength);
+	stringAndBytes(&batch, &batch_l, value, op.proplength);
+	++batch_n;
+
+	if (batch_l >= BATCHMAX)
+		return sendBatch();
+	return 0;
+}				/* queueOp */
+
 /*********************************************************************
-Process the side effects of running js. These are:
-w{ document.write() strings that fold back into html }
-n{ new window() that may open a new edbrowse buffer }
-t{ timer or interval calling a js function }
-v{ javascript changes the value of an input field }
-c{set cookie}
-i{ innnerHtml or innerText }
-f{ form submit or reset }
-l{ linking objects together in a tree }
-Any or all of these could be coded in the side effects string.
+Read and process the side effects of running js, side bytes of records,
+as described by struct EJ_EFFECT in ebjs.h. These are:
+w document.write() strings that fold back into html
+n new window() that may open a new edbrowse buffer
+t timer or interval calling a js function
+v javascript changes the value of an input field
+c set cookie
+i innnerHtml or innerText
+f form submit or reset
+l linking objects together in a tree
+They are handled in order, as they are read.
+The text of document.write is read directly onto the end of cf->dw;
+it could be megabytes, and it is not copied or scanned along the way.
+Returns 0 for ok or -1 if js is gone.
 *********************************************************************/
 
-static void processEffects(void)
+static int processEffects(int side)
 {
-	char *s, *t, *v;
-	char c;
-	jsobjtype p;
-	int n;
+	struct EJ_EFFECT e;
+	char *buf, *s0, *s1, *s2;
+	int total, skip;
 	struct inputChange *ic;
 
-	if (!effects)
-		return;
-
-	s = effects;
-	while (c = *s) {	/* another effect */
-		s += 2;
-		v = strstr(s, "`~@}");	/* end marker */
-/* There should always be an end marker -
- * unless there is a spurious null in the string. */
-		if (!v)
-			break;
-		*v = 0;
+	while (side > 0) {
+		if (readFromJS(&e, sizeof(e)) < 0)
+			return -1;
+		total = e.len[0] + e.len[1] + e.len[2] + 3;
+		side -= sizeof(e) + total;
+		if (e.len[0] < 0 || e.len[1] < 0 || e.len[2] < 0 || side < 0) {
+/* this should never happen */
+			js_kill();
+			i_puts(MSG_JSEngineSync);
+			markAllDead();
+			return -1;
+		}
 
-		switch (c) {
-		case 'w':	/* document.write */
+		skip = 0;
+		if (e.type == 'w') {
 			dwStart();
-			stringAndString(&cf->dw, &cf->dw_l, s);
-			break;
+			buf = stringAndRoom(&cf->dw, &cf->dw_l, e.len[0]);
+			if (readFromJS(buf, e.len[0]) < 0)
+				return -1;
+			debugPrint(4, "< write %d bytes", e.len[0]);
+			skip = e.len[0];
+		}
 
+/* the rest of the record, or just the nulls after the written text */
+		buf = allocMem(total - skip);
+		if (readFromJS(buf, total - skip) < 0) {
+			free(buf);
+			return -1;
+		}
+		if (e.type == 'w') {
+			free(buf);
+			continue;
+		}
+		s0 = buf;
+		s1 = s0 + e.len[0] + 1;
+		s2 = s1 + e.len[1] + 1;
+		debugPrint(4, "< effect %c%c %p %s", e.type,
+			   (e.minor ? e.minor : ' '), e.obj[0],
+			   (e.len[0] > 100 ? "long" : s0));
+
+		switch (e.type) {
 		case 'n':	/* new window */
-/* url on one line, name of window on next line */
-			t = strchr(s, '\n');
-			*t = 0;
-			javaOpensWindow(s, t + 1);
+/* p or r for replace, and the url, then the name of the window */
+			javaOpensWindow(s0, s1);
 			break;
 
 		case 'v':	/* value = "foo" */
-			t = strchr(s, '=');
-			*t++ = 0;
-			sscanf(s, "%p", &p);
-			prepareForField(t);
-			javaSetsTagVar(p, t);
+			prepareForField(s0);
+			javaSetsTagVar(e.obj[0], s0);
 			break;
 
 		case 't':	/* js timer */
-			n = strtol(s, &t, 10);
-			s = t + 1;
-			t = strchr(s, '|');
-			*t++ = 0;
-			v[-2] = 0;
-			sscanf(t, "%p", &p);
-			ic = allocMem(sizeof(struct inputChange) + strlen(s));
+			ic = allocMem(sizeof(struct inputChange) + e.len[0]);
 // Yeah I know, this isn't a pointer to htmlTag.
-			ic->t = p;
-			ic->tagno = n;
+			ic->t = e.obj[0];
+			ic->tagno = e.n;
 			ic->major = 't';
-			ic->minor = v[-1];
+			ic->minor = e.minor;
 			ic->f0 = cf;
-			strcpy(ic->value, s);
+			strcpy(ic->value, s0);
 			addToListBack(&inputChangesPending, ic);
 			break;
 
 		case 'c':	/* cookie */
 /* Javascript does some modest syntax checking on the cookie before
  * passing it back to us, so I'm just going to assume it works. */
-			receiveCookie(cf->fileName, s);
+			receiveCookie(cf->fileName, s0);
 			break;
 
 		case 'f':
-			c = *s++;
-			sscanf(s, "%p", &p);
-			javaSubmitsForm(p, (c == 'r'));
+			javaSubmitsForm(e.obj[0], (e.minor == 'r'));
 			break;
 
 		case 'i':
-			c = *s++;
 /* h = inner html, t = inner text */
-			t = strchr(s, '|');
-			*t++ = 0;
-			sscanf(s, "%p", &p);
-			javaSetsInner(p, t, c);
+			javaSetsInner(e.obj[0], s0, e.len[0], s1, e.len[1],
+				      e.minor);
 			break;
 
 		case 'l':
-			c = *s;
-			s += 2;
-			sscanf(s, "%p", &p);
-			s = strchr(s, ',') + 1;
-			javaSetsLinkage(false, c, p, s);
+			javaSetsLinkage(false, e.minor, e.obj[0], s0,
+					e.obj[1], s1, e.obj[2], s2);
 			break;
 
 		}		/* switch */
 
-/* skip past end marker + newline */
-		s = v + 5;
+		free(buf);
 	}			/* loop over effects */
 
-	free(effects);
-	effects = 0;
-}				/* processEffects */
-
-/* Read some data from the js process.
- * Close things down if there is any trouble from the read.
- * Returns 0 for ok or -1 for bad read. */
-static int readFromJS(void *data_p, int n)
-{
-	unsigned char *bytes_p = (unsigned char *)data_p;
-	int rc;
-	if (n == 0)
-		return 0;
-	while (n > 0) {
-		rc = read(pipe_in[0], bytes_p, n);
-		debugPrint(7, "js read %d", rc);
-		if (rc <= 0) {
-/* Oops - can't read from the process any more */
-			i_puts(MSG_JSEngineRW);
-			js_kill();
-			markAllDead();
-			return -1;
-		}
-		n -= rc;
-		bytes_p += rc;
-	}
 	return 0;
-}				/* readFromJS */
-
-static int writeToJS(const void *data_p, int n)
-{
-	int rc;
-	if (n == 0)
-		return 0;
-	rc = write(pipe_out[1], data_p, n);
-	if (rc == n)
-		return 0;
-/* Oops - can't write to the process any more */
-	js_kill();
-/* this call will print an error message for you */
-	markAllDead();
-	return -1;
-}				/* writeToJS */
+}				/* processEffects */
 
 static char *propval;		/* property value, allocated */
 static enum ej_proptype proptype;
@@ -426,19 +938,8 @@ static int readMessage(void)
 		return -1;
 	}
 
-	if (head.side) {
-		effects = allocMem(head.side + 1);
-		if (readFromJS(effects, head.side) < 0) {
-			free(effects);
-			effects = 0;
-			return -1;
-		}
-		effects[head.side] = 0;
-// because debugPrint always puts on a newline
-		effects[head.side - 1] = 0;
-		debugPrint(4, "< side effects\n%s", effects);
-		processEffects();
-	}
+	if (head.side && processEffects(head.side) < 0)
+		return -1;
 
 /* next grab the error message, if there is one */
 	l = head.msglen;
@@ -511,6 +1012,8 @@ static int readMessage(void)
 
 static int writeHeader(void)
 {
+	if (sendBatch())
+		return -1;
 	head.magic = EJ_MAGIC;
 	head.jcx = cf->jcx;
 	head.winobj = cf->winobj;
@@ -605,6 +1108,12 @@ void freeJavaContext(struct ebFrame *f)
 
 	debugPrint(5, "> free context session %d", context);
 
+/* no sense setting properties in a context that is going away */
+	if (batch_f == f)
+		dropBatch();
+	else if (sendBatch())
+		return;
+
 	head.magic = EJ_MAGIC;
 	head.cmd = EJ_CMD_DESTROY;
 	head.jcx = f->jcx;
@@ -625,6 +1134,7 @@ void js_shutdown(void)
 	if (!js_pid)		/* js not running */
 		return;
 	debugPrint(5, "> js shutdown");
+	dropBatch();
 	head.magic = EJ_MAGIC;
 	head.cmd = EJ_CMD_EXIT;
 	head.jcx = 0;
@@ -640,9 +1150,12 @@ void js_disconnect(void)
 		return;
 	if (!js_pid)
 		return;
+	dropBatch();
+	ringClose();
 	close(pipe_in[0]);
 	close(pipe_out[1]);
 	js_pid = 0;
+	js_threaded = false;
 }				/* js_disconnect */
 
 /* Run some javascript code under the current window */
@@ -732,17 +1245,7 @@ void delete_property(jsobjtype obj, const char *name)
 		return;
 
 	debugPrint(5, "> delete %s", name);
-
-	head.cmd = EJ_CMD_DELPROP;
-	head.obj = obj;
-	head.n = strlen(name);
-	if (writeHeader())
-		return;
-	if (writeToJS(name, head.n))
-		return;
-	if (readMessage())
-		return;
-	ack5();
+	queueOp(EJ_CMD_DELPROP, obj, name, 0, EJ_PROP_NONE, 0);
 }				/* delete_property */
 
 /* Get a property from an object, js will tell us the type. */
@@ -894,6 +1397,11 @@ static int set_property(jsobjtype obj, const char *name,
 
 	debugPrint(5, "> set %s=%s", name, debugString(value));
 
+/* A function is compiled, and its errors are reported under its name,
+ * so it goes on its own. */
+	if (proptype != EJ_PROP_FUNCTION)
+		return queueOp(EJ_CMD_SETPROP, obj, name, value, proptype, 0);
+
 	head.cmd = EJ_CMD_SETPROP;
 	head.obj = obj;
 	head.proptype = proptype;
@@ -1004,6 +1512,10 @@ static int set_array_element(jsobjtype array, int idx,
 
 	debugPrint(5, "> set [%d]=%s", idx, debugString(value));
 
+/* an instance comes back to us, an object does not */
+	if (proptype == EJ_PROP_OBJECT)
+		return queueOp(EJ_CMD_SETAREL, array, 0, value, proptype, idx);
+
 	head.cmd = EJ_CMD_SETAREL;
 	head.obj = array;
 	head.proptype = proptype;
@@ -1460,7 +1972,7 @@ static void rebuildSelector(struct htmlTag *sel, jsobjtype oa, int len2)
 			break;
 		}
 
-		t->jv = oo;	/* should already equal oo */
+		setTagJv(t, oo);	/* should already equal oo */
 		t->rchecked = get_property_bool(oo, "defaultSelected");
 		check2 = get_property_bool(oo, "selected");
 		if (check2) {
@@ -1497,7 +2009,7 @@ static void rebuildSelector(struct htmlTag *sel, jsobjtype oa, int len2)
 			if (t->controller != sel)
 				continue;
 /* option is gone in js, disconnect this option tag from its select */
-			t->jv = 0;
+			setTagJv(t, 0);
 			t->controller = 0;
 			t->action = TAGACT_NOP;
 			changed = true;
@@ -1509,7 +2021,7 @@ static void rebuildSelector(struct htmlTag *sel, jsobjtype oa, int len2)
 			t = newTag("option");
 			t->lic = i2;
 			t->controller = sel;
-			t->jv = oo;
+			setTagJv(t, oo);
 			t->step = 2;	// already decorated
 			t->textval = get_property_string(oo, "text");
 			t->value = get_property_string(oo, "value");
@@ -13,7 +13,10 @@ Since there are no function declarations here, we don't need the extern "C" {}
 #ifndef EBJS_H
 #define EBJS_H 1
 
-#define EJ_MAGIC 0xac97
+/* Bump the version when the messages change shape;
+ * it rides in the magic number, so a mismatch reads as out of sync. */
+#define EJ_VERSION 3
+#define EJ_MAGIC (0xac97 + (EJ_VERSION << 16))
 
 enum ej_cmd {
 	EJ_CMD_NONE,
@@ -30,6 +33,7 @@ enum ej_cmd {
 	EJ_CMD_ARLEN,
 	EJ_CMD_CALL,
 	EJ_CMD_VARUPDATE,
+	EJ_CMD_BATCH,
 };
 
 enum ej_highstat {
@@ -84,9 +88,65 @@ struct EJ_MSG {
 	int proplength;
 	enum ej_proptype proptype;
 	int n;			/* an overloaded integer */
-	int side;		/* length of side effects string */
+	int side;		/* length of the side effect records */
 	int msglen;		/* error message from JS */
 	int lineno;		/* line number */
 };
 
+/* Shared memory transport, see ebjs.c.
+ * Two of these, to js and then from js, each followed by EJ_RINGSIZE bytes.
+ * The counters run modulo 2^32, so the size must be a power of 2. */
+#define EJ_RINGSIZE (1024*1024)
+struct EJ_RING {
+	unsigned int head;	/* bytes written */
+	unsigned int tail;	/* bytes read */
+	int readwait;		/* the reader is asleep */
+	int writewait;		/* the writer is asleep */
+};
+
+/*********************************************************************
+EJ_CMD_BATCH carries several operations that don't return anything,
+n of them, packed into proplength bytes after the header.
+Each is an EJ_OP, then the member name, then the value.
+The js process runs them in order and does not reply;
+side effects and errors come back with the next reply.
+*********************************************************************/
+
+struct EJ_OP {
+	enum ej_cmd cmd;	/* EJ_CMD_SETPROP, DELPROP, or SETAREL */
+	jsobjtype obj;
+	enum ej_proptype proptype;
+	int n;			/* array index */
+	int namelength;
+	int proplength;
+};
+
+/*********************************************************************
+The side effects of running js come back as a series of records,
+side bytes in all, ahead of the error message.
+Each is an EJ_EFFECT, then its three strings, each followed by a null.
+Strings that don't apply are empty.
+Nothing is scanned for; the lengths say where everything is.
+w	document.write, the text
+n	new window, p or r and the url, then the window name
+v	input value, obj[0] is the input, the new value
+t	timer, n is the timer number, minor is 1 for an interval,
+	obj[0] is the timer object, the function name, or - to clear it
+c	cookie
+i	minor h for innerHTML, t for innerText, obj[0] is the tag,
+	the text, then the decoration of the new html, if any
+f	minor s to submit, r to reset, obj[0] is the form
+l	linkage, minor a b r c for append insert-before remove create,
+	obj[] is the parent, the child, and the node before,
+	or just the new node for create,
+	and the strings are their node names
+*********************************************************************/
+
+struct EJ_EFFECT {
+	char type, minor;
+	int n;
+	jsobjtype obj[3];
+	int len[3];
+};
+
 #endif
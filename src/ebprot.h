@@ -6,6 +6,8 @@ bool addWebAuthorization(const char *url, const char *credentials, bool proxy) ;
 
 /* sourcefile=buffers.c */
 void removeHiddenNumbers(pst p, uchar terminate);
+struct lineMap *mapLine(struct lineIndex *x, int n);
+struct lineMap *mapLineWrite(struct lineIndex *x, int n);
 pst fetchLine(int n, int show) ;
 void displayLine(int n) ;
 void initializeReadline(void) ;
@@ -37,9 +39,9 @@ void sendCookies(char **s, int *l, const char *url, bool issecure) ;
 /* sourcefile=cache.c */
 void setupEdbrowseCache(void);
 void clearCache(void) ;
-bool fetchCache(const char * url, const char *etag, time_t modtime, char **data, int *data_len) ;
-void storeCache(const char *url, const char *etag, time_t modtime, const char *data, int datalen) ;
-bool presentInCache(const char *url) ;
+bool fetchCache(const char * url, const char *etag, time_t modtime, time_t expires, char **data, int *data_len, char **content) ;
+void storeCache(const char *url, const char *etag, time_t modtime, time_t expires, const char *content, const char *data, int datalen) ;
+bool lookupCache(const char *url, char **etag, time_t *modtime, bool *fresh) ;
 
 /* sourcefile=dbodbc.c (and others) */
 bool fetchForeign(char *tname) ;
@@ -65,6 +67,11 @@ void createJavaContext(void) ;
 void freeJavaContext(struct ebFrame *f) ;
 void js_shutdown(void) ;
 void js_disconnect(void);
+bool ringAttach(const char *spec, int alive);
+int ringRead(void *data_p, int n);
+int ringWrite(const void *data_p, int n);
+bool inJsThread(void);
+void jsThreadExit(void);
 char *jsRunScriptResult(jsobjtype obj, const char *str, const char *filename, int lineno) ;
 void jsRunScript(jsobjtype obj, const char *str, const char *filename, int lineno) ;
 enum ej_proptype has_property(jsobjtype obj, const char *name) ;
@@ -140,7 +147,6 @@ bool htmlTest(void) ;
 void infShow(int tagno, const char *search) ;
 bool infReplace(int tagno, const char *newtext, bool notify) ;
 bool infPush(int tagno, char **post_string) ;
-struct htmlTag *tagFromJavaVar(jsobjtype v);
 struct htmlTag *tagFromJavaVar2(jsobjtype v, const char *tagname);
 void javaSubmitsForm(jsobjtype v, bool reset) ;
 bool handlerGoBrowse(const struct htmlTag *t, const char *name) ;
@@ -153,7 +159,7 @@ void delTimers(struct ebFrame *f);
 void delInputChanges(struct ebFrame *f);
 void runTimers(void);
 void javaOpensWindow(const char *href, const char *name) ;
-void javaSetsLinkage(bool after, char type, jsobjtype p, const char *rest);
+void javaSetsLinkage(bool after, char type, jsobjtype p_j, const char *p_name, jsobjtype a_j, const char *a_name, jsobjtype b_j, const char *b_name);
 
 /* sourcefile=html-tidy.c */
 void html2nodes(const char *htmltext, bool startpage);
@@ -171,6 +177,11 @@ jsobjtype instantiate_url(jsobjtype parent, const char *name, const char *url) ;
 char *render(int start);
 void decorate(int start);
 void freeTags(struct ebWindow *w) ;
+void setTagJv(struct htmlTag *t, jsobjtype v);
+void setTagId(struct htmlTag *t, char *id);
+void setTagName(struct htmlTag *t, char *name);
+struct htmlTag *tagFromJavaVar(jsobjtype v);
+struct htmlTag *tagFromAnchor(const char *s);
 struct htmlTag *newTag(const char *tagname) ;
 void initTagArray(void);
 void htmlNodesIntoTree(int start, struct htmlTag *attach);
@@ -187,9 +198,15 @@ bool parseRefresh(char *ref, int *delay_p) ;
 bool shortRefreshDelay(void);
 bool httpConnect(const char *url, bool down_ok, bool webpage, bool f_encoded, char **headers_p, char **body_p, int *bodlen_p);
 void ebcurl_setError(CURLcode curlret, const char *url) ;
+void http_curl_cleanup_pool(void);
+void prefetchURLs(struct PREFETCH *list, int n);
+void freePrefetch(struct PREFETCH *list, int n);
+void prefetchAhead(struct PREFETCH *list, int n);
 void setHTTPLanguage(const char *lang) ;
 int ebcurl_debug_handler(CURL * handle, curl_infotype info_desc, char *data, size_t size, void *unused) ;
 int bg_jobs(bool iponly);
+bool bgKill(int id);
+void waitDownloads(void);
 void addNovsHost(char *host) ;
 void deleteNovsHosts(void);
 CURLcode setCurlURL(CURL * h, const char *url) ;
@@ -269,6 +286,7 @@ char *strmove(char *dest, const char *src) ;
 char *initString(int *l) ;
 void stringAndString(char **s, int *l, const char *t) ;
 void stringAndBytes(char **s, int *l, const char *t, int cnt) ;
+char *stringAndRoom(char **s, int *l, int cnt) ;
 void stringAndChar(char **s, int *l, char c) ;
 void stringAndNum(char **s, int *l, int n) ;
 void stringAndKnum(char **s, int *l, int n) ;
@@ -370,6 +388,7 @@ void decodeMailURL(const char *url, char **addr_p, char **subj_p, char **body_p)
 
 /* sourcefile=jseng-moz.cpp */
 int js_main(int argc, char **argv);
+void js_teardown(void);
 // the native versions of the api functions in ebjs.c
 enum ej_proptype has_property_nat(jsobjtype obj, const char *name) ;
 void delete_property_nat(jsobjtype obj, const char *name) ;
@@ -2681,10 +2681,9 @@ nextline:
 	repln = strchr(linetype, 'r') - linetype;
 	subln = strchr(linetype, 's') - linetype;
 	if (repln != 1) {
-		struct lineMap *map = cw->map;
 		struct lineMap swap;
-		struct lineMap *q1 = map + 1;
-		struct lineMap *q2 = map + repln;
+		struct lineMap *q1 = mapLineWrite(cw->map, 1);
+		struct lineMap *q2 = mapLineWrite(cw->map, repln);
 		swap = *q1;
 		*q1 = *q2;
 		*q2 = swap;
@@ -2695,10 +2694,9 @@ nextline:
 
 	j = strlen(linetype) - 1;
 	if (j != subln) {
-		struct lineMap *map = cw->map;
 		struct lineMap swap;
-		struct lineMap *q1 = map + j;
-		struct lineMap *q2 = map + subln;
+		struct lineMap *q1 = mapLineWrite(cw->map, j);
+		struct lineMap *q2 = mapLineWrite(cw->map, subln);
 		swap = *q1;
 		*q1 = *q2;
 		*q2 = swap;
@@ -456,7 +456,7 @@ static void runGeneratedHtml(struct htmlTag *t, const char *h, const char *pre)
 				break;
 			++pre;
 			sscanf(pre, "%p", &v);
-			tagList[l + j]->jv = v;
+			setTagJv(tagList[l + j], v);
 			while (*pre && *pre != ',')
 				++pre;
 		}
@@ -465,26 +465,113 @@ static void runGeneratedHtml(struct htmlTag *t, const char *h, const char *pre)
 	htmlGenerated = false;
 }				/* runGeneratedHtml */
 
-/* helper function to prepare an html script.
- * Fetch from the internetif src=url.
- * Some day we'll do these fetches in parallel in the background. */
-static void prepareScript(struct htmlTag *t)
+static bool isJavaScript(const struct htmlTag *t)
 {
-	const char *js_file = "generated";
-	char *js_text = 0;
 	const char *a;
-	const char *filepart;
-
 /* If no language is specified, javascript is default. */
 	a = attribVal(t, "language");
 	if (a && (!memEqualCI(a, "javascript", 10) || isalphaByte(a[10])))
-		return;
+		return false;
 /* Also reject a script if a type is specified and it is not JS.
  * For instance, some JSON pairs in script tags on the amazon.com
  * homepage. */
 	a = attribVal(t, "type");
 	if (a && (!memEqualCI(a, "javascript", 10))
 	    && (!memEqualCI(a, "text/javascript", 15)))
+		return false;
+	return true;
+}				/* isJavaScript */
+
+/*********************************************************************
+Before the scripts run, fetch all the external ones at once,
+see prefetchURLs() in http.c.
+The scripts still run one at a time, in document order,
+and prepareScript() takes each body from this list, if it is there.
+A script that came back 404, or any other error, is reported from the list.
+Whatever isn't there, because the connection failed or the server
+wants a password, prepareScript() fetches as it always has.
+*********************************************************************/
+
+static struct PREFETCH *pfList;
+static struct htmlTag **pfTags;
+static int pfCount;
+
+static void freeScriptPrefetch(void)
+{
+	freePrefetch(pfList, pfCount);
+	nzFree(pfList);
+	nzFree(pfTags);
+	pfList = NULL;
+	pfTags = NULL;
+	pfCount = 0;
+}				/* freeScriptPrefetch */
+
+/* the external scripts that runScriptsPending() is about to run */
+static bool prefetchable(const struct htmlTag *t)
+{
+	return (t->action == TAGACT_SCRIPT && t->step < 3 && t->jv &&
+		t->href && isJavaScript(t) && javaOK(t->href) &&
+		!isDataURI(t->href) && isURL(t->href));
+}				/* prefetchable */
+
+static void prefetchScripts(void)
+{
+	int j, n;
+	struct htmlTag *t;
+
+	freeScriptPrefetch();
+	for (j = n = 0; j < cw->numTags; ++j)
+		if (prefetchable(tagList[j]))
+			++n;
+	if (n < 2)
+		return;
+
+	pfList = allocZeroMem(n * sizeof(struct PREFETCH));
+	pfTags = allocMem(n * sizeof(struct htmlTag *));
+	for (j = 0; j < cw->numTags; ++j) {
+		t = tagList[j];
+		if (!prefetchable(t))
+			continue;
+		pfList[pfCount].url = t->href;
+		pfTags[pfCount] = t;
+		++pfCount;
+	}
+	prefetchURLs(pfList, pfCount);
+}				/* prefetchScripts */
+
+/* Take the prefetched body of this script, if we have it.
+ * Returns the http code, 0 if it wasn't prefetched, or it has to be fetched
+ * again, by httpConnect, to ask for a password or to report the error.
+ * Any other code is final, and data is set only for 200. */
+static long prefetched(const struct htmlTag *t, char **data, int *len)
+{
+	int j;
+	long code;
+	for (j = 0; j < pfCount; ++j) {
+		if (pfTags[j] != t)
+			continue;
+		code = pfList[j].code;
+		if (code == 200 && !pfList[j].data)
+			return 0;
+		*data = pfList[j].data;
+		*len = pfList[j].length;
+		pfList[j].data = 0;
+		return code;
+	}
+	return 0;
+}				/* prefetched */
+
+/* helper function to prepare an html script.
+ * Fetch from the internet if src=url, unless it was prefetched. */
+static void prepareScript(struct htmlTag *t)
+{
+	const char *js_file = "generated";
+	char *js_text = 0;
+	const char *filepart;
+	int js_len;
+	long js_code;
+
+	if (!isJavaScript(t))
 		return;
 
 /* It's javascript, run with the source or the inline text.
@@ -525,6 +612,14 @@ static void prepareScript(struct htmlTag *t)
 					prepareForBrowse(js_text,
 							 serverDataLen);
 				}
+			} else if ((js_code = prefetched(t, &js_text, &js_len))) {
+				if (js_code == 200) {
+					prepareForBrowse(js_text, js_len);
+				} else {
+					if (debugLevel >= 3)
+						i_printf(MSG_GetJS,
+							 t->href, js_code);
+				}
 			} else
 			    if (httpConnect
 				(t->href, false, false, true, 0, 0, 0)) {
@@ -596,6 +691,7 @@ void runScriptsPending(void)
 
 top:
 	change = false;
+	prefetchScripts();
 
 	for (j = 0; j < cw->numTags; ++j) {
 		t = tagList[j];
@@ -628,8 +724,10 @@ top:
 		debugPrint(3, "execution complete");
 		nzFree(jtxt);
 
-		if (newlocation && newloc_r)
+		if (newlocation && newloc_r) {
+			freeScriptPrefetch();
 			return;
+		}
 
 /* look for document.write from this script */
 		if (cf->dw) {
@@ -641,6 +739,7 @@ top:
 		}
 	}
 
+	freeScriptPrefetch();
 	if (change)
 		goto top;
 
@@ -660,12 +759,8 @@ top:
 			u->step = 100;
 		}
 		t->firstchild = NULL;
-		h = strstr(ic->value, "</body>@");
-		if (h) {
-			h += 7;
-			*h++ = 0;
-		} else
-			h = emptyString;
+/* the decoration follows the html, see javaSetsInner() */
+		h = ic->value + strlen(ic->value) + 1;
 		runGeneratedHtml(t, ic->value, h);
 		change = true;
 	}
@@ -704,10 +799,19 @@ top:
 	}
 
 	foreach(ic, inputChangesPending) {
+		jsobjtype a_j, b_j;
+		char *p_name, *a_name, *b_name;
 		if (ic->major != 'l')
 			continue;
 		ic->major = 'x';
-		javaSetsLinkage(true, ic->minor, ic->t, ic->value);
+/* unpack what javaSetsLinkage put there */
+		memcpy(&a_j, ic->value, sizeof(jsobjtype));
+		memcpy(&b_j, ic->value + sizeof(jsobjtype), sizeof(jsobjtype));
+		p_name = ic->value + 2 * sizeof(jsobjtype);
+		a_name = p_name + strlen(p_name) + 1;
+		b_name = a_name + strlen(a_name) + 1;
+		javaSetsLinkage(true, ic->minor, ic->t, p_name,
+				a_j, a_name, b_j, b_name);
 	}
 
 	foreach(ic, inputChangesPending) {
@@ -972,6 +1076,7 @@ updateFieldInBuffer(int tagno, const char *newtext, bool notify, bool fromForm)
 {
 	int ln, idx, n, plen;
 	char *p, *s, *t, *new;
+	struct lineMap *lm;
 
 	if (locateTagInBuffer(tagno, &ln, &p, &s, &t)) {
 		n = (plen = pstLength((pst) p)) + strlen(newtext) - (t - s);
@@ -979,8 +1084,11 @@ updateFieldInBuffer(int tagno, const char *newtext, bool notify, bool fromForm)
 		memcpy(new, p, s - p);
 		strcpy(new + (s - p), newtext);
 		memcpy(new + strlen(new), t, plen - (t - p));
-		free(cw->map[ln].text);
-		cw->map[ln].text = new;
+		lm = mapLineWrite(cw->map, ln);
+		if (lm->home == LT_HEAP)
+			free(lm->text);
+		lm->text = new;
+		lm->home = LT_HEAP;
 		if (notify)
 			displayLine(ln);
 		return;
@@ -1812,25 +1920,7 @@ bool infPush(int tagno, char **post_string)
 	return true;
 }				/* infPush */
 
-/* I don't have any reverse pointers, so I'm just going to scan the list */
-/* This doesn't come up all that often. */
-struct htmlTag *tagFromJavaVar(jsobjtype v)
-{
-	struct htmlTag *t = 0;
-	int i;
-
-	if (!tagList)
-		i_printfExit(MSG_NullListInform);
-
-	for (i = 0; i < cw->numTags; ++i) {
-		t = tagList[i];
-		if (t->jv == v)
-			return t;
-	}
-	return 0;
-}				/* tagFromJavaVar */
-
-/* Like the above but create it if you can't find it. */
+/* Like tagFromJavaVar() but create it if you can't find it. */
 struct htmlTag *tagFromJavaVar2(jsobjtype v, const char *tagname)
 {
 	struct htmlTag *t = tagFromJavaVar(v);
@@ -1843,7 +1933,7 @@ struct htmlTag *tagFromJavaVar2(jsobjtype v, const char *tagname)
 		debugPrint(3, "cannot create tag node %s", tagname);
 		return 0;
 	}
-	t->jv = v;
+	setTagJv(t, v);
 /* this node now has a js object, don't decorate it again. */
 	t->step = 2;
 /* and don't render it unless it is linked into the active tree */
@@ -2440,31 +2530,43 @@ static void setTagAttr(struct htmlTag *t, const char *name, char *val)
 	t->atvals[nattr] = 0;
 }				/* setTagAttr */
 
-void javaSetsLinkage(bool after, char type, jsobjtype p_j, const char *rest)
+void javaSetsLinkage(bool after, char type, jsobjtype p_j, const char *p_name,
+		     jsobjtype a_j, const char *a_name,
+		     jsobjtype b_j, const char *b_name)
 {
 	struct htmlTag *parent, *add, *before, *c, *t;
-	jsobjtype *a_j, *b_j;
-	char p_name[MAXTAGNAME], a_name[MAXTAGNAME], b_name[MAXTAGNAME];
 	int action;
 	char *jst;		// java string
 
 // Postpone anything other than create until after js is finished,
 // so we can query js variables.
+// The child and the node before go at the front of value, then the names.
 	if (!after && type != 'c') {
 		struct inputChange *ic;
-		ic = allocMem(sizeof(struct inputChange) + strlen(rest));
+		int l1 = strlen(p_name) + 1;
+		int l2 = strlen(a_name) + 1;
+		int l3 = strlen(b_name) + 1;
+		char *s;
+		ic = allocMem(sizeof(struct inputChange) +
+			      2 * sizeof(jsobjtype) + l1 + l2 + l3);
 // Yeah I know, this isn't a pointer to htmlTag.
 		ic->t = p_j;
 		ic->tagno = 0;
 		ic->major = 'l';
 		ic->minor = type;
 		ic->f0 = cf;
-		strcpy(ic->value, rest);
+		s = ic->value;
+		memcpy(s, &a_j, sizeof(jsobjtype));
+		s += sizeof(jsobjtype);
+		memcpy(s, &b_j, sizeof(jsobjtype));
+		s += sizeof(jsobjtype);
+		memcpy(s, p_name, l1);
+		memcpy(s + l1, a_name, l2);
+		memcpy(s + l1 + l2, b_name, l3);
 		addToListBack(&inputChangesPending, ic);
 		return;
 	}
 
-	sscanf(rest, "%s %p,%s %p,%s ", p_name, &a_j, a_name, &b_j, b_name);
 /* options are relinked by rebuildSelectors, not here. */
 	if (stringEqual(p_name, "option"))
 		return;
@@ -2566,8 +2668,8 @@ ab:
 /* This node is attached to the tree, just like an html tag would be. */
 	t = add;
 	action = t->action;
-	t->name = get_property_string(t->jv, "name");
-	t->id = get_property_string(t->jv, "id");
+	setTagName(t, get_property_string(t->jv, "name"));
+	setTagId(t, get_property_string(t->jv, "id"));
 
 	switch (action) {
 	case TAGACT_INPUT:
@@ -8,53 +8,102 @@
 #ifdef _MSC_VER
 #include <fcntl.h>
 #else
-#include <sys/wait.h>
+#include <pthread.h>
 #endif
 #include <time.h>
 
-char *serverData;
-int serverDataLen;
+THREADLOCAL char *serverData;
+THREADLOCAL int serverDataLen;
 CURL *global_http_handle;
 CURLSH *global_share_handle;
-bool pluginsOn = true;
+THREADLOCAL bool pluginsOn = true;
 bool down_bg;			/* download in background */
+int downMax = 4;		/* background downloads at once */
+long downRate;			/* kilobytes per second for each, 0 is no limit */
+int downSegments = 1;		/* byte ranges to fetch a large file in */
 char showProgress = 'd';	// dots
 
-static CURL *down_h;
-static int down_pid;		/* pid of the downloading child process */
-static bool down_permitted;
-static int down_msg;
+static THREADLOCAL CURL *down_h;
+static THREADLOCAL bool down_permitted;
+static THREADLOCAL bool down_post;	/* the download answers a post */
+static THREADLOCAL int down_msg;
+
+/* A download is fetched in one or more byte ranges, each on its own handle. */
+#define MINSEGMENT (4*1024*1024)
+struct BG_JOB;
+struct DOWNSEG {
+	struct BG_JOB *job;
+	CURL *h;
+	off_t start, end;	// end is one past the range, 0 if not known
+	off_t pos;		// where the next byte goes
+	int tries;
+	bool ranged;		// asked for a range
+	bool busy;		// in the multi handle
+	bool checked;		// response code has been checked
+	bool refused;		// server would not send the range
+	bool done;
+};
 
 struct BG_JOB {
 	struct BG_JOB *next, *prev;
-	int pid, state;
-	size_t fsize;		// file size
+	struct DOWNSEG seg[MAXSEGMENTS];
+	int nseg;
+	struct curl_slist *headers;
+	char *url;
+	char *etag;
+	time_t modtime;
+	int id;			// as shown by bglist
+	int fd;
+	int state;		// 5 queued, 4 running, 0 complete, -1 failed
+	CURLcode result;
+	bool cancel;
+	bool http;
+	bool fg;		// the user is waiting for it
+	bool resumable;		// keeps a resume file beside it
+	off_t fsize;		// file size, 0 if not known
 	int file2;		// offset into filename
 	char file[4];
 };
+static THREADLOCAL struct BG_JOB *down_job;	/* planned, not yet handed over */
 struct listHead down_jobs = {
 	&down_jobs, &down_jobs
 };
 
-static void background_download(struct eb_curl_callback_data *data);
+static void background_download(struct eb_curl_callback_data *data,
+				CURL * h, struct curl_slist *headers);
+static bool planDownload(struct eb_curl_callback_data *data,
+			 const char *file);
 static void setup_download(struct eb_curl_callback_data *data);
 static CURL *http_curl_init(struct eb_curl_callback_data *cbd);
+static void http_curl_release(CURL * h);
+static void connectStats(CURL * h);
+static bool takePrefetch(const char *url);
+
+/*********************************************************************
+Everything that one fetch leaves behind, the headers, the body,
+a redirection, is per thread.
+With jsthread = on, an xhr runs httpConnect on the js thread,
+and must not disturb a fetch, or a refresh, pending on the edbrowse side;
+each thread gets its own copy, as the js process did.
+*********************************************************************/
 
-static char *http_headers;
-static int http_headers_len;
+static THREADLOCAL char *http_headers;
+static THREADLOCAL int http_headers_len;
 static char *httpLanguage;	/* outgoing */
-long ht_code;			/* example, 404 */
-static char ht_error[CURL_ERROR_SIZE + 1];
+THREADLOCAL long ht_code;	/* example, 404 */
+static THREADLOCAL char ht_error[CURL_ERROR_SIZE + 1];
 /* an assortment of variables that are gleaned from the incoming http headers */
 /* http content type is used in many places, and isn't arbitrarily long
  * or case sensitive, so keep our own sanitized copy. */
-static char ht_content[60];
-static char *ht_charset;	/* extra content info such as charset */
-int ht_length;			/* http content length */
-static char *ht_cdfn;		/* http content disposition file name */
-static time_t ht_modtime;	/* http modification time */
-static char *ht_etag;		/* the etag in the header */
-static bool ht_cacheable;
+static THREADLOCAL char ht_content[60];
+static THREADLOCAL char *ht_charset;	/* extra content info such as charset */
+static THREADLOCAL off_t ht_length;	/* http content length */
+static THREADLOCAL char *ht_cdfn;	/* http content disposition file name */
+static THREADLOCAL time_t ht_modtime;	/* http modification time */
+static THREADLOCAL char *ht_etag;	/* the etag in the header */
+static THREADLOCAL bool ht_cacheable;
+static THREADLOCAL int ht_maxage;	/* cache-control max-age, -1 if not given */
+static THREADLOCAL bool ht_ranges;	/* server takes byte ranges of this resource */
 
 /*********************************************************************
 This function is called for a new web page, by http refresh,
@@ -66,11 +115,11 @@ The refresh parameter means replace the current page.
 This is false only if js creates a new window, which should stack up on top of the old.
 *********************************************************************/
 
-char *newlocation;
-int newloc_d;			/* possible delay */
-bool newloc_r;			/* replace the buffer */
-struct ebFrame *newloc_f;	/* frame calling for new web page */
-bool js_redirects;
+THREADLOCAL char *newlocation;
+THREADLOCAL int newloc_d;	/* possible delay */
+THREADLOCAL bool newloc_r;	/* replace the buffer */
+THREADLOCAL struct ebFrame *newloc_f;	/* frame calling for new web page */
+THREADLOCAL bool js_redirects;
 void gotoLocation(char *url, int delay, bool rf)
 {
 	if (newlocation && delay >= newloc_d) {
@@ -133,21 +182,26 @@ static char *find_http_header(const char *name)
 	return NULL;
 }				/* find_http_header */
 
+static void setContentType(const char *v)
+{
+	strncpy(ht_content, v, sizeof(ht_content) - 1);
+	caseShift(ht_content, 'l');
+	debugPrint(3, "content %s", ht_content);
+	ht_charset = strchr(ht_content, ';');
+	if (ht_charset)
+		*ht_charset++ = 0;
+/* The protocol, such as rtsp, could have already set the mime type. */
+	if (!cf->mt)
+		cf->mt = findMimeByContent(ht_content);
+}				/* setContentType */
+
 static void scan_http_headers(bool fromCallback)
 {
 	char *v;
 
 	if (!ht_content[0] && (v = find_http_header("content-type"))) {
-		strncpy(ht_content, v, sizeof(ht_content) - 1);
-		caseShift(ht_content, 'l');
+		setContentType(v);
 		nzFree(v);
-		debugPrint(3, "content %s", ht_content);
-		ht_charset = strchr(ht_content, ';');
-		if (ht_charset)
-			*ht_charset++ = 0;
-/* The protocol, such as rtsp, could have already set the mime type. */
-		if (!cf->mt)
-			cf->mt = findMimeByContent(ht_content);
 	}
 
 	if (!ht_cdfn && (v = find_http_header("content-disposition"))) {
@@ -168,10 +222,22 @@ static void scan_http_headers(bool fromCallback)
 	}
 
 	if (!ht_length && (v = find_http_header("content-length"))) {
-		ht_length = atoi(v);
+		ht_length = strtoll(v, NULL, 10);
 		nzFree(v);
+		if (ht_length < 0)
+			ht_length = 0;
 		if (ht_length)
-			debugPrint(3, "content length %d", ht_length);
+			debugPrint(3, "content length %lld",
+				   (long long)ht_length);
+	}
+
+/* Ranges of an encoded body don't line up with what curl gives us. */
+	if (!ht_ranges && (v = find_http_header("accept-ranges"))) {
+		char *e = find_http_header("content-encoding");
+		ht_ranges = (strstrCI(v, "bytes") &&
+			     (!e || stringEqualCI(e, "identity")));
+		nzFree(e);
+		nzFree(v);
 	}
 
 	if (!ht_etag && (v = find_http_header("etag"))) {
@@ -179,12 +245,24 @@ static void scan_http_headers(bool fromCallback)
 		debugPrint(3, "etag %s", ht_etag);
 	}
 
-	if (ht_cacheable && (v = find_http_header("cache-control"))) {
+	if ((ht_cacheable || ht_maxage < 0) &&
+	    (v = find_http_header("cache-control"))) {
+		char *s;
 		caseShift(v, 'l');
-		if (strstr(v, "no-cache")) {
+		if (ht_cacheable && strstr(v, "no-cache")) {
 			ht_cacheable = false;
 			debugPrint(3, "no cache");
 		}
+		if (ht_maxage < 0 && (s = strstr(v, "max-age="))) {
+			ht_maxage = atoi(s + 8);
+/* The copy may have sat in a proxy for a while. */
+			nzFree(v);
+			if ((v = find_http_header("age")))
+				ht_maxage -= atoi(v);
+			if (ht_maxage < 0)
+				ht_maxage = 0;
+			debugPrint(3, "max age %d", ht_maxage);
+		}
 		nzFree(v);
 	}
 
@@ -224,15 +302,9 @@ static void scan_http_headers(bool fromCallback)
 	}
 }				/* scan_http_headers */
 
-/* actually run the curl request, http or ftp or whatever */
-static bool is_http;
-static CURLcode fetch_internet(CURL * h)
+/* forget the headers of the last fetch */
+static void clearHeaders(void)
 {
-	CURLcode curlret;
-	down_h = h;
-/* this should already be 0 */
-	nzFree(newlocation);
-	newlocation = NULL;
 	nzFree(http_headers);
 	http_headers = initString(&http_headers_len);
 	ht_content[0] = 0;
@@ -243,7 +315,23 @@ static CURLcode fetch_internet(CURL * h)
 	ht_etag = NULL;
 	ht_length = 0;
 	ht_modtime = 0;
+	ht_maxage = -1;
+	ht_ranges = false;
+}				/* clearHeaders */
+
+/* actually run the curl request, http or ftp or whatever */
+static THREADLOCAL bool is_http;
+static CURLcode fetch_internet(CURL * h)
+{
+	CURLcode curlret;
+	down_h = h;
+/* this should already be 0 */
+	nzFree(newlocation);
+	newlocation = NULL;
+	clearHeaders();
 	curlret = curl_easy_perform(h);
+	if (curlret == CURLE_OK)
+		connectStats(h);
 	if (is_http)
 		scan_http_headers(false);
 	return curlret;
@@ -262,9 +350,8 @@ static const char *message_for_response_code(int code);
  * 0 standard in-memory download
  * 1 download but stop and ask user if he wants to download to disk
 * 2 disk download foreground
-* 3 disk download background parent
-* 4 disk download background child
-* 5 disk download background prefork
+* 3 disk download background, handed to the download thread
+* 5 disk download background, not yet handed over
  * 6 mime type says this should be a stream */
 size_t
 eb_curl_callback(char *incoming, size_t size, size_t nitems,
@@ -301,29 +388,12 @@ eb_curl_callback(char *incoming, size_t size, size_t nitems,
 			return -1;
 	}
 
-	if (data->down_state == 2 || data->down_state == 4) {	/* to disk */
+	if (data->down_state == 2) {	/* to disk */
 		rc = write(data->down_fd, incoming, num_bytes);
-		if (rc == num_bytes) {
-			if (data->down_state == 4) {
-#if 0
-// Deliberately delay background download, to get several running in parallel
-// for testing purposes.
-				if (data->down_length == 0)
-					sleep(17);
-				data->down_length += rc;
-#endif
-				return rc;
-			}
+		if (rc == num_bytes)
 			goto showdots;
-		}
-		if (data->down_state == 2) {
-			setError(MSG_NoWrite2, data->down_file);
-			return -1;
-		}
-		i_printf(MSG_NoWrite2, data->down_file);
-		printf(", ");
-		i_puts(MSG_DownAbort);
-		exit(1);
+		setError(MSG_NoWrite2, data->down_file);
+		return -1;
 	}
 
 showdots:
@@ -341,7 +411,7 @@ showdots:
 		}
 		if (showProgress == 'c' && ht_length)
 			printf("%d/%d\n", dots2,
-			       (ht_length + CHUNKSIZE - 1) / CHUNKSIZE);
+			       (int)((ht_length + CHUNKSIZE - 1) / CHUNKSIZE));
 	}
 	return num_bytes;
 }
@@ -734,6 +804,159 @@ fail:
 	return 0;
 }				/* parseHeaderDate */
 
+/* content type and charset, as they came in, for setContentType() */
+static char *contentString(void)
+{
+	char *content = allocMem(strlen(ht_content) +
+				 (ht_charset ? strlen(ht_charset) : 0) + 2);
+	strcpy(content, ht_content);
+	if (ht_charset) {
+		strcat(content, ";");
+		strcat(content, ht_charset);
+	}
+	return content;
+}				/* contentString */
+
+/* Put a fetched file into cache, if the headers say we may. */
+static void storeFetched(const char *url, const char *data, int len)
+{
+	char *content;
+	if (!ht_cacheable || (!ht_modtime && !ht_etag))
+		return;
+/* remember the content type, a 304 response needn't send it again */
+	content = contentString();
+	storeCache(url, ht_etag, ht_modtime,
+		   (ht_maxage > 0 ? time(0) + ht_maxage : 0),
+		   content, data, len);
+	nzFree(content);
+}				/* storeFetched */
+
+/* the inverse of parseHeaderDate, for If-Modified-Since */
+static void httpDate(time_t t, char *buf)
+{
+	static const char *const days[7] = {
+		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+	};
+	static const char *const months[12] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	struct tm *tm = gmtime(&t);
+	sprintf(buf, "%s, %02d %s %d %02d:%02d:%02d GMT",
+		days[tm->tm_wday], tm->tm_mday, months[tm->tm_mon],
+		tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec);
+}				/* httpDate */
+
+/*********************************************************************
+If the url is in cache, ask for it only if it has changed.
+Send the cached etag and mod time along, as If-None-Match
+and If-Modified-Since, and a 304 response says our copy is still good.
+That is one round trip, where a HEAD and then a GET was two.
+We build these headers ourselves rather than using CURLOPT_TIMECONDITION,
+since curl treats an unmet time condition as an empty 200 response.
+If max-age says the cached copy is still fresh, don't ask at all;
+take it from cache, put it in serverData, and return true.
+The conditional headers are the custom headers plus these two,
+and the list lives until the next fetch or until httpConnect is done.
+*********************************************************************/
+
+static THREADLOCAL char *cache_etag;
+static THREADLOCAL time_t cache_modtime;
+static THREADLOCAL bool cache_validating;
+static THREADLOCAL struct curl_slist *cond_headers;
+
+static void dropCondition(void)
+{
+	if (cond_headers)
+		curl_slist_free_all(cond_headers);
+	cond_headers = NULL;
+	nzFree(cache_etag);
+	cache_etag = NULL;
+	cache_modtime = 0;
+	cache_validating = false;
+}				/* dropCondition */
+
+/* back to a plain GET */
+static void unconditionalGet(CURL * h, struct curl_slist *base)
+{
+	if (cond_headers)
+		curl_easy_setopt(h, CURLOPT_HTTPHEADER, base);
+	dropCondition();
+}				/* unconditionalGet */
+
+static struct curl_slist *appendHeader(struct curl_slist *l,
+				       const char *line)
+{
+	l = curl_slist_append(l, line);
+	if (!l)
+		i_printfExit(MSG_NoMem);
+	return l;
+}				/* appendHeader */
+
+/* If-None-Match and If-Modified-Since, from what the cache knows */
+static struct curl_slist *appendValidators(struct curl_slist *l,
+					   const char *etag, time_t modtime)
+{
+	char *line;
+	char date[60];
+
+	if (etag && etag[0]) {
+		line = allocMem(strlen(etag) + 20);
+/* weak etags keep their W/ outside the quotes */
+		if (!strncmp(etag, "W/", 2))
+			sprintf(line, "If-None-Match: %s", etag);
+		else
+			sprintf(line, "If-None-Match: \"%s\"", etag);
+		debugPrint(3, "%s", line);
+		l = appendHeader(l, line);
+		nzFree(line);
+	}
+	if (modtime) {
+		strcpy(date, "If-Modified-Since: ");
+		httpDate(modtime, date + strlen(date));
+		debugPrint(3, "%s", date);
+		l = appendHeader(l, date);
+	}
+	return l;
+}				/* appendValidators */
+
+static bool conditionalGet(CURL * h, const char *url,
+			   struct curl_slist *base)
+{
+	bool fresh;
+	char *data, *content;
+	int data_len;
+	struct curl_slist *p;
+
+	unconditionalGet(h, base);
+	if (!lookupCache(url, &cache_etag, &cache_modtime, &fresh))
+		return false;
+
+	if (fresh &&
+	    fetchCache(url, cache_etag, cache_modtime, 0, &data, &data_len,
+		       &content)) {
+		debugPrint(3, "fresh in cache");
+		dropCondition();
+		clearHeaders();
+		if (content)
+			setContentType(content);
+		nzFree(content);
+		nzFree(serverData);
+		serverData = data;
+		serverDataLen = data_len;
+		return true;
+	}
+
+	for (p = base; p; p = p->next)
+		cond_headers = appendHeader(cond_headers, p->data);
+	cond_headers =
+	    appendValidators(cond_headers, cache_etag, cache_modtime);
+	if (cond_headers)
+		curl_easy_setopt(h, CURLOPT_HTTPHEADER, cond_headers);
+	cache_validating = true;
+	return false;
+}				/* conditionalGet */
+
 bool parseRefresh(char *ref, int *delay_p)
 {
 	int delay = 0;
@@ -783,8 +1006,8 @@ bool shortRefreshDelay(void)
 	return false;
 }				/* shortRefreshDelay */
 
-static char *urlcopy;
-static int urlcopy_l;
+static THREADLOCAL char *urlcopy;
+static THREADLOCAL int urlcopy_l;
 
 // encode the url, if it was supplied by the user.
 // Otherwise just make a copy.
@@ -820,6 +1043,23 @@ static void urlSanitize(const char *url, const char *post, bool f_encoded)
 	}
 }				/* urlSanitize */
 
+/* The referrer is the current page, without post data or .browse */
+static char *setReferrer(void)
+{
+	const char *post2;
+	if (!sendReferrer || !currentReferrer)
+		return NULL;
+	post2 = strchr(currentReferrer, '\1');
+	if (!post2)
+		post2 = currentReferrer + strlen(currentReferrer);
+	if (post2 - currentReferrer >= 7 && !memcmp(post2 - 7, ".browse", 7))
+		post2 -= 7;
+	nzFree(cw->referrer);
+	cw->referrer = cloneString(currentReferrer);
+	cw->referrer[post2 - currentReferrer] = 0;
+	return cw->referrer;
+}				/* setReferrer */
+
 // Last three are result parameters, for http headers and body strings.
 // Set to 0 if you don't want these passed back in this way.
 bool httpConnect(const char *url, bool down_ok, bool webpage,
@@ -849,7 +1089,7 @@ bool httpConnect(const char *url, bool down_ok, bool webpage,
 	int redirect_count = 0;
 	bool name_changed = false;
 	bool post_request = false;
-	bool head_request = false;
+	char *cacheContent;
 
 	if (headers_p)
 		*headers_p = 0;
@@ -935,6 +1175,12 @@ mimestream:
 		goto mimestream;
 	}
 
+/* a frame that was fetched ahead of time, see frameExpand() */
+	if (!headers_p && !body_p && takePrefetch(url)) {
+		transfer_status = true;
+		goto prefetched;
+	}
+
 	cbd.buffer = &serverData;
 	cbd.length = &serverDataLen;
 	cbd.down_state = 0;
@@ -1008,19 +1254,7 @@ mimestream:
 			goto curl_fail;
 	}
 
-	if (sendReferrer && currentReferrer) {
-		const char *post2 = strchr(currentReferrer, '\1');
-		if (!post2)
-			post2 = currentReferrer + strlen(currentReferrer);
-		if (post2 - currentReferrer >= 7
-		    && !memcmp(post2 - 7, ".browse", 7))
-			post2 -= 7;
-		nzFree(cw->referrer);
-		cw->referrer = cloneString(currentReferrer);
-		cw->referrer[post2 - currentReferrer] = 0;
-		referrer = cw->referrer;
-	}
-
+	referrer = setReferrer();
 	curlret = curl_easy_setopt(h, CURLOPT_REFERER, referrer);
 	if (curlret != CURLE_OK)
 		goto curl_fail;
@@ -1065,10 +1299,12 @@ mimestream:
 
 	still_fetching = true;
 	serverData = initString(&serverDataLen);
+	down_post = post_request;
 
-	if (!post_request && presentInCache(urlcopy)) {
-		head_request = true;
-		curl_easy_setopt(h, CURLOPT_NOBODY, 1l);
+	if (!post_request && conditionalGet(h, urlcopy, custom_headers)) {
+		ht_code = 200;
+		still_fetching = false;
+		transfer_status = true;
 	}
 
 	while (still_fetching == true) {
@@ -1083,61 +1319,42 @@ mimestream:
 		if (redirect_count &&
 		    (cf->mt = findMimeByURL(urlcopy)) && pluginsOn
 		    && cf->mt->stream) {
-			curl_easy_cleanup(h);
+			http_curl_release(h);
 			goto mimestream;
 		}
 
-perform:
 		is_http = true;
 		ht_cacheable = true;
 		curlret = fetch_internet(h);
 
 		if (cbd.down_state == 6) {
-			curl_easy_cleanup(h);
+			http_curl_release(h);
 			goto mimestream;
 		}
 
-/*********************************************************************
-If the desired file is in cache for some reason, and we issued the head request,
-and it is application, or some such that triggers a download, then state = 1,
-but no data is forthcoming, and the user was never asked if he wants
-to download, so state is still 1.
-So ask, and then look at state.
-If state is nonzero, sorry, I'm not taking the file from cache,
-not yet, just because it's a whole bunch of new code.
-We don't generally store our downloaded files in cache anyways,
-they go where they go, so this doesn't come up very often.
-*********************************************************************/
-
-		if (head_request) {
-			if (cbd.down_state == 1) {
-				setup_download(&cbd);
-/* now we have our answer */
-			}
-
-			if (cbd.down_state != 0) {
-				curl_easy_setopt(h, CURLOPT_NOBODY, 0l);
-				head_request = false;
-				debugPrint(3, "switch to get for download %d",
-					   cbd.down_state);
-			}
-
-			if (cbd.down_state == 2) {
-				curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE,
-						  &ht_code);
-				if (ht_code == 200)
-					goto perform;
-			}
-		}
-
 		if (cbd.down_state == 5) {
 /* user has directed a download of this file in the background. */
-			background_download(&cbd);
-			if (cbd.down_state == 4)
-				goto perform;
+/* The download thread starts it over, with the same handle,
+ * the same headers, and its own copy of the post data. */
+			unconditionalGet(h, custom_headers);
+			if (post_request) {
+				curl_easy_setopt(h, CURLOPT_POSTFIELDSIZE,
+						 (postb_l ? postb_l :
+						  strlen(post)));
+				curl_easy_setopt(h, CURLOPT_COPYPOSTFIELDS,
+						 (postb_l ? postb : post));
+			}
+			background_download(&cbd, h, custom_headers);
+			if (cbd.down_state == 3) {
+/* the handle and headers belong to the download now */
+				serverData = NULL;
+				cnzFree(cbd.down_file);
+				nzFree(postb);
+				return false;
+			}
 		}
 
-		if (cbd.down_state == 3 || cbd.down_state == -1) {
+		if (cbd.down_state == -1) {
 /* set this to null so we don't push a new buffer */
 			serverData = NULL;
 			cnzFree(cbd.down_file);
@@ -1145,17 +1362,6 @@ they go where they go, so this doesn't come up very often.
 			return false;
 		}
 
-		if (cbd.down_state == 4) {
-			if (curlret != CURLE_OK) {
-				ebcurl_setError(curlret, urlcopy);
-				showError();
-				exit(2);
-			}
-			i_printf(MSG_DownSuccess);
-			printf(": %s\n", cbd.down_file2);
-			exit(0);
-		}
-
 		if (*(cbd.length) >= CHUNKSIZE && showProgress == 'd')
 			nl();	/* We printed dots, so terminate them with newline */
 
@@ -1164,7 +1370,7 @@ they go where they go, so this doesn't come up very often.
 			cnzFree(cbd.down_file);
 			setError(MSG_DownSuccess);
 			serverData = NULL;
-			curl_easy_cleanup(h);
+			http_curl_release(h);
 			return false;
 		}
 
@@ -1228,11 +1434,6 @@ they go where they go, so this doesn't come up very often.
 				if (curlret != CURLE_OK)
 					goto curl_fail;
 
-				if (!post_request && presentInCache(urlcopy)) {
-					head_request = true;
-					curl_easy_setopt(h, CURLOPT_NOBODY, 1l);
-				}
-
 				nzFree(serverData);
 				serverData = emptyString;
 				serverDataLen = 0;
@@ -1240,6 +1441,15 @@ they go where they go, so this doesn't come up very often.
 				still_fetching = true;
 				name_changed = true;
 				debugPrint(2, "redirect %s", urlcopy);
+
+				if (post_request)
+					unconditionalGet(h, custom_headers);
+				else if (conditionalGet(h, urlcopy,
+							custom_headers)) {
+					ht_code = 200;
+					still_fetching = false;
+					transfer_status = true;
+				}
 			}
 		}
 
@@ -1259,28 +1469,33 @@ they go where they go, so this doesn't come up very often.
 				proceed_unauthenticated = true;
 			}
 		} else {	/* not redirect, not 401 */
-			if (head_request) {
+			if (ht_code == 304 && cache_validating) {
+/* not modified, our copy is good */
 				if (fetchCache
-				    (urlcopy, ht_etag, ht_modtime, &cacheData,
-				     &cacheDataLen)) {
+				    (urlcopy, cache_etag, cache_modtime,
+				     (ht_maxage > 0 ? time(0) + ht_maxage : 0),
+				     &cacheData, &cacheDataLen, &cacheContent)) {
 					nzFree(serverData);
 					serverData = cacheData;
 					serverDataLen = cacheDataLen;
+					if (cacheContent && !ht_content[0])
+						setContentType(cacheContent);
+					nzFree(cacheContent);
+					ht_code = 200;
 					still_fetching = false;
 					transfer_status = true;
 				} else {
-/* Back through the loop,
- * now doing GET rather than HEAD. */
-					curl_easy_setopt(h, CURLOPT_NOBODY, 0l);
-					head_request = false;
-					--redirect_count;
+/* It fell out of cache in the meantime.
+ * Back through the loop, without the conditions. */
+					unconditionalGet(h, custom_headers);
+					nzFree(serverData);
+					serverData = emptyString;
+					serverDataLen = 0;
 				}
 			} else {
-				if (ht_code == 200 && ht_cacheable &&
-				    (ht_modtime || ht_etag) &&
-				    cbd.down_state == 0)
-					storeCache(urlcopy, ht_etag, ht_modtime,
-						   serverData, serverDataLen);
+				if (ht_code == 200 && cbd.down_state == 0)
+					storeFetched(urlcopy, serverData,
+						     serverDataLen);
 				still_fetching = false;
 				transfer_status = true;
 			}
@@ -1288,10 +1503,11 @@ they go where they go, so this doesn't come up very often.
 	}
 
 curl_fail:
+	dropCondition();
 	if (custom_headers)
 		curl_slist_free_all(custom_headers);
 // Don't need the handle any more.
-	curl_easy_cleanup(h);
+	http_curl_release(h);
 
 	if (curlret != CURLE_OK)
 		ebcurl_setError(curlret, urlcopy);
@@ -1325,6 +1541,7 @@ curl_fail:
 		ht_cdfn = NULL;
 	}
 
+prefetched:
 /* Check for plugin to run here */
 	if (transfer_status && ht_code == 200 && cf->mt && pluginsOn &&
 	    !cf->mt->stream && !cf->mt->outtype && cf->mt->program) {
@@ -1626,19 +1843,23 @@ static bool ftpConnect(const char *url, const char *user, const char *pass,
 	down_msg = MSG_FTPDownload;
 	if (is_scp)
 		down_msg = MSG_SCPDownload;
+	down_post = false;
 	cbd.length = &serverDataLen;
 
-perform:
 	curlret = fetch_internet(h);
 
 	if (cbd.down_state == 5) {
 /* user has directed a download of this file in the background. */
-		background_download(&cbd);
-		if (cbd.down_state == 4)
-			goto perform;
+		background_download(&cbd, h, NULL);
+		if (cbd.down_state == 3) {
+/* the handle belongs to the download now */
+			serverData = NULL;
+			cnzFree(cbd.down_file);
+			return false;
+		}
 	}
 
-	if (cbd.down_state == 3 || cbd.down_state == -1) {
+	if (cbd.down_state == -1) {
 /* set this to null so we don't push a new buffer */
 		serverData = NULL;
 		cnzFree(cbd.down_file);
@@ -1646,17 +1867,6 @@ perform:
 		return false;
 	}
 
-	if (cbd.down_state == 4) {
-		if (curlret != CURLE_OK) {
-			ebcurl_setError(curlret, urlcopy);
-			showError();
-			exit(2);
-		}
-		i_printf(MSG_DownSuccess);
-		printf(": %s\n", cbd.down_file2);
-		exit(0);
-	}
-
 	if (*(cbd.length) >= CHUNKSIZE && showProgress == 'd')
 		nl();		/* We printed dots, so terminate them with newline */
 
@@ -1665,7 +1875,7 @@ perform:
 		setError(MSG_DownSuccess);
 		serverData = NULL;
 		cnzFree(cbd.down_file);
-		curl_easy_cleanup(h);
+		http_curl_release(h);
 		return false;
 	}
 
@@ -1702,7 +1912,7 @@ perform:
 ftp_transfer_fail:
 // Don't need the handle any more
 	if (h)
-		curl_easy_cleanup(h);
+		http_curl_release(h);
 	if (transfer_success == false) {
 		if (curlret != CURLE_OK)
 			ebcurl_setError(curlret, urlcopy);
@@ -1755,10 +1965,65 @@ my_curl_safeSocket(void *clientp, curl_socket_t socketfd, curlsocktype purpose)
 #endif // _MSC_VER y/n
 }
 
+/*********************************************************************
+Curl keeps the connections it has made in the easy handle,
+so a handle that is thrown away takes its open connections with it,
+and the next fetch from the same host starts over with tcp and tls.
+Instead, keep a few finished handles in a pool, and hand the most recent one
+out again, reset, for the next fetch, which finds its connection still open.
+Newer versions of curl can also share the connection cache
+through the share handle, see eb_curl_global_init().
+A handle that has gone to a background download is not put back,
+the download thread owns it and cleans it up.
+*********************************************************************/
+
+#define CURLPOOLSIZE 4
+static CURL *curlPool[CURLPOOLSIZE];
+static int curlPoolCount;
+/* transfers that opened a new connection, or reused an old one */
+static long connectsNew, connectsReused;
+
+static void http_curl_release(CURL * h)
+{
+	if (curlPoolCount == CURLPOOLSIZE) {
+		curl_easy_cleanup(curlPool[0]);
+		memmove(curlPool, curlPool + 1,
+			(CURLPOOLSIZE - 1) * sizeof(CURL *));
+		--curlPoolCount;
+	}
+	curlPool[curlPoolCount++] = h;
+}				/* http_curl_release */
+
+void http_curl_cleanup_pool(void)
+{
+	while (curlPoolCount)
+		curl_easy_cleanup(curlPool[--curlPoolCount]);
+}				/* http_curl_cleanup_pool */
+
+/* Was the connection new or reused? Called after each transfer. */
+static void connectStats(CURL * h)
+{
+	long n = 0;
+	if (curl_easy_getinfo(h, CURLINFO_NUM_CONNECTS, &n) != CURLE_OK)
+		return;
+	if (n)
+		connectsNew += n;
+	else
+		++connectsReused;
+	debugPrint(3, "%s connection, %ld new %ld reused",
+		   (n ? "new" : "reused"), connectsNew, connectsReused);
+}				/* connectStats */
+
 static CURL *http_curl_init(struct eb_curl_callback_data *cbd)
 {
 	CURLcode curl_init_status = CURLE_OK;
-	CURL *h = curl_easy_init();
+	CURL *h;
+	if (curlPoolCount) {
+		h = curlPool[--curlPoolCount];
+/* reset the options, the connections stay */
+		curl_easy_reset(h);
+	} else
+		h = curl_easy_init();
 	if (h == NULL)
 		goto libcurl_init_fail;
 	curl_init_status =
@@ -1817,6 +2082,345 @@ libcurl_init_fail:
 	return 0;
 }				/* http_curl_init */
 
+/*********************************************************************
+Fetch a list of urls all at once, through curl multi.
+A page with 30 scripts shouldn't wait on 30 round trips, one after another.
+The caller still runs the scripts in order, taking each body from the list.
+At most MAXHOSTFETCH fetches go to any one host at a time, as browsers do.
+This is only for the simple case, an http or https get.
+Anything else, a url that is fresh in cache, a 401 asking for a password,
+or a fetch that failed outright, comes back with code 0,
+and the caller goes through httpConnect() as before.
+Any other code, 404 say, is kept, without the data, for the caller to report.
+Files in cache are revalidated, and a 304 response reads the file from cache.
+The headers of each response are scanned, one at a time, after it is done,
+the same way httpConnect() scans them, so caching works as it always has.
+*********************************************************************/
+
+#define MAXHOSTFETCH 6
+
+static size_t prefetchData(char *s, size_t size, size_t nitems,
+			   struct PREFETCH *p)
+{
+	size_t n = size * nitems;
+	stringAndBytes(&p->data, &p->length, s, n);
+	return n;
+}				/* prefetchData */
+
+static size_t prefetchHeader(char *s, size_t size, size_t nitems,
+			     struct PREFETCH *p)
+{
+	size_t n = size * nitems;
+/* a redirect starts a new set of headers */
+	if (n >= 5 && !memcmp(s, "HTTP/", 5)) {
+		nzFree(p->hdata);
+		p->hdata = initString(&p->hlength);
+	}
+	stringAndBytes(&p->hdata, &p->hlength, s, n);
+	return n;
+}				/* prefetchHeader */
+
+static bool prefetchStart(CURLM * m, struct PREFETCH *p, const char *referrer)
+{
+	char creds[MAXUSERPASS * 2 + 1];
+	CURL *h = http_curl_init(NULL);
+	if (!h)
+		return false;
+
+	p->data = initString(&p->length);
+	p->hdata = initString(&p->hlength);
+	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, prefetchData);
+	curl_easy_setopt(h, CURLOPT_WRITEDATA, p);
+	curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, prefetchHeader);
+	curl_easy_setopt(h, CURLOPT_HEADERDATA, p);
+	curl_easy_setopt(h, CURLOPT_NOPROGRESS, 1L);
+/* ht_error is for one fetch at a time */
+	curl_easy_setopt(h, CURLOPT_ERRORBUFFER, NULL);
+	curl_easy_setopt(h, CURLOPT_PRIVATE, p);
+	curl_easy_setopt(h, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(h, CURLOPT_FOLLOWLOCATION, (long)allowRedirection);
+	curl_easy_setopt(h, CURLOPT_MAXREDIRS, 10L);
+	curl_easy_setopt(h, CURLOPT_REFERER, referrer);
+
+	p->headers = appendHeader(NULL, "Expect:");
+	if (httpLanguage)
+		p->headers = appendHeader(p->headers, httpLanguage);
+	p->headers = appendValidators(p->headers, p->etag, p->modtime);
+	curl_easy_setopt(h, CURLOPT_HTTPHEADER, p->headers);
+
+	creds[0] = 0;
+	getUserPass(p->u, creds, false);
+	curl_easy_setopt(h, CURLOPT_USERPWD, creds);
+
+	if (setCurlURL(h, p->u) != CURLE_OK ||
+	    curl_multi_add_handle(m, h) != CURLM_OK) {
+		curl_easy_cleanup(h);
+		return false;
+	}
+	p->h = h;
+	p->state = 1;
+	debugPrint(3, "prefetch %s", p->u);
+	return true;
+}				/* prefetchStart */
+
+/* start whatever we can, without going over the limit for any host */
+static int prefetchMore(CURLM * m, struct PREFETCH *list, int n,
+			const char *referrer)
+{
+	struct PREFETCH *p;
+	int i, j, k, started = 0;
+
+	for (i = 0; i < n; ++i) {
+		p = list + i;
+		if (p->state != 0)
+			continue;
+		for (j = k = 0; j < n; ++j)
+			if (list[j].state == 1 &&
+			    stringEqualCI(list[j].host, p->host))
+				++k;
+		if (k >= MAXHOSTFETCH)
+			continue;
+		if (prefetchStart(m, p, referrer))
+			++started;
+		else
+			p->state = 2;
+	}
+	return started;
+}				/* prefetchMore */
+
+static void prefetchDone(CURLM * m, struct PREFETCH *p, CURLcode rc)
+{
+	char *save_headers = http_headers;
+	int save_headers_len = http_headers_len;
+	const struct MIMETYPE *save_mt = cf->mt;
+	char *data, *content;
+	char *final = NULL;
+	int len;
+
+	curl_multi_remove_handle(m, p->h);
+	p->state = 2;
+	if (rc == CURLE_OK) {
+		curl_easy_getinfo(p->h, CURLINFO_RESPONSE_CODE, &p->code);
+		if (curl_easy_getinfo(p->h, CURLINFO_EFFECTIVE_URL, &final) ==
+		    CURLE_OK)
+			final = cloneString(final);
+		connectStats(p->h);
+	} else
+		debugPrint(3, "prefetch %s failed, %s", p->u,
+			   curl_easy_strerror(rc));
+	http_curl_release(p->h);
+	p->h = NULL;
+	curl_slist_free_all(p->headers);
+	p->headers = NULL;
+
+/* look at the headers the way httpConnect does */
+	http_headers = NULL;
+	clearHeaders();
+	nzFree(http_headers);
+	http_headers = p->hdata;
+	http_headers_len = p->hlength;
+	p->hdata = NULL;
+	ht_cacheable = true;
+	scan_http_headers(true);
+
+	if (p->code == 304) {
+		if (fetchCache(p->u, p->etag, p->modtime,
+			       (ht_maxage > 0 ? time(0) + ht_maxage : 0),
+			       &data, &len, &content)) {
+			nzFree(p->data);
+			p->data = data;
+			p->length = len;
+/* the type in the 304 response, if any, wins, as in httpConnect */
+			if (ht_content[0]) {
+				nzFree(content);
+				content = contentString();
+			}
+			p->content = content;
+			p->code = 200;
+		} else
+			p->code = 0;
+	} else if (p->code == 200) {
+		if (ht_content[0])
+			p->content = contentString();
+		storeFetched((final ? final : p->u), p->data, p->length);
+		if (final && !stringEqual(final, p->u)) {
+			p->location = final;
+			final = NULL;
+		}
+	} else if (p->code == 401) {
+/* httpConnect asks for the password */
+		p->code = 0;
+	}
+/* Any other code, 404 or 500 say, is the answer, and the caller reports it;
+ * fetching again through httpConnect would only get the same thing. */
+	if (p->code != 200) {
+		nzFree(p->data);
+		p->data = NULL;
+		p->length = 0;
+		nzFree(p->content);
+		p->content = NULL;
+	}
+	debugPrint(3, "prefetch %s code %ld", p->u, p->code);
+
+	nzFree(final);
+	clearHeaders();
+	nzFree(http_headers);
+	http_headers = save_headers;
+	http_headers_len = save_headers_len;
+	cf->mt = save_mt;
+}				/* prefetchDone */
+
+void prefetchURLs(struct PREFETCH *list, int n)
+{
+	struct PREFETCH *p;
+	CURLM *m;
+	CURLMsg *msg;
+	CURL *e;
+	CURLcode rc;
+	const char *prot, *host;
+	const char *referrer;
+	bool fresh;
+	int i, waiting = 0, running, still;
+
+	for (i = 0, p = list; i < n; ++i, ++p) {
+		p->u = p->data = p->hdata = p->host = p->etag = NULL;
+		p->location = p->content = NULL;
+		p->length = p->hlength = 0;
+		p->code = 0;
+		p->h = NULL;
+		p->headers = NULL;
+		p->modtime = 0;
+		p->state = 2;
+		prot = getProtURL(p->url);
+		if (!prot || !(stringEqualCI(prot, "http") ||
+			       stringEqualCI(prot, "https")))
+			continue;
+		if (strchr(p->url, '\1'))
+			continue;
+		urlSanitize(p->url, NULL, true);
+		p->u = urlcopy;
+		urlcopy = NULL;
+		host = getHostURL(p->u);
+		if (!host)
+			continue;
+		if (lookupCache(p->u, &p->etag, &p->modtime, &fresh) && fresh)
+/* httpConnect reads it from cache, without asking */
+			continue;
+		p->host = cloneString(host);
+		p->state = 0;
+		++waiting;
+	}
+
+/* One fetch gains nothing, leave it to httpConnect */
+	if (waiting < 2) {
+		for (i = 0; i < n; ++i)
+			list[i].state = 2;
+		return;
+	}
+
+	m = curl_multi_init();
+	if (!m)
+		return;
+	debugPrint(3, "prefetch %d files", waiting);
+	referrer = setReferrer();
+
+	running = prefetchMore(m, list, n, referrer);
+	while (running) {
+		curl_multi_perform(m, &still);
+		while ((msg = curl_multi_info_read(m, &still))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+/* msg goes away when the handle is removed */
+			e = msg->easy_handle;
+			rc = msg->data.result;
+			curl_easy_getinfo(e, CURLINFO_PRIVATE, (char **)&p);
+			prefetchDone(m, p, rc);
+			--running;
+		}
+		if (intFlag)
+			break;
+		running += prefetchMore(m, list, n, referrer);
+		if (running)
+			curl_multi_wait(m, NULL, 0, 1000, NULL);
+	}
+
+/* interrupted, drop whatever is still going */
+	for (i = 0, p = list; i < n; ++i, ++p) {
+		if (p->h) {
+			curl_multi_remove_handle(m, p->h);
+			curl_easy_cleanup(p->h);
+			p->h = NULL;
+		}
+		if (p->headers)
+			curl_slist_free_all(p->headers);
+		p->headers = NULL;
+		if (p->state == 1) {
+			nzFree(p->data);
+			p->data = NULL;
+			p->length = 0;
+		}
+		p->state = 2;
+	}
+	curl_multi_cleanup(m);
+}				/* prefetchURLs */
+
+/*********************************************************************
+Bodies fetched ahead of time, by prefetchURLs(), that httpConnect
+hands out instead of going to the network, see frameExpand().
+The content type goes with the body, and httpConnect takes it up,
+setting cf->mt and running a plugin if need be,
+so the fetched page goes through readFile() and everything else
+just as if it had come from the network.
+*********************************************************************/
+
+static THREADLOCAL struct PREFETCH *aheadList;
+static THREADLOCAL int aheadCount;
+
+void prefetchAhead(struct PREFETCH *list, int n)
+{
+	aheadList = list;
+	aheadCount = n;
+}				/* prefetchAhead */
+
+static bool takePrefetch(const char *url)
+{
+	struct PREFETCH *p;
+	int i;
+	for (i = 0, p = aheadList; i < aheadCount; ++i, ++p) {
+		if (p->code != 200 || !p->data || !stringEqual(p->url, url))
+			continue;
+		debugPrint(3, "prefetched %s", url);
+		serverData = p->data;
+		serverDataLen = p->length;
+		p->data = NULL;
+		ht_code = 200;
+		clearHeaders();
+		if (p->content)
+			setContentType(p->content);
+		if (p->location) {
+			changeFileName = p->location;
+			p->location = NULL;
+		}
+		return true;
+	}
+	return false;
+}				/* takePrefetch */
+
+void freePrefetch(struct PREFETCH *list, int n)
+{
+	struct PREFETCH *p;
+	int i;
+	for (i = 0, p = list; i < n; ++i, ++p) {
+		nzFree(p->u);
+		nzFree(p->location);
+		nzFree(p->content);
+		nzFree(p->data);
+		nzFree(p->hdata);
+		nzFree(p->host);
+		nzFree(p->etag);
+	}
+}				/* freePrefetch */
+
 /*
  * There's no easy way to get at the server's response message from libcurl.
  * So here are some tables and a function for translating response codes to
@@ -2105,8 +2709,7 @@ top:
 		goto top;
 	}
 
-	data->down_fd = creat(answer, 0666);
-	if (data->down_fd < 0) {
+	if (!planDownload(data, answer)) {
 		i_printf(MSG_NoCreate2, answer);
 		nl();
 		goto top;
@@ -2121,13 +2724,21 @@ top:
 				++data->down_file2;
 		}
 	}
-	data->down_state = (down_bg ? 5 : 2);
+	data->down_state = (down_bg || down_job ? 5 : 2);
 	data->length = &data->down_length;
 }				/* setup_download */
 
-#ifdef _MSC_VER			// need fork()
+#ifdef _MSC_VER			// need pthreads
+static bool planDownload(struct eb_curl_callback_data *data,
+			 const char *file)
+{
+	data->down_fd = creat(file, 0666);
+	return (data->down_fd >= 0);
+}				/* planDownload */
+
 /* At this point, down_state = 5 */
-static void background_download(struct eb_curl_callback_data *data)
+static void background_download(struct eb_curl_callback_data *data,
+				CURL * h, struct curl_slist *headers)
 {
 	data->down_state = -1;
 /* perhaps a better error message here */
@@ -2140,45 +2751,561 @@ int bg_jobs(bool iponly)
 	return 0;
 }
 
+bool bgKill(int id)
+{
+	return false;
+}
+
+void waitDownloads(void)
+{
+}
+
 #else // !_MSC_VER
 
-/* At this point, down_state = 5 */
-static void background_download(struct eb_curl_callback_data *data)
+/*********************************************************************
+Downloads to disk run in this process, on one thread that drives
+a curl multi handle, rather than in a forked child per file.
+The foreground hands over its easy handle, still aimed at the url,
+and the thread runs up to downMax of these transfers at a time,
+each limited to downRate kilobytes per second if that is set.
+A foreground download that can be resumed runs the same way,
+while the user waits for it; any other is written to disk
+as it arrives on the first request, down_state 2.
+down_jobs is shared with that thread; walk it under down_mutex.
+
+If the server takes byte ranges, a large file can be fetched
+in several ranges at once, downSegments of them, each written in place.
+A file that can be fetched by ranges keeps a resume file beside it,
+file.resume, holding the url, its validators and size,
+and how far each range has come.
+If the connection drops, the thread asks for the rest of the range,
+and if the download fails or is stopped, or edbrowse exits,
+downloading the same url to the same file picks up where it left off.
+*********************************************************************/
+
+static pthread_mutex_t down_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t down_cond = PTHREAD_COND_INITIALIZER;
+static bool down_thread;	/* the download thread is running */
+static int down_id;		/* number of the last job */
+
+static char *resumeName(const char *file)
 {
-	down_pid = fork();
-	if (down_pid < 0) {	/* should never happen */
-		data->down_state = -1;
-/* perhaps a better error message here */
-		setError(MSG_DownAbort);
+	char *name = allocMem(strlen(file) + 8);
+	sprintf(name, "%s.resume", file);
+	return name;
+}				/* resumeName */
+
+static void saveResume(const struct BG_JOB *j)
+{
+	char *name;
+	FILE *f;
+	int i;
+
+	if (!j->resumable)
 		return;
+	name = resumeName(j->file);
+	f = fopen(name, "w");
+	if (f) {
+		fprintf(f, "edbrowse resume 1\n%s\n%s\n%lld\n%lld\n",
+			j->url, (j->etag ? j->etag : ""),
+			(long long)j->modtime, (long long)j->fsize);
+		for (i = 0; i < j->nseg; ++i) {
+			const struct DOWNSEG *s = j->seg + i;
+			fprintf(f, "%lld %lld %lld\n", (long long)s->start,
+				(long long)s->end, (long long)s->pos);
+		}
+		fclose(f);
 	}
+	nzFree(name);
+}				/* saveResume */
 
-	if (down_pid) {		/* parent */
-		struct BG_JOB *job;
-		close(data->down_fd);
-/* the error message here isn't really an error, but a progress message */
-		setError(MSG_DownProgress);
-		data->down_state = 3;
-
-/* push job onto the list for tracking and display */
-		job = allocMem(sizeof(struct BG_JOB) + strlen(data->down_file));
-		job->pid = down_pid;
-		job->state = 4;
-		strcpy(job->file, data->down_file);
-		job->file2 = data->down_file2 - data->down_file;
-// round file size up to the nearest chunk.
-// This will come out 0 only if the true size is 0.
-		job->fsize = ((ht_length + (CHUNKSIZE - 1)) / CHUNKSIZE);
-		addToListBack(&down_jobs, job);
+static void dropResume(const struct BG_JOB *j)
+{
+	char *name = resumeName(j->file);
+	unlink(name);
+	nzFree(name);
+}				/* dropResume */
+
+/* Take up the ranges in the resume file, if it describes
+ * the same resource, unchanged since. */
+static bool loadResume(struct BG_JOB *j)
+{
+	char *name, *data, *t;
+	char *line[5];
+	int len, i, n;
+	long long a, b, c;
+	bool ok = false;
+
+	if (fileTypeByName(j->file, false) != 'f')
+		return false;
+	name = resumeName(j->file);
+	if (fileTypeByName(name, false) != 'f' ||
+	    !fileIntoMemory(name, &data, &len)) {
+		nzFree(name);
+		return false;
+	}
+
+	t = data;
+	for (i = 0; i < 5; ++i) {
+		line[i] = t;
+		t = strchr(t, '\n');
+		if (!t)
+			goto done;
+		*t++ = 0;
+	}
+	if (!stringEqual(line[0], "edbrowse resume 1") ||
+	    !stringEqual(line[1], j->url) ||
+	    !stringEqual(line[2], (j->etag ? j->etag : "")) ||
+	    strtoll(line[3], NULL, 10) != j->modtime ||
+	    strtoll(line[4], NULL, 10) != j->fsize)
+		goto done;
+
+	for (n = 0; n < MAXSEGMENTS && *t; ++n) {
+		struct DOWNSEG *s = j->seg + n;
+		if (sscanf(t, "%lld %lld %lld", &a, &b, &c) != 3 ||
+		    a < 0 || c < a || (b && c > b))
+			goto done;
+		s->start = a, s->end = b, s->pos = c;
+		t = strchr(t, '\n');
+		if (!t)
+			break;
+		++t;
+	}
+	j->nseg = n;
+	ok = (n > 0);
+
+done:
+	nzFree(data);
+	nzFree(name);
+	return ok;
+}				/* loadResume */
+
+/* Cut a fresh download into ranges. */
+static void splitDownload(struct BG_JOB *j)
+{
+	int i, n = 1;
+	off_t piece;
+
+	memset(j->seg, 0, sizeof(j->seg));
+	if (j->resumable && j->fsize >= 2 * MINSEGMENT && downSegments > 1) {
+		n = downSegments;
+		if (n > j->fsize / MINSEGMENT)
+			n = j->fsize / MINSEGMENT;
+	}
+	piece = j->fsize / n;
+	for (i = 0; i < n; ++i) {
+		struct DOWNSEG *s = j->seg + i;
+		s->start = s->pos = piece * i;
+/* Without ranges the length may not be what lands on disk. */
+		if (j->resumable)
+			s->end = (i == n - 1 ? j->fsize : piece * (i + 1));
+	}
+	j->nseg = n;
+}				/* splitDownload */
+
+static off_t jobBytes(const struct BG_JOB *j)
+{
+	off_t got = 0;
+	int i;
+	for (i = 0; i < j->nseg; ++i)
+		got += j->seg[i].pos - j->seg[i].start;
+	return got;
+}				/* jobBytes */
+
+static void freeJob(struct BG_JOB *j)
+{
+	nzFree(j->url);
+	nzFree(j->etag);
+	free(j);
+}				/* freeJob */
+
+/* Open the file and lay out the ranges, resuming if we can.
+ * The job waits in down_job for background_download(). */
+static bool planDownload(struct eb_curl_callback_data *data,
+			 const char *file)
+{
+	struct BG_JOB *j;
+	bool resumed;
+	int fd;
+
+	j = allocZeroMem(sizeof(struct BG_JOB) + strlen(file));
+	strcpy(j->file, file);
+	j->url = cloneString(urlcopy);
+	j->etag = cloneString(ht_etag);
+	j->modtime = ht_modtime;
+	j->fsize = ht_length;
+	j->http = is_http;
+/* The answer to a post can't be asked for again piece by piece.
+ * Of the other protocols, libcurl only honors a range for ftp and sftp;
+ * scp and tftp would send the whole file again. */
+	if (down_post)
+		j->resumable = false;
+	else if (is_http)
+		j->resumable = ht_ranges;
+	else
+		j->resumable = (memEqualCI(urlcopy, "ftp", 3)
+				|| memEqualCI(urlcopy, "sftp:", 5));
+	resumed = (j->resumable && loadResume(j));
+	if (!resumed)
+		splitDownload(j);
+
+	fd = open(file, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0666);
+	if (fd < 0) {
+		freeJob(j);
+		return false;
+	}
+	data->down_fd = fd;
+
+/* In the foreground, a file that can't be resumed is written as it comes in,
+ * down_state 2, rather than asked for again by the download thread.
+ * A post is never sent twice. */
+	if (!down_bg && !j->resumable) {
+		freeJob(j);
+		return true;
+	}
+
+	j->fd = fd;
+	j->fg = !down_bg;
+	if (resumed) {
+		i_printf(MSG_DownResume, (long long)jobBytes(j));
+		nl();
+	}
+	saveResume(j);
+
+	down_job = j;
+	return true;
+}				/* planDownload */
+
+static void setRange(struct DOWNSEG *s)
+{
+	char range[48];
+
+	s->checked = false;
+	s->ranged = (s->pos > 0 || (s->end && s->end < s->job->fsize));
+	if (!s->ranged) {
+		curl_easy_setopt(s->h, CURLOPT_RANGE, NULL);
+		return;
+	}
+	if (s->end)
+		sprintf(range, "%lld-%lld", (long long)s->pos,
+			(long long)s->end - 1);
+	else
+		sprintf(range, "%lld-", (long long)s->pos);
+	curl_easy_setopt(s->h, CURLOPT_RANGE, range);
+}				/* setRange */
+
+static size_t
+downloadData(char *incoming, size_t size, size_t nitems, struct DOWNSEG *s)
+{
+	struct BG_JOB *j = s->job;
+	size_t num_bytes = size * nitems;
+	size_t n = num_bytes;
+	long code = 0;
+
+	if (j->cancel)
+		return 0;
+/* Same rule as the foreground, only a good response goes to disk,
+ * and a range has to come back as a range. */
+	if (!s->checked && j->http) {
+		curl_easy_getinfo(s->h, CURLINFO_RESPONSE_CODE, &code);
+		if (s->ranged ? code != 206 : code / 100 != 2) {
+			s->refused = true;
+			return 0;
+		}
+	}
+	s->checked = true;
+	if (s->end && s->pos + n > s->end)
+		n = s->end - s->pos;
+	if (pwrite(j->fd, incoming, n, s->pos) != n)
+		return 0;
+	s->pos += n;
+	return num_bytes;
+}				/* downloadData */
+
+static int
+downloadProgress(struct DOWNSEG *s, double dl_total, double dl_now,
+		 double ul_total, double ul_now)
+{
+	return s->job->cancel;
+}				/* downloadProgress */
+
+/* Let go of the resources of a job; down_mutex is held. */
+static void endJob(CURLM * mh, struct BG_JOB *j, CURLcode rc)
+{
+	int i;
+
+	for (i = 0; i < j->nseg; ++i) {
+		struct DOWNSEG *s = j->seg + i;
+		if (s->busy)
+			curl_multi_remove_handle(mh, s->h);
+		s->busy = false;
+		if (s->h)
+			curl_easy_cleanup(s->h);
+		s->h = NULL;
+	}
+	close(j->fd);
+	if (j->headers)
+		curl_slist_free_all(j->headers);
+	j->headers = NULL;
+	j->result = rc;
+	j->state = (rc == CURLE_OK ? 0 : -1);
+	if (j->state == 0)
+		dropResume(j);
+	else
+		saveResume(j);
+
+	if (j->fg || j->cancel)
+		return;
+	i_printf(j->state == 0 ? MSG_DownSuccess : MSG_Failed);
+	printf(": %s\n", j->file + j->file2);
+}				/* endJob */
+
+static void startJob(CURLM * mh, struct BG_JOB *j)
+{
+	curl_off_t rate = 0;
+	int i, n = 0;
+
+	for (i = 0; i < j->nseg; ++i)
+		if (!j->seg[i].done)
+			++n;
+	j->state = 4;
+	if (!n) {
+		endJob(mh, j, CURLE_OK);
+		return;
+	}
+	if (downRate && !j->fg)
+		rate = (curl_off_t) downRate *1024 / n;
+	for (i = 0; i < j->nseg; ++i) {
+		struct DOWNSEG *s = j->seg + i;
+		if (s->done)
+			continue;
+		curl_easy_setopt(s->h, CURLOPT_MAX_RECV_SPEED_LARGE, rate);
+		setRange(s);
+		curl_multi_add_handle(mh, s->h);
+		s->busy = true;
+	}
+}				/* startJob */
+
+/* A range has come to an end, one way or another. */
+static void segmentDone(CURLM * mh, struct DOWNSEG *s, CURLcode rc)
+{
+	struct BG_JOB *j = s->job;
+	int i;
+
+	if (rc == CURLE_OK && (!s->end || s->pos >= s->end)) {
+		s->done = true;
+		for (i = 0; i < j->nseg; ++i)
+			if (!j->seg[i].done)
+				return;
+		endJob(mh, j, CURLE_OK);
+		return;
+	}
 
+	if (rc == CURLE_OK)
+		rc = CURLE_PARTIAL_FILE;
+/* The connection dropped, ask for the rest of the range. */
+	if (!j->cancel && !s->refused && j->resumable && s->tries < 3) {
+		++s->tries;
+		debugPrint(3, "download %s resumes at %lld", j->file,
+			   (long long)s->pos);
+		setRange(s);
+		curl_multi_add_handle(mh, s->h);
+		s->busy = true;
 		return;
 	}
+	endJob(mh, j, rc);
+}				/* segmentDone */
+
+static void *downloadThread(void *arg)
+{
+	CURLM *mh = curl_multi_init();
+	CURLMsg *msg;
+	struct BG_JOB *j;
+	struct DOWNSEG *s;
+	int running, left, active;
+	time_t now, lastsave = 0;
+
+	pthread_mutex_lock(&down_mutex);
+	while (true) {
+/* start whatever is queued, as far as downMax allows;
+ * the user is waiting for a foreground download, so it goes right away. */
+		active = 0;
+		foreach(j, down_jobs) {
+			if (j->state == 4 && !j->fg)
+				++active;
+		}
+		foreach(j, down_jobs) {
+			if (j->state != 5 || (active >= downMax && !j->fg))
+				continue;
+			startJob(mh, j);
+			if (!j->fg)
+				++active;
+		}
+		active = 0;
+		foreach(j, down_jobs) {
+			if (j->state == 4)
+				++active;
+		}
+		if (!active) {
+			pthread_cond_wait(&down_cond, &down_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&down_mutex);
+
+		curl_multi_perform(mh, &running);
+		curl_multi_wait(mh, NULL, 0, 500, NULL);
+
+		pthread_mutex_lock(&down_mutex);
+		while ((msg = curl_multi_info_read(mh, &left))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+					  (char **)&s);
+			curl_multi_remove_handle(mh, msg->easy_handle);
+			s->busy = false;
+			if (s->job->state == 4)
+				segmentDone(mh, s, msg->data.result);
+		}
+
+/* keep the resume files current, in case we don't get to finish */
+		time(&now);
+		if (now - lastsave >= 2) {
+			foreach(j, down_jobs) {
+				if (j->state == 4)
+					saveResume(j);
+			}
+			lastsave = now;
+		}
+	}
+
+	return NULL;
+}				/* downloadThread */
+
+/* The user is waiting on this download; show progress
+ * as the foreground fetch would, and take interrupt as a cancel. */
+static void waitForeground(struct BG_JOB *j)
+{
+	int dots1, dots2, state;
+	bool printed = false;
+
+	dots1 = jobBytes(j) / CHUNKSIZE;
+	do {
+		usleep(100000);
+		if (intFlag) {
+			intFlag = false;
+			j->cancel = true;
+		}
+		pthread_mutex_lock(&down_mutex);
+		state = j->state;
+		dots2 = jobBytes(j) / CHUNKSIZE;
+		pthread_mutex_unlock(&down_mutex);
+		if (showProgress != 'q' && dots1 < dots2) {
+			if (showProgress == 'd') {
+				for (; dots1 < dots2; ++dots1)
+					putchar('.');
+				fflush(stdout);
+				printed = true;
+			}
+			if (showProgress == 'c' && j->fsize)
+				printf("%d/%d\n", dots2,
+				       (int)((j->fsize + CHUNKSIZE -
+					      1) / CHUNKSIZE));
+			dots1 = dots2;
+		}
+	} while (state == 4 || state == 5);
+	if (printed)
+		nl();
+
+	pthread_mutex_lock(&down_mutex);
+	delFromList(j);
+	pthread_mutex_unlock(&down_mutex);
+	if (j->state == 0)
+		setError(MSG_DownSuccess);
+	else if (j->cancel)
+		setError(MSG_DownAbort);
+	else
+		ebcurl_setError(j->result, j->url);
+	freeJob(j);
+}				/* waitForeground */
+
+/* At this point, down_state = 5 */
+static void background_download(struct eb_curl_callback_data *data,
+				CURL * h, struct curl_slist *headers)
+{
+	struct BG_JOB *job = down_job;
+	CURL *first = NULL;
+	pthread_t tid;
+	bool fg;
+	int i;
 
-/* child doesn't need javascript */
-	js_disconnect();
-/* ignore interrupt, not sure about quit and hangup */
-	signal(SIGINT, SIG_IGN);
-	data->down_state = 4;
+	down_job = NULL;
+	job->headers = headers;
+	job->file2 = data->down_file2 - data->down_file;
+
+/* From here on the handle reports to the job, not to the foreground. */
+	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, downloadData);
+	curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(h, CURLOPT_HEADERDATA, NULL);
+	curl_easy_setopt(h, CURLOPT_PROGRESSFUNCTION, downloadProgress);
+	curl_easy_setopt(h, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(h, CURLOPT_VERBOSE, 0L);
+	curl_easy_setopt(h, CURLOPT_ERRORBUFFER, NULL);
+
+/* Each range still to fetch gets a handle, the first one gets ours. */
+	for (i = 0; i < job->nseg; ++i) {
+		struct DOWNSEG *s = job->seg + i;
+		s->job = job;
+		if (s->end && s->pos >= s->end) {
+			s->done = true;
+			continue;
+		}
+		if (h) {
+			s->h = first = h;
+			h = NULL;
+		} else {
+			s->h = curl_easy_duphandle(first);
+			if (!s->h)
+				i_printfExit(MSG_LibcurlNoInit);
+		}
+		curl_easy_setopt(s->h, CURLOPT_WRITEDATA, s);
+		curl_easy_setopt(s->h, CURLOPT_PROGRESSDATA, s);
+		curl_easy_setopt(s->h, CURLOPT_PRIVATE, s);
+	}
+
+	pthread_mutex_lock(&down_mutex);
+	if (!down_thread) {
+		if (pthread_create(&tid, NULL, downloadThread, NULL)) {
+			pthread_mutex_unlock(&down_mutex);
+/* The caller still has its handle, and cleans it up; endJob must not. */
+			for (i = 0; i < job->nseg; ++i)
+				if (first && job->seg[i].h == first)
+					job->seg[i].h = NULL;
+			endJob(NULL, job, CURLE_FAILED_INIT);
+			freeJob(job);
+			data->down_state = -1;
+/* perhaps a better error message here */
+			setError(MSG_DownAbort);
+			return;
+		}
+		pthread_detach(tid);
+		down_thread = true;
+	}
+	if (h)			/* nothing left to fetch */
+		curl_easy_cleanup(h);
+	job->id = ++down_id;
+	job->state = 5;
+	fg = job->fg;
+	addToListBack(&down_jobs, job);
+	pthread_cond_signal(&down_cond);
+	pthread_mutex_unlock(&down_mutex);
+	data->down_state = 3;
+
+	if (fg) {
+		waitForeground(job);
+		return;
+	}
+/* the error message here isn't really an error, but a progress message */
+	setError(MSG_DownProgress);
 }				/* background_download */
 
 /* show background jobs and return the number of jobs pending */
@@ -2188,26 +3315,14 @@ int bg_jobs(bool iponly)
 	bool present = false, part;
 	int numback = 0;
 	struct BG_JOB *j;
-	int pid, status;
 
-/* gather exit status of background jobs */
-	foreach(j, down_jobs) {
-		if (j->state != 4)
-			continue;
-		pid = waitpid(j->pid, &status, WNOHANG);
-		if (!pid)
-			continue;
-		j->state = -1;
-		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
-			j->state = 0;
-	}
+	pthread_mutex_lock(&down_mutex);
 
 /* three passes */
-/* in progress */
+/* in progress, or waiting its turn */
 	part = false;
 	foreach(j, down_jobs) {
-		size_t now_size;
-		if (j->state != 4)
+		if (j->state != 4 && j->state != 5)
 			continue;
 		++numback;
 		if (!part) {
@@ -2215,17 +3330,21 @@ int bg_jobs(bool iponly)
 			puts(" {");
 			part = present = true;
 		}
-		printf("%s", j->file + j->file2);
+		printf("%d: %s", j->id, j->file + j->file2);
+// round file size up to the nearest chunk.
+// This will come out 0 only if the true size is 0.
 		if (j->fsize)
-			printf(" %d/%lu",
-			       (fileSizeByName(j->file) / CHUNKSIZE), j->fsize);
+			printf(" %lld/%lld",
+			       (long long)(jobBytes(j) / CHUNKSIZE),
+			       (long long)((j->fsize + (CHUNKSIZE - 1)) /
+					   CHUNKSIZE));
 		nl();
 	}
 	if (part)
 		puts("}");
 
 	if (iponly)
-		return numback;
+		goto done;
 
 /* complete */
 	part = false;
@@ -2260,9 +3379,63 @@ int bg_jobs(bool iponly)
 	if (!present)
 		i_puts(MSG_Empty);
 
+done:
+	pthread_mutex_unlock(&down_mutex);
 	return numback;
 }				/* bg_jobs */
-#endif // #ifndef _MSC_VER // need fork()
+
+/* Stop download number id, or all of them if id is 0.
+ * Returns false if there was nothing to stop. */
+bool bgKill(int id)
+{
+	bool found = false;
+	struct BG_JOB *j;
+
+	pthread_mutex_lock(&down_mutex);
+	foreach(j, down_jobs) {
+		if (j->state != 4 && j->state != 5)
+			continue;
+		if (id && j->id != id)
+			continue;
+		found = true;
+		j->cancel = true;
+/* A running job stops at its next callback, the thread cleans it up.
+ * One still in the queue is not known to curl, so end it here. */
+		if (j->state == 5)
+			endJob(NULL, j, CURLE_ABORTED_BY_CALLBACK);
+	}
+	pthread_mutex_unlock(&down_mutex);
+	return found;
+}				/* bgKill */
+
+/* Downloads live in this process, so let them finish before we exit.
+ * Interrupt gives up on them, they can be resumed later. */
+void waitDownloads(void)
+{
+	struct BG_JOB *j;
+	int pending;
+
+	if (!bg_jobs(true))
+		return;
+	while (true) {
+		if (intFlag) {
+			intFlag = false;
+			bgKill(0);
+		}
+		pending = 0;
+		pthread_mutex_lock(&down_mutex);
+		foreach(j, down_jobs) {
+			if (j->state == 4 || j->state == 5)
+				++pending;
+		}
+		pthread_mutex_unlock(&down_mutex);
+		if (!pending)
+			break;
+		usleep(200000);
+	}
+}				/* waitDownloads */
+
+#endif // #ifndef _MSC_VER // need pthreads
 
 static char **novs_hosts;
 size_t novs_hosts_avail;
@@ -2400,11 +3573,57 @@ const char *findProxyForURL(const char *url)
 static int frameExpandLine(int lineNumber);
 static int frameContractLine(int lineNumber);
 static const char *stringInBufLine(const char *s, const char *t);
+/* the frame tag on this line, if it is a frame that hasn't been fetched */
+static struct htmlTag *unfetchedFrame(int ln)
+{
+	pst line;
+	int tagno;
+	const char *s;
+	struct htmlTag *t;
+
+	line = fetchLine(ln, -1);
+	s = stringInBufLine(line, "Frame ");
+	if (!s || !(s = strchr(s, InternalCodeChar)))
+		return 0;
+	tagno = strtol(s + 1, (char **)&s, 10);
+	if (tagno < 0 || tagno >= cw->numTags || *s != '{')
+		return 0;
+	t = tagList[tagno];
+	if (t->action != TAGACT_FRAME || t->f1 || !t->href || !isURL(t->href))
+		return 0;
+	return t;
+}				/* unfetchedFrame */
+
+/*********************************************************************
+Expand or contract the frames in a range of lines.
+When expanding several frames, fetch them all at once first,
+and then parse and render them one at a time, in order, as before.
+A page of 10 frames takes about as long as its slowest frame.
+*********************************************************************/
+
 bool frameExpand(bool expand, int ln1, int ln2)
 {
 	int ln;			/* line number */
 	int problem = 0, p;
 	bool something_worked = false;
+	struct PREFETCH *list = 0;
+	struct htmlTag *t;
+	int n = 0;
+
+	if (expand) {
+		for (ln = ln1; ln <= ln2; ++ln)
+			if (unfetchedFrame(ln))
+				++n;
+		if (n >= 2) {
+			list = allocZeroMem(n * sizeof(struct PREFETCH));
+			n = 0;
+			for (ln = ln1; ln <= ln2; ++ln)
+				if ((t = unfetchedFrame(ln)))
+					list[n++].url = t->href;
+			prefetchURLs(list, n);
+			prefetchAhead(list, n);
+		}
+	}
 
 	for (ln = ln1; ln <= ln2; ++ln) {
 		if (expand)
@@ -2417,6 +3636,12 @@ bool frameExpand(bool expand, int ln1, int ln2)
 			something_worked = true;
 	}
 
+	if (list) {
+		prefetchAhead(0, 0);
+		freePrefetch(list, n);
+		free(list);
+	}
+
 	if (something_worked && problem < 3)
 		problem = 0;
 	if (problem == 1)
@@ -49,12 +49,43 @@ using namespace std;
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage:  edbrowse-js pipe_in pipe_out\n");
+	fprintf(stderr, "Usage:  edbrowse-js pipe_in pipe_out [ring]\n");
 	exit(1);
 }				/* usage */
 
 /* arguments, as indicated by the above */
 static int pipe_in, pipe_out;
+/* talking through shared memory, see ringAttach() in ebjs.c */
+static bool use_ring;
+/* running on a thread inside edbrowse, see jsThreadMain() in ebjs.c */
+static bool in_thread;
+
+static JSRuntime *jrt;		/* our js runtime environment */
+
+/* Edbrowse is gone, or asked us to go, or we can't go on.
+ * Every fatal path comes through here.
+ * A process just exits; a thread must not, that would take edbrowse with it.
+ * jsThreadExit() unwinds the thread, running the destructors on the stack,
+ * and then js_teardown() frees the runtime, see jsThreadMain() in ebjs.c. */
+static void hangup(int n)
+{
+	if (in_thread)
+		jsThreadExit();
+	exit(n);
+}				/* hangup */
+
+/* A process gives its memory back by exiting, a thread has to free
+ * the runtime, with its contexts, or every restart leaks a whole js pool. */
+void js_teardown(void)
+{
+	JSContext *iter, *c;
+	if (!jrt)
+		return;
+	while ((iter = 0, c = JS_ContextIterator(jrt, &iter)))
+		JS_DestroyContext(c);
+	JS_DestroyRuntime(jrt);
+	jrt = 0;
+}				/* js_teardown */
 
 /* Here is an instance of the edbrowse window that exists for parsing
  * html from inside javascript. It belongs to edbrowse-js,
@@ -94,7 +125,50 @@ static char *effects;
 static int eff_l;
 #define effectString(s) stringAndString(&effects, &eff_l, (s))
 #define effectChar(s) stringAndChar(&effects, &eff_l, (s))
-#define endeffect() effectString("`~@}\n");
+
+/*********************************************************************
+Side effects go back to edbrowse as binary records, see struct EJ_EFFECT.
+Begin a record, append its first string, call effectSplit() to move on
+to the next string, and endeffect() fills in the lengths.
+*********************************************************************/
+
+static int eff_rec;		/* where the current record starts */
+static int eff_str;		/* which of its strings we are building */
+static int eff_mark;		/* where that string starts */
+
+static void effectBegin(char type, char minor, int n,
+			const JSObject * o0, const JSObject * o1,
+			const JSObject * o2)
+{
+	struct EJ_EFFECT e;
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	e.minor = minor;
+	e.n = n;
+	e.obj[0] = (jsobjtype) o0;
+	e.obj[1] = (jsobjtype) o1;
+	e.obj[2] = (jsobjtype) o2;
+	eff_rec = eff_l;
+	stringAndBytes(&effects, &eff_l, (char *)&e, sizeof(e));
+	eff_str = 0;
+	eff_mark = eff_l;
+}				/* effectBegin */
+
+static void effectSplit(void)
+{
+	int len = eff_l - eff_mark;
+	memcpy(effects + eff_rec + offsetof(struct EJ_EFFECT, len) +
+	       eff_str * sizeof(int), &len, sizeof(int));
+	effectChar(0);
+	++eff_str;
+	eff_mark = eff_l;
+}				/* effectSplit */
+
+static void endeffect(void)
+{
+	while (eff_str < 3)
+		effectSplit();
+}				/* endeffect */
 
 /* pack the decoration of a tree into the effects string */
 static void packDecoration(void)
@@ -117,21 +191,40 @@ static char *membername;
 static char *propval;
 static enum ej_proptype proptype;
 static char *runscript;
+static char *batchdata;
+/* the worst error in a batch, held for the next reply */
+static enum ej_highstat batchhigh;
+static enum ej_lowstat batchlow;
+static int batchline;
 
 int js_main(int argc, char **argv)
 {
-	if (argc != 2)
+	if (argc != 2 && argc != 3)
 		usage();
 
 	pipe_in = stringIsNum(argv[0]);
 	pipe_out = stringIsNum(argv[1]);
 	if (pipe_in < 0 || pipe_out < 0)
 		usage();
+	in_thread = inJsThread();
+/* edbrowse hangs up the pipe if it goes away */
+	if (argc == 3 && !ringAttach(argv[2], pipe_in)) {
+/* edbrowse falls back to the pipe to read this */
+		fprintf(stderr, "js cannot attach to shared memory\n");
+		head.highstat = EJ_HIGH_PROC_FAIL;
+		head.lowstat = EJ_LOW_EXEC;
+		writeHeader();
+		hangup(2);
+	}
+	use_ring = (argc == 3);
 
-	readConfigFile();
-	setupEdbrowseCache();
-	eb_curl_global_init();
-	cookiesFromJar();
+/* A thread shares all this with edbrowse, which has already done it. */
+	if (!in_thread) {
+		readConfigFile();
+		setupEdbrowseCache();
+		eb_curl_global_init();
+		cookiesFromJar();
+	}
 	pluginsOn = false;
 	sendReferrer = false;
 	cw = &in_js_cw;
@@ -143,7 +236,8 @@ int js_main(int argc, char **argv)
 /* edbrowse catches interrupt, this process ignores it. */
 /* Use quit to terminate, or kill from another console. */
 /* If edbrowse quits then this process also quits via broken pipe. */
-	signal(SIGINT, SIG_IGN);
+	if (!in_thread)
+		signal(SIGINT, SIG_IGN);
 
 	effects = initString(&eff_l);
 
@@ -154,7 +248,7 @@ int js_main(int argc, char **argv)
 		head.side = head.msglen = 0;
 
 		if (head.cmd == EJ_CMD_EXIT)
-			exit(0);
+			hangup(0);
 
 		if (head.cmd == EJ_CMD_CREATE) {
 /* this one is special */
@@ -212,11 +306,16 @@ static void readFromEb(void *data_p, int n)
 	unsigned char *bytes_p = (unsigned char *)data_p;
 	if (n == 0)
 		return;
+	if (use_ring) {
+		if (ringRead(data_p, n))
+			hangup(2);
+		return;
+	}
 	while (n > 0) {
 		rc = read(pipe_in, bytes_p, n);
 		if (rc <= 0) {
 /* Oops - can't read from the process any more */
-			exit(2);
+			hangup(2);
 		}
 		n -= rc;
 		bytes_p += rc;
@@ -228,17 +327,29 @@ static void writeToEb(const void *data_p, int n)
 	int rc;
 	if (n == 0)
 		return;
+	if (use_ring) {
+		if (!ringWrite(data_p, n))
+			return;
+		fprintf(stderr, "js cannot communicate with edbrowse\n");
+		hangup(2);
+	}
 	rc = write(pipe_out, data_p, n);
 	if (rc == n)
 		return;
 /* Oops - can't write to the process any more */
 	fprintf(stderr, "js cannot communicate with edbrowse\n");
-	exit(2);
+	hangup(2);
 }				/* writeToEb */
 
 static void writeHeader(void)
 {
 	head.magic = EJ_MAGIC;
+	if (batchhigh > head.highstat) {
+		head.highstat = batchhigh;
+		head.lowstat = batchlow;
+		head.lineno = batchline;
+	}
+	batchhigh = EJ_HIGH_OK;
 	head.side = eff_l;
 	head.msglen = 0;
 	if (errorMessage)
@@ -287,7 +398,7 @@ static void readMessage(void)
 	if (head.magic != EJ_MAGIC) {
 		fprintf(stderr,
 			"Messages between js and edbrowse are out of sync\n");
-		exit(3);
+		hangup(3);
 	}
 
 	cmd = head.cmd;
@@ -298,6 +409,11 @@ static void readMessage(void)
 			runscript = readString(head.proplength);
 	}
 
+	if (cmd == EJ_CMD_BATCH) {
+		if (head.proplength)
+			batchdata = readString(head.proplength);
+	}
+
 	if (cmd == EJ_CMD_HASPROP ||
 	    cmd == EJ_CMD_GETPROP ||
 	    cmd == EJ_CMD_CALL ||
@@ -317,7 +433,6 @@ static void readMessage(void)
 /* and that's the whole message */
 }				/* readMessage */
 
-static JSRuntime *jrt;		/* our js runtime environment */
 static const size_t gStackChunkSize = 8192;
 
 static void js_start(void)
@@ -332,7 +447,7 @@ static void js_start(void)
 	head.highstat = EJ_HIGH_PROC_FAIL;
 	head.lowstat = EJ_LOW_RUNTIME;
 	writeHeader();
-	exit(4);
+	hangup(4);
 }				/* js_start */
 
 static void misconfigure(int n)
@@ -533,7 +648,7 @@ static JSClass window_class = {
 };
 
 /* the window constructor can open a new window, a new edbrowse session. */
-/* This is done by setting n{url} in the effects string */
+/* This is done by sending back an n effect with the url */
 static JSBool window_ctor(JSContext * cx, unsigned int argc, jsval * vp)
 {
 	const char *newloc = 0;
@@ -559,9 +674,10 @@ static JSBool window_ctor(JSContext * cx, unsigned int argc, jsval * vp)
  * I only do something if opening a new web page.
  * If it's just a blank window, I don't know what to do with that. */
 	if (newloc && *newloc) {
-		effectString("n{p");	// }
+		effectBegin('n', 0, 0, 0, 0, 0);
+		effectChar('p');
 		effectString(newloc);
-		effectChar('\n');
+		effectSplit();
 		if (winname)
 			effectString(winname);
 		endeffect();
@@ -738,9 +854,9 @@ setter_loc(JSContext * cx, JS::HandleObject uo, JS::Handle < jsid > id,
 		JS_ReportError(jcx,
 			       "window.location is assigned something that I don't understand");
 	} else {
-		effectString("n{r");	// }
+		effectBegin('n', 0, 0, 0, 0, 0);
+		effectChar('r');
 		effectString(s);
-		effectChar('\n');
 		endeffect();
 	}
 	debugPrint(5, "return");
@@ -761,9 +877,9 @@ setter_loc_hrefval(JSContext * cx, JS::HandleObject uo,
 	debugPrint(5, "setter location href");
 	url = stringize(vp);
 	if (url && iswindocloc(uo)) {
-		effectString("n{r");	// }
+		effectBegin('n', 0, 0, 0, 0, 0);
+		effectChar('r');
 		effectString(url);
-		effectChar('\n');
 		endeffect();
 		debugPrint(5, "return abort");
 		return JS_FALSE;
@@ -905,9 +1021,7 @@ setter_value(JSContext * cx, JS::HandleObject obj,
 		JS_ReportError(jcx,
 			       "input.value is assigned something other than a string; this can cause problems when you submit the form.");
 	} else {
-		effectString("v{");	// }
-		effectString(pointer2string(*obj.address()));
-		effectChar('=');
+		effectBegin('v', 0, 0, *obj.address(), 0, 0);
 		effectString(val);
 		endeffect();
 	}
@@ -933,10 +1047,9 @@ setter_innerHTML(JSContext * cx, JS::HandleObject obj,
 		JS_SetArrayLength(jcx, children, 0);
 
 	int begin;
-	effectString("i{h");	// }
-	effectString(pointer2string(obj));
-	begin = eff_l + 1;
-	effectString("|<!DOCTYPE public><body>\n");
+	effectBegin('i', 'h', 0, obj, 0, 0);
+	begin = eff_l;
+	effectString("<!DOCTYPE public><body>\n");
 	effectString(s);
 	if (*s && s[strlen(s) - 1] != '\n')
 		effectChar('\n');
@@ -944,7 +1057,7 @@ setter_innerHTML(JSContext * cx, JS::HandleObject obj,
 	cwSetup();
 	jsobjtype innerParent = obj;
 	html_from_setter(innerParent, effects + begin);
-	effectChar('@');
+	effectSplit();
 	packDecoration();
 	cwBringdown();
 	endeffect();
@@ -961,9 +1074,7 @@ setter_innerText(JSContext * cx, JS::HandleObject obj,
 	const char *s = stringize(vp);
 	if (!s)
 		s = emptyString;
-	effectString("i{t");	// }
-	effectString(pointer2string(obj));
-	effectChar('|');
+	effectBegin('i', 't', 0, obj, 0, 0);
 	effectString(s);
 	endeffect();
 	debugPrint(5, "return");
@@ -1008,7 +1119,7 @@ static bool foldinCookie(const char *newcook)
 	}
 
 /* pass back to edbrowse */
-	effectString("c{");	// }
+	effectBegin('c', 0, 0, 0, 0, 0);
 	effectString(newcook);
 	endeffect();
 
@@ -1378,15 +1489,10 @@ static JSBool appendChild0(bool side, JSContext * cx, unsigned int argc,
 		return JS_TRUE;
 
 /* pass this linkage information back to edbrowse, to update its dom tree */
-	char e[40];
-	sprintf(e, "l{a|%s,", pointer2string(thisobj));
-	effectString(e);
+	effectBegin('l', 'a', 0, thisobj, child, 0);
 	embedNodeName(thisobj);
-	effectChar(' ');
-	effectString(pointer2string(child));
-	effectChar(',');
+	effectSplit();
 	embedNodeName(child);
-	effectString(" 0x0, ");
 	endeffect();
 	return JS_TRUE;
 }				/* appendChild0 */
@@ -1479,19 +1585,12 @@ static JSBool insbf(JSContext * cx, unsigned int argc, jsval * vp)
 			  NULL, NULL, PROP_STD);
 
 /* pass this linkage information back to edbrowse, to update its dom tree */
-	char e[40];
-	sprintf(e, "l{b|%s,", pointer2string(thisobj));
-	effectString(e);
+	effectBegin('l', 'b', 0, thisobj, child, item);
 	embedNodeName(thisobj);
-	effectChar(' ');
-	effectString(pointer2string(child));
-	effectChar(',');
+	effectSplit();
 	embedNodeName(child);
-	effectChar(' ');
-	effectString(pointer2string(item));
-	effectChar(',');
+	effectSplit();
 	embedNodeName(item);
-	effectChar(' ');
 	endeffect();
 	debugPrint(5, "return");
 	return JS_TRUE;
@@ -1550,15 +1649,10 @@ found:
 	JS_DeleteProperty(cx, child, "parentNode");
 
 /* pass this linkage information back to edbrowse, to update its dom tree */
-	char e[40];
-	sprintf(e, "l{r|%s,", pointer2string(thisobj));
-	effectString(e);
+	effectBegin('l', 'r', 0, thisobj, child, 0);
 	embedNodeName(thisobj);
-	effectChar(' ');
-	effectString(pointer2string(child));
-	effectChar(',');
+	effectSplit();
 	embedNodeName(child);
-	effectString(" 0x0, ");
 	endeffect();
 	debugPrint(5, "return");
 	return JS_TRUE;
@@ -1567,11 +1661,10 @@ found:
 static void dwrite1(unsigned int argc, jsval * argv, bool newline)
 {
 	debugPrint(5, "document write");
-	int i, begin;
+	int i;
 	const char *msg;
 	JS::RootedString str(jcx);
-	effectString("w{");	// }
-	begin = eff_l;
+	effectBegin('w', 0, 0, 0, 0, 0);
 	for (i = 0; i < (signed)argc; ++i) {
 		if ((str = JS_ValueToString(jcx, argv[i])) &&
 		    (msg = JS_c_str(str))) {
@@ -1636,8 +1729,8 @@ fail:
 			  JS_GetEmptyStringValue(cx),
 			  NULL, setter_innerHTML, PROP_STD);
 /* But we can't set innerHTML unless the object exists in edbrowse */
-	sprintf(run, "l{c|%s,%s 0x0, 0x0, ", pointer2string(child), tagname);
-	effectString(run);
+	effectBegin('l', 'c', 0, child, 0, 0);
+	effectString(tagname);
 	endeffect();
 
 /* and return the created object */
@@ -1773,8 +1866,7 @@ static JSBool form_submit(JSContext * cx, unsigned int argc, jsval * vp)
 {
 	debugPrint(5, "form submit");
 	JS::RootedObject obj(cx, JS_THIS_OBJECT(cx, vp));
-	effectString("f{s");	// }
-	effectString(pointer2string(obj));
+	effectBegin('f', 's', 0, obj, 0, 0);
 	endeffect();
 	JS::CallArgs args = JS::CallArgsFromVp(argc, vp);
 	args.rval().set(JSVAL_VOID);
@@ -1786,8 +1878,7 @@ static JSBool form_reset(JSContext * cx, unsigned int argc, jsval * vp)
 {
 	debugPrint(5, "form reset");
 	JS::RootedObject obj(cx, JS_THIS_OBJECT(cx, vp));
-	effectString("f{r");	// }
-	effectString(pointer2string(obj));
+	effectBegin('f', 'r', 0, obj, 0, 0);
 	endeffect();
 	JS::CallArgs args = JS::CallArgsFromVp(argc, vp);
 	args.rval().set(JSVAL_VOID);
@@ -1874,7 +1965,7 @@ static JSBool win_prompt(JSContext * cx, unsigned int argc, jsval * vp)
 		printf("[%s] ", answer);
 	fflush(stdout);
 	if (!fgets(inbuf, sizeof(inbuf), stdin))
-		exit(5);
+		hangup(5);
 	s = inbuf + strlen(inbuf);
 	if (s > inbuf && s[-1] == '\n')
 		*--s = 0;
@@ -1919,7 +2010,7 @@ static JSBool win_confirm(JSContext * cx, unsigned int argc, jsval * vp)
 		first = false;
 		fflush(stdout);
 		if (!fgets(inbuf, sizeof(inbuf), stdin))
-			exit(5);
+			hangup(5);
 		c = *inbuf;
 		if (c && strchr("nNyY", c))
 			break;
@@ -1942,7 +2033,6 @@ static JSObject *setTimeout(unsigned int argc, jsval * argv, bool isInterval)
 // the function object, to execute, and the timer object.
 	JS::RootedObject fo(jcx, 0), to(jcx);
 	int n;			/* number of milliseconds */
-	char nstring[20];
 	char fname[48];		/* function name */
 	const char *fstr;	/* function string */
 	const char *methname = (isInterval ? "setInterval" : "setTimeout");
@@ -2033,13 +2123,8 @@ abort:
 			fstr = fname;
 		}
 
-		sprintf(nstring, "t{%d|", n);	// }
-		effectString(nstring);
+		effectBegin('t', (isInterval ? '1' : '0'), n, to, 0, 0);
 		effectString(fstr);
-		effectChar('|');
-		effectString(pointer2string(to));
-		effectChar('|');
-		effectChar((isInterval ? '1' : '0'));
 		endeffect();
 
 		debugPrint(5, "return");
@@ -2082,9 +2167,8 @@ static JSBool clearTimeout(JSContext * cx, unsigned int argc, jsval * vp)
 	if (argc == 0 || !args[0].isObject())
 		return JS_TRUE;
 	JS::RootedObject obj(jcx, JSVAL_TO_OBJECT(args[0]));
-	char nstring[80];
-	sprintf(nstring, "t{0|-|%s|0", pointer2string(obj));	// }
-	effectString(nstring);
+	effectBegin('t', '0', 0, obj, 0, 0);
+	effectString("-");
 	endeffect();
 	debugPrint(5, "return");
 	return JS_TRUE;
@@ -2231,7 +2315,7 @@ static JSClass *classByName(const char *classname)
 	if (!cp) {
 		fprintf(stderr, "Unexpected class name %s from edbrowse\n",
 			classname);
-		exit(8);
+		hangup(8);
 	}
 	return cp;
 }				/* classByName */
@@ -2308,7 +2392,7 @@ childreturn:
 	default:
 		fprintf(stderr, "Unexpected property type %d from edbrowse\n",
 			proptype);
-		exit(7);
+		hangup(7);
 	}
 
 }				/* set_property_generic */
@@ -2427,7 +2511,7 @@ static JSObject *get_array_element_object1(JS::HandleObject parent, int idx)
 		return 0;	/* perhaps out of range */
 	if (!v.isObject()) {
 		fprintf(stderr, "JS DOM arrays should contain only objects\n");
-		exit(9);
+		hangup(9);
 	}
 	child = JSVAL_TO_OBJECT(v);
 	return child;
@@ -2504,6 +2588,76 @@ static char *run_function(JS::HandleObject parent, const char *name)
 }				/* run_function */
 
 /* process each message from edbrowse and respond appropriately */
+/* Run the operations of an EJ_CMD_BATCH message, see ebjs.h.
+ * These are the set and delete cases below, without the replies. */
+static void runBatch(void)
+{
+	struct EJ_OP op;
+	const char *s = batchdata;
+	const char *end = batchdata + head.proplength;
+	JS::RootedObject parent(jcx);
+	JS::RootedObject child(jcx);
+	int i;
+
+	for (i = 0; i < head.n && s + sizeof(op) <= end; ++i) {
+		memcpy(&op, s, sizeof(op));
+		s += sizeof(op);
+		if (s + op.namelength + op.proplength > end) {
+			fprintf(stderr,
+				"Messages between js and edbrowse are out of sync\n");
+			hangup(3);
+		}
+		membername = propval = 0;
+		if (op.namelength) {
+			membername = allocString(op.namelength + 1);
+			memcpy(membername, s, op.namelength);
+			membername[op.namelength] = 0;
+			s += op.namelength;
+		}
+		if (op.proplength) {
+			propval = allocString(op.proplength + 1);
+			memcpy(propval, s, op.proplength);
+			propval[op.proplength] = 0;
+			s += op.proplength;
+		}
+		proptype = op.proptype;
+		parent = (JSObject *) op.obj;
+
+		switch (op.cmd) {
+		case EJ_CMD_SETPROP:
+			setter_suspend = true;
+			set_property_generic(parent, membername);
+			setter_suspend = false;
+			break;
+
+		case EJ_CMD_DELPROP:
+			JS_DeleteProperty(jcx, parent, membername);
+			break;
+
+		case EJ_CMD_SETAREL:
+			if (proptype == EJ_PROP_OBJECT && propval) {
+				child = string2pointer(propval);
+				set_array_element_object1(parent, op.n, child);
+			}
+			break;
+
+		default:
+			fprintf(stderr,
+				"Unexpected batch command %d from edbrowse\n",
+				op.cmd);
+			hangup(6);
+		}
+
+		nzFree(membername);
+		membername = 0;
+		nzFree(propval);
+		propval = 0;
+	}
+
+	nzFree(batchdata);
+	batchdata = 0;
+}				/* runBatch */
+
 static void processMessage(void)
 {
 	JSAutoRequest autoreq(jcx);
@@ -2692,9 +2846,19 @@ propreturn:
 		propval = 0;
 		break;
 
+	case EJ_CMD_BATCH:
+		runBatch();
+/* no reply, so hold on to any error until there is one */
+		if (head.highstat > batchhigh) {
+			batchhigh = head.highstat;
+			batchlow = head.lowstat;
+			batchline = head.lineno;
+		}
+		break;
+
 	default:
 		fprintf(stderr, "Unexpected message command %d from edbrowse\n",
 			head.cmd);
-		exit(6);
+		hangup(6);
 	}
 }				/* processMessage */
@@ -15,7 +15,7 @@
 const char *progname;
 const char eol[] = "\r\n";
 const char *version = "3.6.3+";
-char *changeFileName;
+THREADLOCAL char *changeFileName;
 char *configFile, *addressFile, *cookieFile;
 char *mailDir, *mailUnread, *mailStash, *mailReply;
 char *recycleBin, *sigFile, *sigFileEnd;
@@ -24,10 +24,12 @@ int cacheSize = 1000, cacheCount = 10000;
 char *ebTempDir, *ebUserDir;
 char *userAgents[10];
 char *currentAgent, *currentReferrer;
-bool allowRedirection = true, allowJS = true, sendReferrer = true;
+bool allowRedirection = true, allowJS = true;
+THREADLOCAL bool sendReferrer = true;
 bool allowXHR = true;
 bool ftpActive;
 int jsPool = 32;
+int undoDepth = 1;
 int webTimeout = 20, mailTimeout = 0;
 int displayLength = 500;
 int verifyCertificates = 1;
@@ -60,7 +62,7 @@ static struct DBTABLE dbtables[MAXDBT];
 static int numTables;
 volatile bool intFlag;
 bool ismc, isimap, passMail;
-char whichproc = 'e';		// edbrowse
+THREADLOCAL char whichproc = 'e';	// edbrowse
 bool inInput, listNA;
 int fileSize;
 char *dbarea, *dblogin, *dbpw;	/* to log into the database */
@@ -315,6 +317,11 @@ void eb_curl_global_init(void)
 			  CURL_LOCK_DATA_DNS);
 	curl_share_setopt(global_share_handle, CURLSHOPT_SHARE,
 			  CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+/* open connections too, so any handle can pick up where another left off */
+	curl_share_setopt(global_share_handle, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_CONNECT);
+#endif
 
 	global_http_handle = curl_easy_init();
 	if (global_http_handle == NULL)
@@ -351,13 +358,14 @@ libcurl_init_fail:
 
 static void eb_curl_global_cleanup(void)
 {
+	http_curl_cleanup_pool();
 	curl_easy_cleanup(global_http_handle);
 	curl_global_cleanup();
 }				/* eb_curl_global_cleanup */
 
 void ebClose(int n)
 {
-	bg_jobs(true);
+	waitDownloads();
 	dbClose();
 	js_shutdown();
 	eb_curl_global_cleanup();
@@ -1053,6 +1061,7 @@ void unreadConfigFile(void)
 	webTimeout = mailTimeout = 0;
 	displayLength = 500;
 	jsPool = 32;
+	undoDepth = 1;
 
 	setDataSource(NULL);
 	setHTTPLanguage(NULL);
@@ -1075,7 +1084,8 @@ static const char *const keywords[] = {
 	"jar", "nojs", "cachedir",
 	"webtimer", "mailtimer", "certfile", "datasource", "proxy",
 	"linelength", "localizeweb", "jspool", "novs", "cachesize",
-	"adbook", 0
+	"adbook", "undodepth", "cachecount", "downmax", "downrate",
+	"downsegments", "jsthread", 0
 };
 
 /* Read the config file and populate the corresponding data structures. */
@@ -1608,8 +1618,8 @@ putc:
 			cacheSize = atoi(v);
 			if (cacheSize <= 0)
 				cacheSize = 0;
-			if (cacheSize >= 10000)
-				cacheSize = 10000;
+			if (cacheSize >= 1000000)
+				cacheSize = 1000000;
 			continue;
 
 		case 36:	/* adbook */
@@ -1619,6 +1629,48 @@ putc:
 				cfgAbort1(MSG_EBRC_AbNotFile, v);
 			continue;
 
+		case 37:	/* undodepth */
+			undoDepth = atoi(v);
+			if (undoDepth < 1)
+				undoDepth = 1;
+			if (undoDepth > 1000)
+				undoDepth = 1000;
+			continue;
+
+		case 38:	/* cachecount */
+			cacheCount = atoi(v);
+			if (cacheCount < 100)
+				cacheCount = 100;
+			if (cacheCount > 10000000)
+				cacheCount = 10000000;
+			continue;
+
+		case 39:	/* downmax */
+			downMax = atoi(v);
+			if (downMax < 1)
+				downMax = 1;
+			if (downMax > 20)
+				downMax = 20;
+			continue;
+
+		case 40:	/* downrate */
+			downRate = atol(v);
+			if (downRate < 0)
+				downRate = 0;
+			continue;
+
+		case 41:	/* downsegments */
+			downSegments = atoi(v);
+			if (downSegments < 1)
+				downSegments = 1;
+			if (downSegments > MAXSEGMENTS)
+				downSegments = MAXSEGMENTS;
+			continue;
+
+		case 42:	/* jsthread */
+			jsThread = (stringEqualCI(v, "on") || stringEqual(v, "1"));
+			continue;
+
 		default:
 			cfgLine1(MSG_EBRC_KeywordNYI, s);
 		}		/* switch */
@@ -757,4 +757,7 @@ enum {
 	MSG_JSSessionFail,
 	MSG_SystemCmdFail,
 	MSG_notused659,
+	MSG_NoRedo,
+	MSG_NoDownJob,
+	MSG_DownResume,
 };
@@ -238,6 +238,30 @@ void stringAndBytes(char **s, int *l, const char *t, int cnt)
 	p[oldlen + cnt] = 0;
 }				/* stringAndBytes */
 
+/* Make room for cnt more bytes and return where they go,
+ * so the caller can read them in place, rather than copy them in. */
+char *stringAndRoom(char **s, int *l, int cnt)
+{
+	char *p = *s;
+	int oldlen, newlen, x;
+	oldlen = *l;
+	newlen = oldlen + cnt;
+	*l = newlen;
+	++newlen;
+	x = oldlen ^ newlen;
+	if (x > oldlen) {	/* must realloc */
+		newlen |= (newlen >> 1);
+		newlen |= (newlen >> 2);
+		newlen |= (newlen >> 4);
+		newlen |= (newlen >> 8);
+		newlen |= (newlen >> 16);
+		p = reallocString(p, newlen);
+		*s = p;
+	}
+	p[oldlen + cnt] = 0;
+	return p + oldlen;
+}				/* stringAndRoom */
+
 void stringAndChar(char **s, int *l, char c)
 {
 	char *p = *s;